@@ -0,0 +1,53 @@
+#ifndef MATH_DISTRIBUTION_HPP
+#define MATH_DISTRIBUTION_HPP
+
+#include <vector>
+
+#include "float.hpp"
+#include "vector.hpp"
+
+namespace math {
+  /*
+   * Piecewise-constant distribution over [0, 1) from non-negative function values at n
+   * equally sized segments
+   */
+  class distribution1d {
+    private:
+      std::vector<Float> func;
+      std::vector<Float> cdf;
+      Float integral = 0;
+
+    public:
+      distribution1d() {}
+      distribution1d(const Float* values, int n);
+
+      int size() const;
+      Float total() const;
+
+      // x from u, pdf is per unit x, offset is the segment x falls in
+      Float sample(Float u, Float* pdf, int* offset = nullptr) const;
+      Float pdf(Float x) const;
+  };
+
+  /*
+   * Piecewise-constant distribution over [0, 1)^2 from an nu x nv grid of values stored row by
+   * row, v is drawn from the marginal of the rows and u from the row it picked
+   */
+  class distribution2d {
+    private:
+      std::vector<distribution1d> conditional;
+      distribution1d marginal;
+
+    public:
+      distribution2d() {}
+      distribution2d(const Float* values, int nu, int nv);
+
+      bool empty() const;
+
+      // pdf is per unit area of [0, 1)^2
+      point2f sample(const point2f& u, Float* pdf) const;
+      Float pdf(const point2f& p) const;
+  };
+} /* namespace math */
+
+#endif /* MATH_DISTRIBUTION_HPP */
@@ -47,8 +47,9 @@ namespace math {
   }
 
   inline Float logistic_pdf(Float s, Float x) {
+    // symmetric, evaluating at |x| keeps exp from overflowing for narrow distributions
     Float inv_s = 1.f / s;
-    Float ex = std::exp(-x * inv_s);
+    Float ex = std::exp(-std::abs(x) * inv_s);
     return ex / (pow2(1 + ex)) * inv_s;
   }
 
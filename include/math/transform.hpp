@@ -1,6 +1,8 @@
 #ifndef MATH_TRANSFORM_HPP
 #define MATH_TRANSFORM_HPP
 
+#include <memory>
+
 #include "math/quaternion.hpp"
 #include "tracer/ray.hpp"
 #include "tracer/bounds.hpp"
@@ -34,6 +36,43 @@ namespace math {
         bounds3f  operator()(const bounds3f& b) const;
     };
 
+    // Reference-counted handle to an interned transform. Equal transforms share one copy, so
+    // all primitives of an object carry a pointer instead of their own matrices, and identity
+    // or translation-only transforms skip the matrix products altogether.
+    class shared_transform {
+      public:
+        enum kind { IDENTITY, TRANSLATION, GENERAL };
+
+      private:
+        struct entry {
+          transform tf;
+          kind type;
+          vector3f offset; // translation of tf
+        };
+
+        std::shared_ptr<const entry> shared;
+        bool inverted = false;
+
+        static std::shared_ptr<const entry> intern(const transform& tf);
+
+      public:
+        shared_transform();
+        shared_transform(const transform& tf);
+
+        kind type() const { return shared->type; }
+        // distances are the same on both sides of the transform
+        bool preserves_length() const { return shared->type != GENERAL; }
+
+        transform get() const;
+        shared_transform inverse() const;
+
+        vector3f  operator()(const vector3f& v) const;
+        point3f   operator()(const point3f& p) const;
+        normal3f  operator()(const normal3f& n) const;
+        ray       operator()(const ray& r) const;
+        bounds3f  operator()(const bounds3f& b) const;
+    };
+
     vector3f apply(const matrix4f& tf_mat, const vector3f& pt);
     point3f apply(const matrix4f& tf_mat, const point3f& pt);
     normal3f apply_normal(const matrix4f& tf_mat, const vector3f& normal);
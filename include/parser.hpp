@@ -2,9 +2,11 @@
 #define PARSER_HPP
 
 #include <string>
+#include <future>
 #include <yaml-cpp/yaml.h>
 
 #include "tracer/scene.hpp"
+#include "tracer/materials/sss.hpp"
 
 class parser {
   private:
@@ -27,23 +29,29 @@ class parser {
     tracer::material::transport_type parse_transport_model(
         const YAML::Node& node, const std::string& name);
     std::shared_ptr<tracer::material> parse_material(const YAML::Node& mat_node);
+    std::shared_ptr<tracer::material> parse_scattering(const YAML::Node& mat_node);
     std::shared_ptr<tracer::shape> parse_shape(const YAML::Node& attr, const std::string& name);
     std::unique_ptr<tracer::camera::camera> parse_camera(
         const YAML::Node& cam_node, const math::vector2i& img_res, math::point3f* eye_position);
     void parse_model(
-        std::vector<std::shared_ptr<tracer::shape>>& shapes,
+        tracer::primitive_arena<tracer::shapes::triangle>& triangles,
         const YAML::Node& model_node
         );
-    bvh_tree* parse_hair(
-        std::vector<std::shared_ptr<tracer::shape>>& shapes,
+    tracer::hair_job parse_hair(
         const YAML::Node& hair_node,
-        uintptr_t* hair_id
+        const math::point3f& eye_position
         );
+    unsigned int parse_visibility(const YAML::Node& object_node);
+    RTCBuildQuality parse_build_quality(const YAML::Node& node, const std::string& name);
+    tracer::materials::sss::walk_mode parse_walk_mode(
+        const YAML::Node& node, const std::string& name);
 
   public:
 
     parser();
 
+    static RTCBuildQuality to_build_quality(const std::string& quality);
+
     std::shared_ptr<tracer::scene> load_scene(
         const std::string& file,
         tracer::render_params* params
@@ -0,0 +1,51 @@
+#ifndef THREAD_BUDGET_HPP
+#define THREAD_BUDGET_HPP
+
+#include <atomic>
+#include <future>
+#include <thread>
+
+/*
+ * Process-wide limit on the number of threads doing work at the same time.
+ * The calling thread always counts as one, so a budget of n allows n - 1 extra threads.
+ */
+class thread_budget {
+  private:
+    std::atomic<int> n_available;
+    int n_threads;
+
+    struct slot_guard {
+      thread_budget* budget;
+      ~slot_guard() { ++budget->n_available; }
+    };
+
+  public:
+    thread_budget(int n_threads = std::thread::hardware_concurrency());
+
+    static thread_budget& global();
+
+    void resize(int n_threads);
+    int size() const;
+
+    // Take up to n free slots for threads started outside dispatch(), returns how many were taken
+    int reserve(int n);
+    void release(int n);
+
+    /*
+     * Run task on a new thread if a slot is free. Otherwise the task is deferred and runs on
+     * whichever thread waits for the returned future.
+     */
+    template <typename F>
+      auto dispatch(F&& task) -> std::future<decltype(task())> {
+        if (--n_available < 0) {
+          ++n_available;
+          return std::async(std::launch::deferred, std::forward<F>(task));
+        }
+        return std::async(std::launch::async, [this, task]() {
+            slot_guard guard{ this };
+            return task();
+            });
+      }
+};
+
+#endif /* THREAD_BUDGET_HPP */
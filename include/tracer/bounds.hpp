@@ -201,12 +201,16 @@ namespace tracer {
       }
 
       bool intersect(const ray& r) const {
+        // widen the far distance by the rounding error of the slab test (2 * gamma(3)) so
+        // that rays grazing a box, e.g. on a mesh edge shared with a flat box, are not culled
+        constexpr Float robust_scale = 1 + 4 * std::numeric_limits<Float>::epsilon();
         Float t_near, t_far;
         Float t0 = 0, t1 = r.t_max;
         for (int dim = 0; dim < 3; ++dim) {
           t_near  = (p_min[dim] - r.origin[dim]) * r.inv_dir[dim];
           t_far   = (p_max[dim] - r.origin[dim]) * r.inv_dir[dim];
           if (t_near > t_far) std::swap(t_near, t_far);
+          t_far *= robust_scale;
           t0 = std::max(t0, t_near);
           t1 = std::min(t1, t_far);
           if (t0 > t1) return false;
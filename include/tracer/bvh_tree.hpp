@@ -2,25 +2,33 @@
 #define TRACER_BVH_TREE_HPP
 
 #include "shape.hpp"
-#include <thread>
-#include <mutex>
+#include "shapes/triangle.hpp"
+#include <future>
 
 namespace tracer {
+  namespace shapes {
+    class cubic_bezier;
+  }
+
   class bvh_tree {
     private:
       struct bvh_node {
         bounds3f bounds;
         std::shared_ptr<bvh_node> children[2] = { nullptr, nullptr };
-        std::vector<std::shared_ptr<shape>> shapes;
+        uint32_t shapes_offset = 0, shapes_count = 0;     // leaf shapes other than triangles
+        std::vector<shapes::triangle_packet> triangles;  // leaf triangles, tested packet-wise
         int split_dim = -1;
+        unsigned int visibility = 0; // union of the subtree's shape visibilities
       };
 
-      int n_available_workers;
-
       std::shared_ptr<bvh_node> root;
 
+      // Non-owning, reordered during construction so that leaves refer to ranges of it. Leaves
+      // mix parsed shapes with triangles and curves from several arenas, so they are kept as
+      // pointers rather than 32-bit arena indices.
+      std::vector<shape*> shapes;
+
       std::shared_ptr<bvh_node> construct_tree(
-          std::vector<std::shared_ptr<shape>>& shapes,
           int start,
           int end,
           std::shared_ptr<bvh_node>* ret_node = nullptr
@@ -32,7 +40,8 @@ namespace tracer {
           const std::shared_ptr<bvh_node>& node,
           const ray& r,
           const shape::intersect_opts& options,
-          shape::intersect_result* result
+          shape::intersect_result* result,
+          const shapes::cubic_bezier* strand
           ) const;
 
       bool occluded(
@@ -41,20 +50,16 @@ namespace tracer {
           const shape::intersect_opts& options
           ) const;
 
-      std::thread* dispatch_construction(
-          std::vector<std::shared_ptr<shape>>& shapes,
+      std::future<std::shared_ptr<bvh_node>> dispatch_construction(
           int start,
           int end,
           std::shared_ptr<bvh_node>* ret_node = nullptr
           );
 
-      void wait_worker(std::thread* worker);
-
-      bool workers_available() const;
-
     public:
       bvh_tree() {};
-      bvh_tree(std::vector<std::shared_ptr<shape>> shapes);
+      // The shapes are owned by the caller and must outlive the tree
+      bvh_tree(std::vector<shape*> shapes);
 
       size_t n_shapes() const;
 
@@ -64,6 +69,14 @@ namespace tracer {
           shape::intersect_result* result
           ) const;
 
+      // Only report hits on curves lying on the same hair strand as strand
+      bool intersect(
+          const ray& r,
+          const shape::intersect_opts& options,
+          shape::intersect_result* result,
+          const shapes::cubic_bezier* strand
+          ) const;
+
       bool occluded(
           const ray& r, 
           const shape::intersect_opts& options
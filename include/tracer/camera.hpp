@@ -14,6 +14,9 @@ namespace tracer {
         camera(const tf::transform& cam_to_world) : tf_cam_to_world(cam_to_world) {}
 
         virtual ray generate_ray(const point2f& img_point) const = 0;
+
+        // World-space height of one pixel at p
+        virtual Float pixel_footprint(const point3f& p) const = 0;
     };
 
     class projective : public camera {
@@ -49,6 +52,7 @@ namespace tracer {
             );
 
         ray generate_ray(const point2f& img_point) const override;
+        Float pixel_footprint(const point3f& p) const override;
     };
 
     class persp : public projective {
@@ -69,6 +73,7 @@ namespace tracer {
             );
 
         ray generate_ray(const point2f& img_point) const override;
+        Float pixel_footprint(const point3f& p) const override;
     };
   } /* namespace camera */
 } /* namespace tracer */
@@ -7,29 +7,111 @@
 
 #include "ray.hpp"
 #include "shapes/cubic_bezier.hpp"
+#include "primitive_arena.hpp"
 
 namespace tracer {
   class embree_accel {
+    public:
+      struct device_config {
+        int n_threads                 = 0; // 0 takes every free slot of the thread budget
+        bool set_affinity             = false;
+        RTCBuildQuality build_quality = RTC_BUILD_QUALITY_HIGH;
+        bool compact                  = false;
+        bool robust                   = false;
+        bool count_hits               = false; // needed by count_hits()
+      };
+
+      // How a hair object is handed to Embree
+      enum curve_basis {
+        BEZIER,       // one flat cubic bezier geometry per curve
+        ROUND_LINEAR, // tessellated into round linear segments
+        FLAT_LINEAR   // tessellated into ray-facing linear segments
+      };
+
     private:
       bool valid = false;
-      RTCDevice embree_device;
-      RTCScene embree_scene;
+      RTCDevice embree_device = nullptr;
+      RTCScene embree_scene = nullptr;
+      RTCBuildQuality build_quality = RTC_BUILD_QUALITY_HIGH;
+      // thread budget slots held for the device threads until the commit
+      int budget_slots = 0;
 
       const unsigned int curve_indices[4] = { 0, 1, 2, 3 };
-      std::vector<std::shared_ptr<shapes::cubic_bezier>> beziers;
+
+      // Embree passes the context through to filter callbacks, so extra query state rides along
+      struct intersect_context {
+        RTCIntersectContext rtc_ctx;
+        const shapes::cubic_bezier* strand;
+        unsigned int mask;
+      };
+
+      // Rejects hits on foreign strands and on curves hidden from the ray type. The mask test
+      // duplicates Embree's own ray masks, which are only honoured with EMBREE_RAY_MASK builds.
+      static void hit_filter(const RTCFilterFunctionNArguments* args);
+
+      // A hair object tessellated into one linear curve geometry, segments map back to the
+      // bezier they approximate through their primitive id
+      struct linear_hair {
+        const primitive_arena<shapes::cubic_bezier>* curves;
+        std::vector<uint32_t> segment_curve;
+        std::vector<Float> segment_u0;
+        std::vector<Float> segment_du;
+      };
+      std::vector<std::unique_ptr<linear_hair>> linear_hairs;
+      // indexed by geometry id, null for bezier geometries
+      std::vector<const linear_hair*> linear_geoms;
+
+      static void linear_hit_filter(const RTCFilterFunctionNArguments* args);
+
+      // Occlusion query that records every curve it passes instead of stopping at the first
+      static constexpr int MAX_COUNTED_HITS = 32;
+      struct count_context {
+        intersect_context base; // geometry filters see only this part
+        const embree_accel* accel;
+        const shapes::cubic_bezier* exclude;
+        const shapes::cubic_bezier* counted[MAX_COUNTED_HITS];
+        int n_counted;
+        int max_count;
+      };
+
+      static void count_filter(const RTCFilterFunctionNArguments* args);
 
     public:
       typedef unsigned int geom_id;
 
-      embree_accel();
+      embree_accel() {}
       ~embree_accel();
 
-      geom_id add_hair(const std::vector<std::shared_ptr<shape>>& curves);
+      // Create the Embree device and scene, must be called before adding geometries. The device
+      // threads are taken from the thread budget, so the thread calling init() should commit.
+      void init(const device_config& config);
+
+      // Curves are referenced, not copied, the arena has to outlive the accelerator. If given,
+      // shared_vertices holds 4 Embree curve vertices per curve and is shared instead of copied,
+      // it has to outlive the accelerator as well.
+      geom_id add_hair(
+          const primitive_arena<shapes::cubic_bezier>& curves,
+          const vector4f* shared_vertices = nullptr
+          );
+      // Curve i is split into n_segments[i] uniform segments, returns the number of segments
+      size_t add_linear_hair(
+          const primitive_arena<shapes::cubic_bezier>& curves,
+          const std::vector<uint32_t>& n_segments,
+          bool flat
+          );
       void commit();
 
       bool is_valid() const;
-      bool intersect(const ray& r, shape::intersect_result* result) const;
+      // If strand is not null, only hits on curves of the same hair strand are reported
+      bool intersect(
+          const ray& r,
+          shape::intersect_result* result,
+          const shapes::cubic_bezier* strand = nullptr
+          ) const;
       bool occluded(const ray& r) const;
+      // Number of distinct curves along r other than exclude, at most max_count. Requires the
+      // count_hits device option.
+      int count_hits(const ray& r, int max_count, const shapes::cubic_bezier* exclude) const;
   };
 }
 
@@ -1,9 +1,12 @@
 #ifndef TRACER_HAIR_HPP
 #define TRACER_HAIR_HPP
 
+#include <chrono>
+
 #include "shapes/cubic_bezier.hpp"
+#include "bounds.hpp"
+#include "primitive_arena.hpp"
 #include "cyHairFile.h"
-#include "bvh_tree.hpp"
 
 namespace tracer {
   class hair {
@@ -13,6 +16,7 @@ namespace tracer {
       };
 
       std::string file_path;
+      uintptr_t hair_id;
       cyHairFile cyhair;
       cyHairFile::Header cyhair_header;
       unsigned short* segments_count;
@@ -22,6 +26,16 @@ namespace tracer {
       float* thickness;
       float* tangents = nullptr;
 
+      // A converted curve waiting to be moved into the arena
+      struct bezier_record {
+        point3f cps[4];
+        Float thickness0, thickness1;
+      };
+
+      // strands are converted in this many ranges per thread to even out their lengths
+      static constexpr int RANGES_PER_THREAD = 4;
+      static constexpr std::chrono::seconds PROGRESS_PERIOD{ 1 };
+
       inline point3f point_at(size_t id) const {
         id = 3 * id;
         return right_to_left({ points[id], points[id+1], points[id+2] });
@@ -44,19 +58,40 @@ namespace tracer {
 
       void halve_bezier(point3f left[4], point3f right[4], const point3f cps[4]) const;
 
+      size_t strand_segments(size_t strand) const;
+
+      // Write the world-space curves of one strand to out, 8 per segment if subdivide is set
+      void convert_strand(
+          bezier_record* out,
+          size_t strand,
+          const tf::shared_transform& shape_to_world,
+          Float thickness_scale,
+          bool subdivide
+          ) const;
+
     public:
       hair(const std::string& fpath);
       ~hair();
 
-      bvh_tree* to_beziers(
-          std::vector<std::shared_ptr<shape>>& curves,
+      // Unique non-zero id for curves of one hair object, also used for cached hair
+      static uintptr_t new_id();
+
+      // Bounds of the control points in hair file space
+      bounds3f bounds() const;
+
+      // Tag curves with hair and strand ids if strand_walk is set, so that subsurface random walks
+      // can be restricted to the strand they started in.
+      // With lod below 1 only a random lod fraction of the strands is kept, each widened by
+      // 1 / lod so that the groom keeps its projected coverage.
+      void to_beziers(
+          primitive_arena<shapes::cubic_bezier>& curves,
           const tf::transform& shape_to_world,
           const std::shared_ptr<material>& surface,
-          uintptr_t* hair_id,
           size_t n_strands = 0,
           Float thickness_scale = 1,
-          bool subbvh = false,
-          bool subdivide = false
+          bool strand_walk = false,
+          bool subdivide = false,
+          Float lod = 1
           ) const;
   };
 }
@@ -0,0 +1,92 @@
+#ifndef TRACER_HAIR_CACHE_HPP
+#define TRACER_HAIR_CACHE_HPP
+
+#include <string>
+#include <cstdint>
+
+#include "shapes/cubic_bezier.hpp"
+#include "primitive_arena.hpp"
+
+namespace tracer {
+  /*
+   * Converted hair curves stored next to the hair file. The file is memory-mapped read-only
+   * and its vertex section is laid out exactly like Embree's FLOAT4 curve vertices, so it can
+   * be shared with Embree instead of copied.
+   *
+   * Layout, sections aligned to ALIGNMENT bytes:
+   *   header
+   *   vector4f vertices[4 * n_curves]  control point xyz, thickness lerped at u = i / 3 in w
+   *   uint32_t strand_ids[n_curves]
+   */
+  class hair_cache {
+    private:
+      static constexpr uint32_t MAGIC     = 0x43485446; // "FTHC"
+      static constexpr uint32_t VERSION   = 1;
+      static constexpr uint64_t ALIGNMENT = 64;
+
+      enum flags : uint32_t {
+        STRAND_WALK = 1
+      };
+
+      struct header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint64_t n_curves;
+        uint64_t vertices_offset;
+        uint64_t strand_ids_offset;
+        uint32_t flags;
+      };
+
+      void* mapping = nullptr;
+      size_t mapping_size = 0;
+
+      const header* file_header() const;
+
+    public:
+      hair_cache() {}
+      ~hair_cache();
+
+      hair_cache(const hair_cache&) = delete;
+      hair_cache& operator=(const hair_cache&) = delete;
+
+      // Hash of everything the converted curves depend on: the source file's path, size and
+      // modification time, and the conversion settings. The eye position only matters when the
+      // level of detail follows the distance to it.
+      static uint64_t make_key(
+          const std::string& hair_path,
+          const tf::transform& shape_to_world,
+          size_t n_strands,
+          Float thickness_scale,
+          bool strand_walk,
+          bool subdivide,
+          Float lod,
+          Float lod_distance,
+          const point3f& eye_position
+          );
+
+      // Returns false if path cannot be written, the cache is optional so that is not an error
+      static bool write(
+          const std::string& path,
+          uint64_t key,
+          const primitive_arena<shapes::cubic_bezier>& curves
+          );
+
+      // Map path, returns false and stays closed if it is missing, stale or malformed
+      bool open(const std::string& path, uint64_t key);
+      bool is_open() const;
+
+      // Rebuild the curves, tagging them with hair_id if they were converted for strand walks
+      void to_beziers(
+          primitive_arena<shapes::cubic_bezier>& curves,
+          const std::shared_ptr<material>& surface,
+          uintptr_t hair_id
+          ) const;
+
+      size_t size() const;
+      // 4 vertices per curve, in curve order, as Embree expects them
+      const vector4f* vertices() const;
+  };
+}
+
+#endif /* TRACER_HAIR_CACHE_HPP */
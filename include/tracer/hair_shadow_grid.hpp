@@ -0,0 +1,50 @@
+#ifndef TRACER_HAIR_SHADOW_GRID_HPP
+#define TRACER_HAIR_SHADOW_GRID_HPP
+
+#include <deque>
+#include <vector>
+
+#include "shapes/cubic_bezier.hpp"
+#include "primitive_arena.hpp"
+#include "bounds.hpp"
+
+namespace tracer {
+  /*
+   * Transmittance of hair towards one light on a regular grid over the hair's bounds, a deep
+   * opacity map in world space. Fibers are voxelized into an extinction density, which every
+   * voxel then integrates on its way to the light. Fibers count as opaque, like they do for
+   * shadow rays, and the light is reduced to its center.
+   */
+  class hair_shadow_grid {
+    private:
+      static constexpr int MIN_RES = 8;
+      static constexpr int MAX_RES = 128;
+
+      bounds3f grid_bounds;
+      Float voxel_size = 0;
+      int res[3] = { 0, 0, 0 };
+      // at voxel centers, x runs fastest
+      std::vector<Float> values;
+
+      size_t index(int x, int y, int z) const;
+      void locate(const point3f& p, int i[3], Float d[3]) const;
+      void splat(std::vector<Float>& grid, const point3f& p, Float value) const;
+      Float interpolate(const std::vector<Float>& grid, const point3f& p) const;
+
+    public:
+      hair_shadow_grid() {}
+
+      // Voxels are tolerance times the longest side of the hair's bounds
+      void build(
+          const std::deque<primitive_arena<shapes::cubic_bezier>>& curves,
+          const point3f& light_position,
+          Float tolerance
+          );
+
+      bool empty() const;
+      bool contains(const point3f& p) const;
+      Float transmittance(const point3f& p) const;
+  };
+} /* namespace tracer */
+
+#endif /* TRACER_HAIR_SHADOW_GRID_HPP */
@@ -0,0 +1,70 @@
+#ifndef TRACER_LIGHT_BVH_HPP
+#define TRACER_LIGHT_BVH_HPP
+
+#include <vector>
+#include <unordered_map>
+
+#include "shape.hpp"
+#include "bounds.hpp"
+
+namespace tracer {
+  /*
+   * Emissive shapes clustered by position, power and orientation (Conty Estevez and Kulla 2018),
+   * so that a shading point picks one light in time logarithmic in their number, proportionally
+   * to a bound of what each cluster could contribute there. Lights shine from both sides of
+   * their surface, so orientation cones hold normals up to their sign.
+   */
+  class light_bvh {
+    public:
+      struct light_bounds {
+        bounds3f bounds;
+        Float power = 0;
+        vector3f axis;
+        // half angle of the normal cone
+        Float theta = 0;
+
+        light_bounds merge(const light_bounds& other) const;
+        Float importance(const point3f& p) const;
+      };
+
+    private:
+      struct node {
+        light_bounds lb;
+        // the first child follows its parent, leaves refer to their light instead
+        uint32_t second_child_or_light = 0;
+        bool leaf = false;
+      };
+
+      std::vector<const shape*> lights;
+      // depth first
+      std::vector<node> nodes;
+      // branches taken from the root to each light, bit i set for the second child at depth i
+      std::unordered_map<const shape*, uint64_t> trails;
+
+      uint32_t build(
+          std::vector<std::pair<uint32_t, light_bounds>>& items,
+          size_t start,
+          size_t end,
+          uint64_t trail,
+          int depth
+          );
+
+    public:
+      light_bvh() {}
+
+      // Emitters have to support shape::sample(), lights without power are left out, they
+      // would never be picked
+      void build(const std::vector<const shape*>& emitters);
+
+      bool empty() const;
+      size_t size() const;
+      // The light with the most power, nullptr if there is none
+      const shape* strongest() const;
+
+      // Light for the shading point p from u, nullptr if none can reach it
+      const shape* sample(const point3f& p, Float u, Float* pmf) const;
+      Float pmf(const point3f& p, const shape* light) const;
+  };
+} /* namespace tracer */
+
+#endif /* TRACER_LIGHT_BVH_HPP */
@@ -20,6 +20,9 @@ namespace tracer {
         NONE
       } transport_model;
 
+      // light samples per shading point, 0 takes the scene's render_params::light_samples
+      int light_samples = 0;
+
       typedef uint8_t medium;
 
       struct light_transport {
@@ -58,6 +61,25 @@ namespace tracer {
           const point3f& u
           ) const = 0;
 
+      /*
+       * Solid angle pdf of sample() returning omega_in for omega_out, with the light transport
+       * sample() returned for it. Materials that cannot tell return 0 and false from has_pdf(),
+       * which leaves every light their directions reach to the light strategy in MIS.
+       */
+      virtual Float pdf(
+          const vector3f& omega_in,
+          const vector3f& omega_out,
+          const normal3f& mf_normal,
+          const light_transport& lt
+          ) const
+      {
+        return 0;
+      }
+
+      virtual bool has_pdf() const {
+        return true;
+      }
+
       inline bool is_refractive(transport_type tp) const {
         return tp == REFRACT || tp == SSS;
       }
@@ -1,4 +1,7 @@
+#include <memory>
+
 #include "tracer/material.hpp"
+#include "tracer/materials/dipole_profile.hpp"
 #include "math/sampler.hpp"
 
 namespace tracer {
@@ -7,9 +10,6 @@ namespace tracer {
       private:
         sampled_spectrum sigma_a;
         sampled_spectrum sigma_s;
-        sampled_spectrum sigma_t;
-        sampled_spectrum sigma_tr;
-        sampled_spectrum albedo;
         sampled_spectrum k;
 
         Float beta_n;
@@ -17,10 +17,9 @@ namespace tracer {
         Float eta_i;
         Float eta_t;
 
-        sampler::normal1d standard_normal;
+        std::shared_ptr<const dipole_profile> profile;
 
         sampled_spectrum Sd(Float ft_in, Float ft_out, const sampled_spectrum& rd) const;
-        sampled_spectrum Rd(Float r) const;
         sampled_spectrum S1(const vector3f& omega_in, const vector3f& omega_out) const;
 
       public:
@@ -52,6 +51,10 @@ namespace tracer {
             const light_transport& lt,
             const point3f& u
             ) const override;
+
+        // sample() draws a direction and an offset, the density of the direction has no
+        // closed form, so lights are found through light samples only
+        bool has_pdf() const override;
     };
   }
 }
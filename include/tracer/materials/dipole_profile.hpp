@@ -0,0 +1,58 @@
+#ifndef TRACER_MATERIALS_DIPOLE_PROFILE_HPP
+#define TRACER_MATERIALS_DIPOLE_PROFILE_HPP
+
+#include <vector>
+
+#include "tracer/spectrum.hpp"
+
+namespace tracer {
+  namespace materials {
+    /*
+     * Radial diffuse reflectance Rd(r) of the classic dipole (Jensen et al. 2001), tabulated
+     * up to the radius where it becomes negligible. The luminance of the profile is integrated
+     * over the plane into a CDF, so radii can be drawn proportionally to it.
+     */
+    class dipole_profile {
+      public:
+        static constexpr int RES = 256;
+
+      private:
+        sampled_spectrum sigma_tr;
+        sampled_spectrum albedo;
+        sampled_spectrum zr, zv;
+        Float r_max = 0;
+
+        // radii grow quadratically with the index, the profile peaks sharply around zero
+        std::vector<Float> table;
+        std::vector<Float> lum_table;
+        // of the luminance times 2 pi r, unnormalized
+        std::vector<Float> cdf;
+
+        Float radius(int i) const;
+        // segment holding r and the offset in it
+        int locate(Float r, Float* d) const;
+
+      public:
+        dipole_profile(
+            const sampled_spectrum& sigma_a,
+            const sampled_spectrum& sigma_s,
+            Float eta_i,
+            Float eta_t
+            );
+
+        sampled_spectrum exact(Float r) const;
+        sampled_spectrum evaluate(Float r) const;
+        Float luminance(Float r) const;
+
+        Float max_radius() const;
+        // Luminance of the diffuse reflectance over the whole plane
+        Float total() const;
+
+        // Radius from u, pdf is per unit area at that radius
+        Float sample(Float u, Float* pdf) const;
+        Float pdf(Float r) const;
+    };
+  }
+}
+
+#endif /* TRACER_MATERIALS_DIPOLE_PROFILE_HPP */
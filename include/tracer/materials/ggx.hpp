@@ -21,6 +21,22 @@ namespace tracer {
             const vector3f& omega
             ) const;
 
+        // Microfacet normal seen from omega_out (Heitz 2018), omega_out above the surface
+        normal3f sample_visible_normal(const vector3f& omega_out, const point2f& u) const;
+        Float visible_normal_pdf(const vector3f& omega_out, const normal3f& mf_normal) const;
+
+        // Microfacet normal connecting omega_in and omega_out, and the indices of refraction on
+        // the side of omega_out and across the boundary, for the light transport sample()
+        // returned with omega_in. False if no microfacet connects them.
+        bool half_vector(
+            normal3f* mf_normal,
+            Float* eta_out,
+            Float* eta_in,
+            const vector3f& omega_in,
+            const vector3f& omega_out,
+            const light_transport& lt
+            ) const;
+
       public:
         ggx(const sampled_spectrum& refl,
             const sampled_spectrum& refr,
@@ -36,7 +52,7 @@ namespace tracer {
           eta_t(eta_t) {}
 
         ggx(const ggx& cpy)
-          : material(cpy.refl, cpy.refr, cpy.emittance),
+          : material(cpy),
           alpha(cpy.alpha),
           alpha2(cpy.alpha2),
           eta_i(cpy.eta_i),
@@ -57,6 +73,13 @@ namespace tracer {
             const light_transport& lt,
             const point3f& u
             ) const override;
+
+        Float pdf(
+            const vector3f& omega_in,
+            const vector3f& omega_out,
+            const normal3f& mf_normal,
+            const light_transport& lt
+            ) const override;
     };
   }
 }
@@ -1,6 +1,8 @@
 #ifndef TRACER_MATERALS_HAIRPT_HPP
 #define TRACER_MATERALS_HAIRPT_HPP
 
+#include <vector>
+
 #include "tracer/material.hpp"
 #include "math/pdf.hpp"
 
@@ -21,21 +23,63 @@ namespace tracer {
         Float logistic_s;
         sampled_spectrum sigma_a;
 
-        // Compute longitudinal scattering distribution function
-        Float lsdf(
-            Float sin_theta_in,
+        // Tables are sized so that their spacing is at most a quarter of the lobe width, lobes
+        // needing more than the maximum resolution are evaluated analytically
+        static constexpr int MIN_MP_RES       = 64;
+        static constexpr int MAX_MP_RES       = 512;
+        static constexpr int MIN_DETECTOR_RES = 256;
+        static constexpr int MAX_DETECTOR_RES = 8192;
+
+        // Mp of one lobe on a res x res grid over (theta_in, theta_out) in [-pi/2, pi/2]^2. The
+        // grid is uniform in theta rather than in sin(theta), whose lobes get arbitrarily narrow
+        // towards the poles.
+        struct mp_table {
+          int res = 0;
+          std::vector<Float> values;
+        };
+        // TRT and the residual lobe share their variance, and so their table
+        mp_table mp_tables[3];
+
+        // Finite logistic over the wrapped azimuthal deviation in [-pi, pi]
+        std::vector<Float> detector_table;
+
+        // Lobe attenuations and their sampling probabilities. Both are even in theta_out and
+        // h, so the grid spans |theta_out| and |gamma_o| = asin|h| over [0, pi/2], uniform in
+        // the angles so that the fresnel term stays smooth towards the fiber's silhouette.
+        static constexpr int ATTENUATION_THETA_RES = 33;
+        static constexpr int ATTENUATION_GAMMA_RES = 33;
+        // lobe spectra per grid point, samples innermost
+        std::vector<Float> attenuation_table;
+        std::vector<Float> attenuation_prob_table;
+
+        void build_tables();
+
+        // Dual scattering (Zinke et al. 2008) replaces hair-to-hair bounces with a closed-form
+        // estimate. Forward and backward attenuation are averaged over the fiber width and
+        // tabulated over the longitudinal angle.
+        static constexpr int DS_THETA_RES   = 32;
+        static constexpr int DS_H_SAMPLES   = 32;
+        static constexpr int DS_PHI_SAMPLES = 72;
+
+        struct dual_scattering_entry {
+          sampled_spectrum a_f_lobe[4]; // forward attenuation of each lobe
+          sampled_spectrum a_f;         // total forward attenuation
+          sampled_spectrum A_b;         // attenuation of local back scattering
+          Float beta_f_sq;              // longitudinal variance added per forward scattering
+          Float sigma_b_sq;             // longitudinal variance of local back scattering
+        };
+        std::vector<dual_scattering_entry> ds_table;
+        Float forward_density = 0.7f;
+        Float backward_density = 0.7f;
+
+        void build_dual_scattering();
+
+        void refracted_offsets(
             Float sin_theta_out,
-            Float cos_theta_in,
             Float cos_theta_out,
-            Float v
-            ) const;
-
-        Float gaussian_detector(
-            int lobe,
-            Float phi,
-            Float gamma_o,
-            Float gamma_t,
-            Float s
+            Float h,
+            Float* sin_gamma_o,
+            Float* sin_gamma_t
             ) const;
 
         sampled_spectrum transmittance(
@@ -51,11 +95,77 @@ namespace tracer {
 
         Float specular_cone_angle(Float theta, int lobe) const;
 
+        // Solid angle pdf of sample() for lobes picked with A_prob
+        Float lobe_pdf(
+            const Float A_prob[4],
+            Float sin_theta_in,
+            Float sin_theta_out,
+            Float phi,
+            Float gamma_o,
+            Float gamma_t
+            ) const;
+
         inline Float net_deflection(int lobe, Float gamma_o, Float gamma_t) const {
           return 2.f * lobe * gamma_t - 2.f * gamma_o + lobe * PI;
         }
 
       public:
+        // Analytic longitudinal scattering distribution function, the reference for the tables
+        Float lsdf(
+            Float sin_theta_in,
+            Float sin_theta_out,
+            Float cos_theta_in,
+            Float cos_theta_out,
+            Float v
+            ) const;
+
+        // Analytic azimuthal detector, the reference for the tables
+        Float gaussian_detector(
+            int lobe,
+            Float phi,
+            Float gamma_o,
+            Float gamma_t,
+            Float s
+            ) const;
+
+        // Tabulated lsdf of all four lobes and gaussian_detector of one, as used for shading
+        void longitudinal(Float M[4], Float sin_theta_in, Float sin_theta_out) const;
+        Float detector(int lobe, Float phi, Float gamma_o, Float gamma_t) const;
+
+        // Analytic attenuation and lobe probabilities at offset h, the reference for the tables
+        void exact_attenuation(
+            sampled_spectrum A[4],
+            Float prob[4],
+            Float sin_theta_out,
+            Float h
+            ) const;
+        // Tabulated exact_attenuation as used for shading, either output may be null
+        void lobe_attenuation(
+            sampled_spectrum A[4],
+            Float prob[4],
+            Float sin_theta_out,
+            Float h
+            ) const;
+
+        Float lobe_variance(int lobe) const { return v[lobe]; }
+        Float azimuthal_scale() const { return logistic_s; }
+
+        // Precompute the dual scattering tables, densities are d_f and d_b of the groom
+        void enable_dual_scattering(Float forward_density, Float backward_density);
+        bool dual_scattering() const;
+
+        /*
+         * Multiple scattering towards omega_out of light arriving along omega_in after passing
+         * through n_occluders fibers, both in tangent space. Single scattering is not included,
+         * it is left to the regular direct lighting estimate when nothing is in between. The
+         * result already contains the cosine term and is only to be divided by the light pdf.
+         */
+        sampled_spectrum multiple_scattering(
+            const vector3f& omega_in,
+            const vector3f& omega_out,
+            int n_occluders
+            ) const;
+
         hairpt(
             const sampled_spectrum& refl,
             const sampled_spectrum& emittance,
@@ -83,6 +193,13 @@ namespace tracer {
             const light_transport& lt,
             const point3f& u
             ) const override;
+
+        Float pdf(
+            const vector3f& omega_in,
+            const vector3f& omega_out,
+            const normal3f& mf_normal,
+            const light_transport& lt
+            ) const override;
     };
   }
 }
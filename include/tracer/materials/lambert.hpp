@@ -25,6 +25,13 @@ namespace tracer {
             const light_transport& lt,
             const point3f& u
             ) const override;
+
+        Float pdf(
+            const vector3f& omega_in,
+            const vector3f& omega_out,
+            const normal3f& mf_normal,
+            const light_transport& lt
+            ) const override;
     };
   }
 }
@@ -1,20 +1,46 @@
 #ifndef TRACER_MATERIALS_SSS_HPP
 #define TRACER_MATERIALS_SSS_HPP
 
+#include <memory>
+
 #include "tracer/materials/ggx.hpp"
+#include "tracer/materials/dipole_profile.hpp"
 #include "math/random.hpp"
 
 namespace tracer {
   namespace materials {
     class sss : public ggx {
+      public:
+        // How the random walk inside the medium samples its free flights
+        enum walk_mode {
+          // from one random channel, weighted by the one-sample MIS over all channels
+          SPECTRAL_MIS,
+          // delta tracking against the largest extinction, collisions are told apart by the
+          // path's spectral weight (Kutz et al. 2017)
+          DELTA_TRACKING,
+          // no walk, the exit point is drawn around the entry from the dipole profile
+          DIFFUSION
+        };
+
+        enum collision {
+          SCATTER,
+          NULL_COLLISION,
+          ABSORB
+        };
+
       private:
         const sampled_spectrum sigma_a;
         const sampled_spectrum sigma_s;
         const sampled_spectrum sigma, inv_sigma;
+        const Float sigma_max;
+        const sampled_spectrum sigma_n;
 
       public:
         const Float g;
         const Float absorp_prob;
+        const walk_mode walk;
+        // only built for DIFFUSION
+        const std::shared_ptr<const dipole_profile> profile;
 
         sss(const sampled_spectrum& refl,
             const sampled_spectrum& refr,
@@ -24,16 +50,19 @@ namespace tracer {
             Float eta_t,
             const sampled_spectrum& sigma_a,
             const sampled_spectrum& sigma_s,
-            Float g = 0);
+            Float g = 0,
+            walk_mode walk = SPECTRAL_MIS);
 
         sss(const sss& cpy);
 
         sampled_spectrum transmittance(Float dist) const;
-        sampled_spectrum density(const sampled_spectrum& tr, bool inside) const;
-        sampled_spectrum beta(const sampled_spectrum& tr, bool inside) const;
 
+        // Distance to the next collision
         Float sample_distance(random::rng& rng) const;
-        Float pdf(const sampled_spectrum& density_spec) const;
+        // Weight of leaving the medium dist after the last collision
+        sampled_spectrum escape_weight(Float dist) const;
+        // Resolve the collision dist after the last one and update the walk's weight with it
+        collision collide(sampled_spectrum* weight, Float dist, random::rng& rng) const;
     };
   }
 }
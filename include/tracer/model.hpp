@@ -3,22 +3,23 @@
 
 #include <assimp/scene.h>
 
-#include "shape.hpp"
+#include "shapes/triangle.hpp"
+#include "primitive_arena.hpp"
 
 namespace tracer {
   class model {
     private:
-      const tf::transform tf_shape_to_world;
+      const tf::shared_transform tf_shape_to_world;
       const std::shared_ptr<tracer::material> surface;
       const std::string fpath;
 
       void load_mesh(
-          std::vector<std::shared_ptr<shape>>& shapes,
+          primitive_arena<shapes::triangle>& triangles,
           aiMesh* mesh
           );
 
       void load_node(
-          std::vector<std::shared_ptr<shape>>& shapes,
+          primitive_arena<shapes::triangle>& triangles,
           aiNode* node,
           const aiScene* scene
           );
@@ -30,7 +31,7 @@ namespace tracer {
           const std::string& fpath
           );
 
-      void load(std::vector<std::shared_ptr<shape>>& shapes);
+      void load(primitive_arena<shapes::triangle>& triangles);
   };
 }
 
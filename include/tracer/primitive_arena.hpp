@@ -0,0 +1,46 @@
+#ifndef TRACER_PRIMITIVE_ARENA_HPP
+#define TRACER_PRIMITIVE_ARENA_HPP
+
+#include <deque>
+#include <limits>
+#include <cstdint>
+
+#include "error.hpp"
+
+namespace tracer {
+  // Owns the primitives of one type in chunked contiguous storage. Elements never move once
+  // created, so accelerators hold plain pointers to them without any reference counting; the
+  // arena has to outlive them. The 32-bit index only serves tables over a single arena, like
+  // the segments of a linear hair geometry.
+  template <typename T>
+  class primitive_arena {
+    private:
+      std::deque<T> pool;
+
+    public:
+      typedef uint32_t index;
+      typedef typename std::deque<T>::iterator iterator;
+      typedef typename std::deque<T>::const_iterator const_iterator;
+
+      template <typename... Args>
+      index emplace(Args&&... args) {
+        ASSERT(pool.size() < std::numeric_limits<index>::max(), "primitive arena is full");
+        pool.emplace_back(std::forward<Args>(args)...);
+        return pool.size() - 1;
+      }
+
+      T& operator[](index i)              { return pool[i]; }
+      const T& operator[](index i) const  { return pool[i]; }
+      T& back()                           { return pool.back(); }
+
+      index size() const  { return pool.size(); }
+      bool empty() const  { return pool.empty(); }
+
+      iterator begin()              { return pool.begin(); }
+      iterator end()                { return pool.end(); }
+      const_iterator begin() const  { return pool.begin(); }
+      const_iterator end() const    { return pool.end(); }
+  };
+} /* namespace tracer */
+
+#endif /* TRACER_PRIMITIVE_ARENA_HPP */
@@ -11,22 +11,33 @@ namespace tracer {
 
   class ray {
     public:
+      // Ray types, a shape is only tested against rays whose mask intersects its visibility
+      enum visibility : unsigned int {
+        CAMERA      = 1 << 0,
+        BOUNCE      = 1 << 1,
+        SHADOW      = 1 << 2,
+        SUBSURFACE  = 1 << 3,
+        ALL         = CAMERA | BOUNCE | SHADOW | SUBSURFACE
+      };
+
       point3f   origin;
       vector3f  dir, inv_dir;
       Float     t_max;
 
       material::medium medium;
+      unsigned int mask;
 
       ray() {}
       ray(const point3f& origin,
           const vector3f& dir,
           Float t_max = std::numeric_limits<Float>::max(),
-          material::medium medium = OUTSIDE)
+          material::medium medium = OUTSIDE,
+          unsigned int mask = ALL)
         : origin(origin), dir(dir), inv_dir(dir.inverse()),
-        t_max(t_max), medium(medium) {}
+        t_max(t_max), medium(medium), mask(mask) {}
       ray(const ray& cpy)
         : origin(cpy.origin), dir(cpy.dir), inv_dir(cpy.inv_dir),
-        t_max(cpy.t_max), medium(cpy.medium) {}
+        t_max(cpy.t_max), medium(cpy.medium), mask(cpy.mask) {}
 
       ray& operator=(const ray& cpy) {
         origin  = cpy.origin;
@@ -34,6 +45,7 @@ namespace tracer {
         inv_dir = cpy.inv_dir;
         t_max   = cpy.t_max;
         medium  = cpy.medium;
+        mask    = cpy.mask;
         return *this;
       }
 
@@ -42,7 +54,7 @@ namespace tracer {
       }
 
       ray normalized() const {
-        return ray(origin, dir.normalized(), t_max, medium);
+        return ray(origin, dir.normalized(), t_max, medium, mask);
       }
   };
 }
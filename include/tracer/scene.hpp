@@ -2,10 +2,12 @@
 #define TRACER_SCENE_HPP
 
 #include <vector>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <chrono>
+#include <future>
 #include <unordered_map>
 
 #include "math/random.hpp"
@@ -15,9 +17,16 @@
 #include "tracer/bvh_tree.hpp"
 #include "tracer/texture.hpp"
 #include "tracer/embree_accel.hpp"
+#include "tracer/primitive_arena.hpp"
+#include "tracer/hair_cache.hpp"
+#include "tracer/hair_shadow_grid.hpp"
+#include "tracer/light_bvh.hpp"
 #include "job_master.hpp"
 
 namespace tracer {
+  namespace materials {
+    class sss;
+  }
 
   struct render_params {
     vector2i  img_res       = { 256, 256 };
@@ -33,10 +42,25 @@ namespace tracer {
     int       max_bounce    = 1;
     Float     max_rr        = 0.5;
     bool      mis           = true;
+    int       light_samples = 1; // per shading point, materials may ask for their own
     bool      legacy        = false;
+    Float     hair_pixel_error = 0.5; // allowed deviation of linear hair from its curves
+    Float     hair_shadow_tolerance = 0; // voxel size of the hair shadow grid, 0 disables it
+    Float     hair_shadow_exact_distance = 0; // shadows closer to the eye trace every ray
     int       thread_id;
 
     shape::intersect_opts intersect_options = shape::intersect_opts();
+    embree_accel::device_config embree_config = embree_accel::device_config();
+  };
+
+  // A hair object whose conversion is still running on another thread
+  struct hair_job {
+    std::future<primitive_arena<shapes::cubic_bezier>> curves;
+    embree_accel::curve_basis basis = embree_accel::BEZIER;
+    // opened by the job when the hair is cached, Embree then shares its vertices
+    std::shared_ptr<hair_cache> cache = nullptr;
+    // Embree then counts the hair occluding lights, see scene::count_hair_occluders
+    bool dual_scattering = false;
   };
 
   struct render_profile {
@@ -50,15 +74,15 @@ namespace tracer {
           void (*update_callback)(Float, size_t, size_t)
           );
 
+      // Sample the next direction at result. to_tangent_space is the shading frame the light
+      // samples taken there share, see estimate_direct.
       material::light_transport trace_bsdf(
           ray* r_next,
           vector3f* omega_in,
           vector3f* omega_out,
           normal3f* mf_normal,
-          vector3f* omega_in_dl,
           Float* pdf,
-          Float* pdf_dl,
-          sampled_spectrum* direct_light,
+          matrix3f* to_tangent_space,
           const shape::intersect_result& result,
           const render_params& params,
           const ray& r,
@@ -66,29 +90,74 @@ namespace tracer {
           const point2f& sample,
           random::rng& rng
           );
+
+      // Sample a point on a light, or a direction towards the environment, for result. pdf_dl is
+      // the sample's solid angle pdf and 0 when it is not worth a shadow ray, hair_occluders is
+      // -1 if it is blocked and otherwise counts the fibers in its way for dual scattering hair.
+      void sample_light(
+          vector3f* omega_in_dl,
+          Float* pdf_dl,
+          sampled_spectrum* direct_light,
+          int* hair_occluders,
+          const shape::intersect_result& result,
+          const render_params& params,
+          const ray& r_next,
+          const matrix3f& to_tangent_space,
+          const point2f& sample,
+          Float u_light
+          ) const;
   
+      // prev_pdf is the solid angle pdf the previous vertex sampled r with, divided by the light
+      // samples taken there, which weighs the light r hits against them. 0 gives the light its
+      // full weight, a negative value none when light samples can reach it.
+      // throughput is the luminance of the path's weight so far, which light splitting follows.
       nspectrum trace_path(
           const render_params& params,
           const ray& r,
           const material::light_transport& lt,
           const point2f& sample,
           random::rng& rng,
-          int bounce
+          int bounce,
+          Float prev_pdf,
+          Float throughput
           );
 
       // Calculate differential irrdiance
       void estimate_radiance(
           sampled_spectrum* bxdf_estimator,
-          sampled_spectrum* direct_estimator,
-          const render_params& params,
           const vector3f& omega_in,
           const vector3f& omega_out,
           const normal3f& mf_normal,
-          const normal3f& omega_in_dl,
           const material::light_transport& next_lt,
           const shape::intersect_result& result,
-          Float pdf,
-          Float pdf_dl
+          Float pdf
+          ) const;
+
+      // Direct light at result averaged over n_samples light samples, each weighted against
+      // the bsdf of shading, which differs from result at the exit of a subsurface walk.
+      // omega_out travels in med_out. Without with_light the light's radiance is left out.
+      sampled_spectrum estimate_direct(
+          const shape::intersect_result& result,
+          const shape::intersect_result& shading,
+          const render_params& params,
+          const ray& r_next,
+          const matrix3f& to_tangent_space,
+          const vector3f& omega_out,
+          const normal3f& mf_normal,
+          material::medium med_out,
+          bool with_light,
+          int n_samples,
+          const point2f& sample,
+          random::rng& rng
+          ) const;
+
+      // Light samples to take at a shading point of surface, split fewer times on paths
+      // carrying little light
+      int light_samples(
+          const material& surface,
+          const render_params& params,
+          Float throughput,
+          random::rng& rng
           ) const;
 
       bool intersect(
@@ -99,6 +168,47 @@ namespace tracer {
 
       bool occluded(const ray& r, const shape::intersect_opts& opts) const;
 
+      // Hair fibers other than self along a shadow ray, up to MAX_HAIR_OCCLUDERS, or -1 if
+      // anything else blocks it
+      static constexpr int MAX_HAIR_OCCLUDERS = 32;
+      int count_hair_occluders(
+          const ray& r,
+          const render_params& params,
+          const shapes::cubic_bezier* self
+          ) const;
+
+      // Uniform segment counts that keep linear hair within params.hair_pixel_error pixels of
+      // the curves, as seen from the camera
+      std::vector<uint32_t> linear_segments(
+          const primitive_arena<shapes::cubic_bezier>& hair_curves,
+          const render_params& params
+          ) const;
+
+      // Intersect boundaries of the participating medium of the object made of medium,
+      // restricted to strand if it is not null
+      bool intersect_medium(
+          const ray& r,
+          const render_params& params,
+          const material* medium,
+          const shapes::cubic_bezier* strand,
+          shape::intersect_result* result
+          ) const;
+
+      // Where light entering medium at entry comes out again, found by projecting a radius drawn
+      // from its dipole profile back onto the object along the entry normal or a tangent. The
+      // exit ray heads out of the medium, cosine distributed, and weight is the profile over the
+      // area pdf of the exit. False if the projection misses the object.
+      bool sample_diffusion_exit(
+          ray* r_exit,
+          sampled_spectrum* weight,
+          shape::intersect_result* exit,
+          const shape::intersect_result& entry,
+          const ray& r,
+          const render_params& params,
+          const materials::sss& medium,
+          random::rng& rng
+          ) const;
+
       std::shared_ptr<std::vector<rgb_spectrum>> ird_rgb = nullptr;
       std::vector<light_source::emitter> light_emitters;
 
@@ -120,16 +230,31 @@ namespace tracer {
     public:
       bvh_tree legacy_shapes;
       embree_accel embree_shapes;
+      // The shapes of each subsurface object by material, walks inside it only meet these
+      std::unordered_map<const material*, bvh_tree> medium_shapes;
+
+      // Shapes owned by the scene, the accelerators only hold indices and pointers into them.
+      // Bulk primitives live in per-type arenas, hair conversions finish in build_accel().
+      std::vector<std::shared_ptr<shape>> primitives;
+      primitive_arena<shapes::triangle> triangles;
+      std::deque<primitive_arena<shapes::cubic_bezier>> curves;
+      std::vector<hair_job> hair_jobs;
+      std::vector<std::shared_ptr<const hair_cache>> hair_caches;
+      hair_shadow_grid hair_shadows;
+      const shape* hair_shadow_light = nullptr; // the light the grid is built towards
 
-      std::unordered_map<uintptr_t, bvh_tree*> strand_bvh;
       sampled_spectrum environment_color;
 
       std::unique_ptr<camera::camera> camera = nullptr;
       std::unique_ptr<texture> environment_texture = nullptr;
-      std::shared_ptr<shape> direct_light_shape = nullptr;
+      light_bvh lights;
+      // chance that a light sample is drawn from the environment texture rather than the lights
+      Float environment_prob = 0;
 
       scene() {}
-      ~scene();
+
+      // Build Embree and legacy acceleration structures concurrently within the thread budget
+      void build_accel(const render_params& params);
 
       std::shared_ptr<std::vector<rgb_spectrum>> render(
           const render_params& params,
@@ -10,8 +10,8 @@
 namespace tracer {
   class shape {
     public:
-      const tf::transform tf_shape_to_world;
-      const tf::transform tf_world_to_shape;
+      const tf::shared_transform tf_shape_to_world;
+      const tf::shared_transform tf_world_to_shape;
 
       struct intersect_opts {
         Float hit_epsilon     = 1e-4;
@@ -31,8 +31,11 @@ namespace tracer {
 
       const std::shared_ptr<material> surface;
 
+      // ray types this shape is visible to, see ray::visibility
+      unsigned int visibility = ray::ALL;
+
       shape(
-          const tf::transform& shape_to_world,
+          const tf::shared_transform& shape_to_world,
           const std::shared_ptr<material>& surface
           );
       shape(const shape& cpy);
@@ -47,8 +50,18 @@ namespace tracer {
           intersect_result* result
           ) const;
 
+      // Shapes without sample() and pdf() cannot be lights for next event estimation
+      virtual bool can_sample() const;
       virtual point3f sample(const point2f& u) const;
       virtual Float pdf() const;
+      // Point on the shape as seen from ref, pdf is per solid angle at ref and 0 when the shape's
+      // own front hides the point. By default the area sample is converted.
+      virtual point3f sample_solid_angle(const point3f& ref, const point2f& u, Float* pdf) const;
+      // pdf of sample_solid_angle() for the first point of the shape along dir, 0 if dir misses
+      virtual Float pdf_solid_angle(const point3f& ref, const vector3f& dir) const;
+      // Axis and half angle of a cone holding the shape's normals up to their sign, the whole
+      // sphere unless the shape is flat
+      virtual vector3f normal_cone(Float* theta) const;
 
     protected:
       bool world_bounds_cached;
@@ -86,7 +99,7 @@ namespace tracer {
 
     public:
       destimator(
-          const tf::transform& shape_to_world,
+          const tf::shared_transform& shape_to_world,
           const std::shared_ptr<material>& surface
           );
   };
@@ -5,6 +5,7 @@
 
 namespace tracer {
   namespace shapes {
+    // Control points are moved to world space on construction and keep an identity transform
     class cubic_bezier : public shape {
       public:
         const Float thickness0, thickness1;
@@ -16,7 +17,7 @@ namespace tracer {
         };
 
         cubic_bezier(
-            const tf::transform& shape_to_world,
+            const tf::shared_transform& shape_to_world,
             const std::shared_ptr<material>& surface,
             const point3f cps[4],
             Float thickness0,
@@ -24,7 +25,6 @@ namespace tracer {
             const normal3f normal[4] = nullptr
             );
 
-        bounds3f world_bounds_explicit() const override;
         bounds3f bounds() const override;
 
         bool intersect_shape(
@@ -58,38 +58,57 @@ namespace tracer {
             + 3 * pow2(u) * (cps[3] - cps[2]);
         }
 
+        // Normal at a hit p near parameter u, pointing away from the axis so that it does not
+        // depend on where the curve sits in world space. Hits on the axis itself, like the
+        // middle of a flat curve, face the ray instead. xbasis is the unit tangent.
+        inline static normal3f fiber_normal(
+            Float u,
+            const point3f cps[4],
+            const point3f& p,
+            const vector3f& xbasis,
+            const vector3f& dir)
+        {
+          vector3f away = p - evaluate(u, cps);
+          away = away - xbasis * away.dot(xbasis);
+          if (away.size_sq() < pow2(FLOAT_TOLERANT)) away = xbasis * dir.dot(xbasis) - dir;
+          return away.is_zero() ? normal3f(0, 1, 0) : normal3f(away.normalized());
+        }
+
+        // hair_id is 0 unless the curve belongs to a strand-restricted hair
         uintptr_t hair_id = 0;
         size_t strand_id = 0;
         unsigned int curve_id = 0;
 
-      private:
-        bool intersect_recursive(
-            const ray& r,
-            intersect_result* result,
-            const point3f cps[4],
-            const normal3f normals[4],
-            Float u_min,
-            Float u_max,
-            int depth
-            ) const;
-
-        inline Float wang_term(const Float3& x) const {
-          return std::abs(x[0] - 2 * x[1] + x[2]);
+        inline bool same_strand(const cubic_bezier& other) const {
+          return hair_id == other.hair_id && strand_id == other.strand_id;
         }
 
-        inline int wang_depth(const point3f cps[4]) const {
+        // Longest second difference of the control points, 6 times it bounds |d^2p/du^2|
+        inline Float second_difference() const {
           Float L0 = 0;
           for (int i = 0; i < 2; ++i) {
-            L0 = std::max(L0, max3(
-                  wang_term({ cps[i].x, cps[i+1].x, cps[i+2].x }),
-                  wang_term({ cps[i].y, cps[i+1].y, cps[i+2].y }),
-                  wang_term({ cps[i].z, cps[i+1].z, cps[i+2].z })
-                  )
-                );
+            L0 = std::max(L0, vector3f(
+                  control_points[i] - 2 * control_points[i+1] + control_points[i+2]
+                  ).size());
           }
+          return L0;
+        }
+
+      private:
+        static constexpr int MAX_DEPTH = 10;
+
+        // subdivision depth, fixed per curve since it does not depend on the ray
+        int depth;
+
+        // Wang's bound on the number of halvings until the segments are flat enough. It uses
+        // the length of the second differences, which does not change under the projection to
+        // ray space, so the result holds for every ray.
+        inline int wang_depth() const {
+          const Float L0 = second_difference();
           const Float max_dist_error = std::max(thickness0, thickness1) * 0.05f;
-          const int r0 = log4_nearest(SQRT_TWO * 6.f * L0 / (8.f * max_dist_error));
-          return clamp(r0, 0, 10);
+          const Float x = SQRT_TWO * 6.f * L0 / (8.f * max_dist_error);
+          if (!(x < (1 << (2 * MAX_DEPTH)))) return MAX_DEPTH;
+          return clamp(log4_nearest(x), 0, MAX_DEPTH);
         }
     };
   }
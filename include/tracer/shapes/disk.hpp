@@ -25,8 +25,12 @@ namespace tracer {
             intersect_result* result)
           const override;
 
+        bool can_sample() const override;
         point3f sample(const point2f& u) const override;
         Float pdf() const override;
+        point3f sample_solid_angle(const point3f& ref, const point2f& u, Float* pdf)
+          const override;
+        vector3f normal_cone(Float* theta) const override;
     };
   }
 }
@@ -11,6 +11,10 @@ namespace tracer {
         const vector3f ab, bc, cd, da;
         const normal3f normal;
 
+        // Solid angle of the rectangle seen from o, and the point drawn from u in it if asked
+        // (Urena et al. 2013)
+        Float spherical_rectangle(const point3f& o, const point2f* u, point3f* p) const;
+
       public:
         quad(
             const tf::transform& shape_to_world,
@@ -29,8 +33,13 @@ namespace tracer {
             intersect_result* result)
           const override;
 
+        bool can_sample() const override;
         point3f sample(const point2f& u) const override;
         Float pdf() const override;
+        point3f sample_solid_angle(const point3f& ref, const point2f& u, Float* pdf)
+          const override;
+        Float pdf_solid_angle(const point3f& ref, const vector3f& dir) const override;
+        vector3f normal_cone(Float* theta) const override;
     };
   }
 }
@@ -9,6 +9,9 @@ namespace tracer {
       private:
         const Float radius;
 
+        // 1 - cos of the half angle of the cone the sphere covers from o outside of it
+        Float cone_extent(const point3f& o) const;
+
       public:
         sphere(
             const tf::transform& shape_to_world,
@@ -24,8 +27,13 @@ namespace tracer {
             intersect_result* result)
           const override;
 
+        bool can_sample() const override;
         point3f sample(const point2f& u) const override;
         Float pdf() const override;
+        // Only the cone of directions towards the sphere is sampled from outside of it
+        point3f sample_solid_angle(const point3f& ref, const point2f& u, Float* pdf)
+          const override;
+        Float pdf_solid_angle(const point3f& ref, const vector3f& dir) const override;
     };
   }
 }
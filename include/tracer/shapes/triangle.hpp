@@ -3,17 +3,22 @@
 
 #include "tracer/shape.hpp"
 
+// Triangles tested together by a BVH leaf, wide enough for one AVX register of floats
+#define TRIANGLE_PACKET_WIDTH (8)
+
 namespace tracer {
   namespace shapes {
+    // Triangles are moved to world space on construction and keep an identity transform
     class triangle : public shape {
       private:
-        const point3f a, b, c;
-        const vector3f ab, bc, ca;
-        const normal3f normal;
+        const point3f world_a, world_b, world_c;
+        const normal3f world_normal;
+
+        friend class triangle_packet;
 
       public:
         triangle(
-            const tf::transform& shape_to_world,
+            const tf::shared_transform& shape_to_world,
             const std::shared_ptr<material>& surface,
             const point3f& a,
             const point3f& b,
@@ -22,13 +27,61 @@ namespace tracer {
             );
 
         bounds3f bounds() const override;
-        bounds3f world_bounds_explicit() const override;
+
+        // Watertight test against the world-space vertices, skipping the ray transform
+        bool intersect(
+            const ray& r,
+            const intersect_opts& options,
+            intersect_result* result
+            ) const override;
 
         bool intersect_shape(
             const ray& r,
             const intersect_opts& options,
             intersect_result* result)
           const override;
+
+        // Complete the result of a hit found by a watertight test
+        void fill_result(const ray& r, Float t, Float b1, Float b2, intersect_result* result) const;
+
+        bool can_sample() const override;
+        point3f sample(const point2f& u) const override;
+        Float pdf() const override;
+        vector3f normal_cone(Float* theta) const override;
+    };
+
+    // Per-ray setup of the watertight test, shared by every triangle the ray visits
+    struct watertight_ray {
+      int kx, ky, kz;
+      Float sx, sy, sz;
+
+      watertight_ray(const ray& r);
+    };
+
+    // Structure-of-arrays copy of up to TRIANGLE_PACKET_WIDTH world-space triangles. The test
+    // runs on all lanes at once and only produces distances and barycentrics, the nearest lane
+    // is then turned into a full intersection result.
+    class triangle_packet {
+      private:
+        Float ax[TRIANGLE_PACKET_WIDTH], ay[TRIANGLE_PACKET_WIDTH], az[TRIANGLE_PACKET_WIDTH];
+        Float bx[TRIANGLE_PACKET_WIDTH], by[TRIANGLE_PACKET_WIDTH], bz[TRIANGLE_PACKET_WIDTH];
+        Float cx[TRIANGLE_PACKET_WIDTH], cy[TRIANGLE_PACKET_WIDTH], cz[TRIANGLE_PACKET_WIDTH];
+        unsigned int visibility[TRIANGLE_PACKET_WIDTH];
+        const triangle* triangles[TRIANGLE_PACKET_WIDTH];
+        int n_triangles = 0;
+
+        // Returns the nearest hit lane or -1
+        int nearest(const ray& r, Float* t, Float* b1, Float* b2) const;
+
+      public:
+        triangle_packet();
+
+        bool add(const triangle* tri);
+        bool full() const;
+        int size() const;
+
+        bool intersect(const ray& r, shape::intersect_result* result) const;
+        bool occluded(const ray& r) const;
     };
   }
 }
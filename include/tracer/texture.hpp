@@ -5,12 +5,15 @@
 #include <memory>
 
 #include "spectrum.hpp"
+#include "math/distribution.hpp"
 
 namespace tracer {
   class texture {
     private:
       sampled_spectrum* spectrums = nullptr;
       int width, height;
+      // of the luminance over the sphere, rows are weighted by the solid angle they cover
+      math::distribution2d importance;
 
       inline sampled_spectrum spectrum_at(const point2i& sti) const {
         const point2i stc(clamp(sti.x, 0, width - 1), clamp(sti.y, 0, height - 1));
@@ -23,6 +26,12 @@ namespace tracer {
 
       sampled_spectrum sample(const point2f& st) const;
       sampled_spectrum sample(const point3f& sph_coords) const;
+
+      // False for a black texture, no direction can be drawn from it
+      bool has_distribution() const;
+      // Direction drawn proportionally to the luminance, pdf is per solid angle
+      vector3f sample_direction(const point2f& u, Float* pdf) const;
+      Float pdf(const vector3f& dir) const;
   };
 }
 
@@ -10,6 +10,7 @@
 #include "tracer/scene.hpp"
 #include "tracer/texture.hpp"
 #include "parser.hpp"
+#include "thread_budget.hpp"
 
 using namespace tracer;
 using namespace math;
@@ -92,6 +93,11 @@ int main(int argc, char** argv) {
   std::string scene_file_name;
 
   int arg_n_threads   = 0;
+  int arg_embree_threads = 0;
+  bool arg_affinity   = false;
+  bool arg_compact    = false;
+  bool arg_robust     = false;
+  std::string arg_build_quality;
   bool verbose        = true;
   bool show_depth     = false;
   bool show_normal    = false;
@@ -115,6 +121,38 @@ int main(int argc, char** argv) {
             std::cerr << "error: please specify number of render workers" << std::endl;
             return 1;
           }
+        } else if (!std::strcmp(argv[i], "--embree-threads")) {
+          n_sub_args += 1;
+          if (i + 1 < argc) {
+            arg_embree_threads = std::atoi(argv[i+1]);
+            if (arg_embree_threads < 1) {
+              std::cerr << "error: number of Embree threads should be greater than 0" << std::endl;
+              return 1;
+            }
+          } else {
+            std::cerr << "error: please specify number of Embree threads" << std::endl;
+            return 1;
+          }
+        } else if (!std::strcmp(argv[i], "--build-quality")) {
+          n_sub_args += 1;
+          if (i + 1 < argc) {
+            arg_build_quality = argv[i+1];
+            try {
+              parser::to_build_quality(arg_build_quality);
+            } catch (const std::exception& e) {
+              std::cerr << "error: " << e.what() << std::endl;
+              return 1;
+            }
+          } else {
+            std::cerr << "error: please specify build quality" << std::endl;
+            return 1;
+          }
+        } else if (!std::strcmp(argv[i], "--affinity")) {
+          arg_affinity = true;
+        } else if (!std::strcmp(argv[i], "--compact")) {
+          arg_compact = true;
+        } else if (!std::strcmp(argv[i], "--robust")) {
+          arg_robust = true;
         } else if (!std::strcmp(argv[i], "-o")) {
           n_sub_args += 1;
           if (i + 1 < argc) {
@@ -164,6 +202,12 @@ int main(int argc, char** argv) {
             " x y coordinates of the image to render.\n"
             "\t-e, --end\tSpecify start (lower-right)"
             " x y coordinates of the image to render (exclusively).\n"
+            "\t--embree-threads\tSpecify number of Embree build threads."
+            " If not specified, the number of rendering threads is used.\n"
+            "\t--build-quality\tEmbree build quality (low, medium or high)\n"
+            "\t--affinity\tPin Embree build threads to cores\n"
+            "\t--compact\tUse compact Embree scene layout to save memory\n"
+            "\t--robust\tUse robust Embree traversal\n"
             "\t-h, --help\tPrint this help text and exit gracefully\n"
             << std::endl;
           return 0;
@@ -184,6 +228,9 @@ int main(int argc, char** argv) {
   std::wcout << "* Detected " << std::thread::hardware_concurrency()
     << " logical cores" << std::endl;
 
+  // every thread spawned during setup and rendering is accounted against this budget
+  thread_budget::global().resize(n_threads);
+
   // parse scene file
   parser scene_parser;
   std::shared_ptr<scene> main_scene;
@@ -232,6 +279,21 @@ int main(int argc, char** argv) {
     }
     params.render_bounds.p_max = render_bounds_override.p_max;
   }
+  if (arg_embree_threads) params.embree_config.n_threads = arg_embree_threads;
+  if (!arg_build_quality.empty()) {
+    params.embree_config.build_quality = parser::to_build_quality(arg_build_quality);
+  }
+  if (arg_affinity) params.embree_config.set_affinity = true;
+  if (arg_compact)  params.embree_config.compact = true;
+  if (arg_robust)   params.embree_config.robust = true;
+
+  // build acceleration structures
+  try {
+    main_scene->build_accel(params);
+  } catch (const std::exception& e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    return 1;
+  }
 
   // setup rendering
   render_profile profile;
@@ -0,0 +1,75 @@
+#include <algorithm>
+
+#include "math/distribution.hpp"
+#include "math/util.hpp"
+
+namespace math {
+
+  distribution1d::distribution1d(const Float* values, int n)
+    : func(values, values + n), cdf(n + 1)
+  {
+    cdf[0] = 0;
+    for (int i = 0; i < n; ++i) cdf[i + 1] = cdf[i] + std::max(func[i], Float(0)) / n;
+    integral = cdf[n];
+
+    // a function without mass is sampled uniformly
+    for (int i = 1; i <= n; ++i) cdf[i] = integral > 0 ? cdf[i] / integral : Float(i) / n;
+  }
+
+  int distribution1d::size() const {
+    return func.size();
+  }
+
+  Float distribution1d::total() const {
+    return integral;
+  }
+
+  Float distribution1d::sample(Float u, Float* pdf, int* offset) const {
+    const int n = size();
+    const int i = clamp(
+        int(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()) - 1, 0, n - 1
+        );
+    if (offset != nullptr) *offset = i;
+
+    const Float mass = cdf[i + 1] - cdf[i];
+    const Float d = mass > 0 ? (u - cdf[i]) / mass : 0;
+    *pdf = integral > 0 ? std::max(func[i], Float(0)) / integral : 1;
+    return std::min((i + clamp(d, Float(0), Float(1))) / n, ONE_MINUS_FLOAT_TOLERANT);
+  }
+
+  Float distribution1d::pdf(Float x) const {
+    const int n = size();
+    const int i = clamp(int(x * n), 0, n - 1);
+    return integral > 0 ? std::max(func[i], Float(0)) / integral : 1;
+  }
+
+  distribution2d::distribution2d(const Float* values, int nu, int nv) {
+    conditional.reserve(nv);
+    std::vector<Float> rows(nv);
+    for (int v = 0; v < nv; ++v) {
+      conditional.emplace_back(values + v * nu, nu);
+      rows[v] = conditional.back().total();
+    }
+    marginal = distribution1d(rows.data(), nv);
+  }
+
+  bool distribution2d::empty() const {
+    return conditional.empty() || marginal.total() <= 0;
+  }
+
+  point2f distribution2d::sample(const point2f& u, Float* pdf) const {
+    Float pdf_u, pdf_v;
+    int row;
+    const Float v = marginal.sample(u[1], &pdf_v, &row);
+    const Float s = conditional[row].sample(u[0], &pdf_u);
+    *pdf = pdf_u * pdf_v;
+    return point2f(s, v);
+  }
+
+  Float distribution2d::pdf(const point2f& p) const {
+    const int nv = conditional.size();
+    const int row = clamp(int(p[1] * nv), 0, nv - 1);
+    return marginal.pdf(p[1]) * conditional[row].pdf(p[0]);
+  }
+
+}
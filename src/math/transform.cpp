@@ -1,5 +1,8 @@
 #include "math/transform.hpp"
 #include <iostream>
+#include <array>
+#include <map>
+#include <mutex>
 
 namespace math {
   namespace tf {
@@ -61,6 +64,99 @@ namespace math {
       return new_bounds;
     }
 
+    std::shared_ptr<const shared_transform::entry> shared_transform::intern(const transform& tf) {
+      typedef std::array<Float, 16> key_type;
+      // never destroyed, shapes that outlive static destruction still release their entries
+      static std::mutex& interned_mutex = *new std::mutex;
+      static std::map<key_type, std::weak_ptr<const entry>>& interned =
+        *new std::map<key_type, std::weak_ptr<const entry>>;
+
+      key_type key;
+      std::copy(tf.mat.value_flat, tf.mat.value_flat + 16, key.begin());
+
+      std::lock_guard<std::mutex> lock(interned_mutex);
+      auto it = interned.find(key);
+      if (it != interned.end()) {
+        if (auto existing = it->second.lock()) return existing;
+      }
+
+      bool linear_identity = tf.mat.value[3][0] == 0 && tf.mat.value[3][1] == 0
+        && tf.mat.value[3][2] == 0 && tf.mat.value[3][3] == 1;
+      for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+          linear_identity &= tf.mat.value[i][j] == (i == j ? 1 : 0);
+      const vector3f offset(tf.mat.value[0][3], tf.mat.value[1][3], tf.mat.value[2][3]);
+
+      // the last handle drops its map entry, unless the key was interned again meanwhile
+      auto release = [key](const entry* e) {
+        std::lock_guard<std::mutex> lock(interned_mutex);
+        auto stale = interned.find(key);
+        if (stale != interned.end() && stale->second.expired()) interned.erase(stale);
+        delete e;
+      };
+      std::shared_ptr<const entry> created(new entry{
+          tf,
+          !linear_identity ? GENERAL
+          : (offset.x == 0 && offset.y == 0 && offset.z == 0 ? IDENTITY : TRANSLATION),
+          offset
+          }, release);
+      interned[key] = created;
+      return created;
+    }
+
+    shared_transform::shared_transform() {
+      static const std::shared_ptr<const entry> shared_identity = intern(transform());
+      shared = shared_identity;
+    }
+
+    shared_transform::shared_transform(const transform& tf) : shared(intern(tf)) {}
+
+    transform shared_transform::get() const {
+      return inverted ? shared->tf.inverse() : shared->tf;
+    }
+
+    shared_transform shared_transform::inverse() const {
+      shared_transform inv(*this);
+      inv.inverted = !inverted;
+      return inv;
+    }
+
+    vector3f shared_transform::operator()(const vector3f& v) const {
+      if (shared->type != GENERAL) return v;
+      return apply(inverted ? shared->tf.mat_inv : shared->tf.mat, v);
+    }
+
+    point3f shared_transform::operator()(const point3f& p) const {
+      switch (shared->type) {
+        case IDENTITY:    return p;
+        case TRANSLATION: return inverted ? point3f(p - shared->offset) : point3f(p + shared->offset);
+        default:          return apply(inverted ? shared->tf.mat_inv : shared->tf.mat, p);
+      }
+    }
+
+    normal3f shared_transform::operator()(const normal3f& n) const {
+      if (shared->type != GENERAL) return n;
+      const matrix4f& mat_inv = inverted ? shared->tf.mat : shared->tf.mat_inv;
+      return normal3f(mat_inv.t().dot(vector4f(n, 0)));
+    }
+
+    ray shared_transform::operator()(const ray& r) const {
+      if (shared->type == GENERAL) return apply(inverted ? shared->tf.mat_inv : shared->tf.mat, r);
+
+      // the direction is untouched, which also keeps the cached reciprocal
+      ray moved(r);
+      moved.origin = (*this)(r.origin);
+      return moved;
+    }
+
+    bounds3f shared_transform::operator()(const bounds3f& b) const {
+      switch (shared->type) {
+        case IDENTITY:    return b;
+        case TRANSLATION: return bounds3f((*this)(b.p_min), (*this)(b.p_max));
+        default:          return get()(b);
+      }
+    }
+
     vector3f apply(const matrix4f& tf_mat, const vector3f& vec) {
       const vector4f result = tf_mat.dot(vector4f(vec, 0));
       return vector3f(result);
@@ -83,7 +179,8 @@ namespace math {
           tf::apply(tf_mat, r.origin),
           new_dir,
           r.t_max * t_max_scale,
-          r.medium
+          r.medium,
+          r.mask
           );
     }
 
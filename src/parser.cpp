@@ -22,9 +22,37 @@
 #include "tracer/model.hpp"
 #include "tracer/hair.hpp"
 #include "tracer/texture.hpp"
+#include "thread_budget.hpp"
 
 parser::parser() {}
 
+RTCBuildQuality parser::to_build_quality(const std::string& quality) {
+  if (quality == "low")     return RTC_BUILD_QUALITY_LOW;
+  if (quality == "medium")  return RTC_BUILD_QUALITY_MEDIUM;
+  if (quality == "high")    return RTC_BUILD_QUALITY_HIGH;
+  throw std::runtime_error("unknown build quality `" + quality + "'");
+}
+
+RTCBuildQuality parser::parse_build_quality(const YAML::Node& node, const std::string& name) {
+  try {
+    return to_build_quality(node[name].as<std::string>());
+  } catch (const std::exception& e) {
+    throw parsing_error(node[name].Mark().line, "while parsing " + name + ": " + e.what());
+  }
+}
+
+tracer::materials::sss::walk_mode parser::parse_walk_mode(
+    const YAML::Node& node, const std::string& name)
+{
+  const std::string walk = parse_string(node, name);
+  if (walk == "spectral_mis")   return tracer::materials::sss::SPECTRAL_MIS;
+  if (walk == "delta_tracking") return tracer::materials::sss::DELTA_TRACKING;
+  if (walk == "diffusion")      return tracer::materials::sss::DIFFUSION;
+  throw parsing_error(
+      node[name].Mark().line, "walk must be `spectral_mis', `delta_tracking' or `diffusion'"
+      );
+}
+
 Float parser::parse_float(const YAML::Node& node, const std::string& name) {
   try {
     return node[name].as<Float>();
@@ -207,6 +235,19 @@ tracer::material::transport_type parser::parse_transport_model(
 }
 
 std::shared_ptr<tracer::material> parser::parse_material(const YAML::Node& mat_node) {
+  std::shared_ptr<tracer::material> surface = parse_scattering(mat_node);
+  if (mat_node["light_samples"].IsDefined()) {
+    surface->light_samples = parse_int(mat_node, "light_samples");
+    if (surface->light_samples < 1) {
+      throw parsing_error(
+          mat_node["light_samples"].Mark().line, "`light_samples' must be at least 1"
+          );
+    }
+  }
+  return surface;
+}
+
+std::shared_ptr<tracer::material> parser::parse_scattering(const YAML::Node& mat_node) {
   if (mat_node["ggx"].IsDefined()) {
     YAML::Node ggx_node = mat_node["ggx"];
     auto transport = ggx_node["transport"].IsDefined() ?
@@ -255,7 +296,9 @@ std::shared_ptr<tracer::material> parser::parse_material(const YAML::Node& mat_n
             parse_float(sss_node, "eta_t"),
             parse_rgb_spectrum(sss_node, "sigma_a"),
             parse_rgb_spectrum(sss_node, "sigma_s"),
-            sss_node["g"].IsDefined() ? parse_float(sss_node, "g") : 0.f
+            sss_node["g"].IsDefined() ? parse_float(sss_node, "g") : 0.f,
+            sss_node["walk"].IsDefined() ?
+            parse_walk_mode(sss_node, "walk") : tracer::materials::sss::SPECTRAL_MIS
             ));
     } else {
       throw parsing_error(
@@ -280,7 +323,7 @@ std::shared_ptr<tracer::material> parser::parse_material(const YAML::Node& mat_n
         && hairpt_node["eta_i"].IsDefined()   && hairpt_node["eta_t"].IsDefined()
         && hairpt_node["alpha"].IsDefined())
     {
-      return std::shared_ptr<tracer::material>(new tracer::materials::hairpt(
+      auto hair = std::make_shared<tracer::materials::hairpt>(
             parse_rgb_spectrum(hairpt_node, "rgb_refl"),
             parse_rgb_spectrum(hairpt_node, "emittance"),
             parse_float(hairpt_node, "eta_i"),
@@ -290,8 +333,18 @@ std::shared_ptr<tracer::material> parser::parse_material(const YAML::Node& mat_n
             parse_float(hairpt_node, "alpha"),
             hairpt_node["eumelanin"].IsDefined() ? parse_float(hairpt_node, "eumelanin") : -1.f,
             hairpt_node["pheomelanin"].IsDefined() ? parse_float(hairpt_node, "pheomelanin") : -1.f
-            )
-          );
+            );
+      if (hairpt_node["dual_scattering"].IsDefined()
+          && parse_bool(hairpt_node, "dual_scattering"))
+      {
+        hair->enable_dual_scattering(
+            hairpt_node["forward_density"].IsDefined() ?
+            parse_float(hairpt_node, "forward_density") : 0.7f,
+            hairpt_node["backward_density"].IsDefined() ?
+            parse_float(hairpt_node, "backward_density") : 0.7f
+            );
+      }
+      return hair;
     } else {
       throw parsing_error(hairpt_node.Mark().line,
           "specify rgb_refl, emittance, beta_m, beta_n, eta_i, eta_t and alpha"
@@ -442,8 +495,32 @@ std::shared_ptr<tracer::shape> parser::parse_shape(
   throw parsing_error(attr["shape"].Mark().line, "unknown shape `" + name + "'");
 }
 
+unsigned int parser::parse_visibility(const YAML::Node& object_node) {
+  unsigned int visibility = tracer::ray::ALL;
+  if (!object_node["visibility"].IsDefined()) return visibility;
+
+  const YAML::Node vis_node = object_node["visibility"];
+  if (!vis_node.IsMap()) {
+    throw parsing_error(vis_node.Mark().line, "`visibility' must be a map");
+  }
+
+  const std::pair<const char*, tracer::ray::visibility> ray_types[] = {
+    { "camera", tracer::ray::CAMERA },
+    { "bounce", tracer::ray::BOUNCE },
+    { "shadow", tracer::ray::SHADOW },
+    { "sss",    tracer::ray::SUBSURFACE }
+  };
+  for (const auto& ray_type : ray_types) {
+    if (vis_node[ray_type.first].IsDefined() && !parse_bool(vis_node, ray_type.first)) {
+      visibility &= ~ray_type.second;
+    }
+  }
+
+  return visibility;
+}
+
 void parser::parse_model(
-    std::vector<std::shared_ptr<tracer::shape>>& shapes,
+    tracer::primitive_arena<tracer::shapes::triangle>& triangles,
     const YAML::Node& model_node
     )
 {
@@ -451,22 +528,21 @@ void parser::parse_model(
   std::shared_ptr<tracer::material> surface = parse_material(model_node["material"]);
   tracer::model model(tf, surface, parse_string(model_node, "model"));
 
-  model.load(shapes);
+  model.load(triangles);
 }
 
-bvh_tree* parser::parse_hair(
-    std::vector<std::shared_ptr<tracer::shape>>& shapes,
+tracer::hair_job parser::parse_hair(
     const YAML::Node& hair_node,
-    uintptr_t* hair_id
+    const math::point3f& eye_position
     )
 {
   math::tf::transform tf = parse_transform(hair_node["transform"]);
   std::shared_ptr<tracer::material> surface = parse_material(hair_node["material"]);
-  tracer::hair hair(parse_string(hair_node, "hair"));
+  const std::string fpath = parse_string(hair_node, "hair");
 
   size_t n_strands = 0;
   Float thickness_scale = 1;
-  bool subbvh = false;
+  bool strand_walk = false;
   bool subdivide = false;
   if (hair_node["strands"].IsDefined()) {
     n_strands = parse_int(hair_node, "strands");
@@ -474,16 +550,100 @@ bvh_tree* parser::parse_hair(
   if (hair_node["thickness_scale"].IsDefined()) {
     thickness_scale = parse_float(hair_node, "thickness_scale");
   }
+  // `subbvh' is kept for older scene files; strands no longer get their own BVH
   if (hair_node["subbvh"].IsDefined()) {
-    subbvh = parse_bool(hair_node, "subbvh");
+    strand_walk = parse_bool(hair_node, "subbvh");
+  }
+  if (hair_node["strand_walk"].IsDefined()) {
+    strand_walk = parse_bool(hair_node, "strand_walk");
   }
   if (hair_node["subdivide"].IsDefined()) {
     subdivide = parse_bool(hair_node, "subdivide");
   }
+  const unsigned int visibility = parse_visibility(hair_node);
+
+  // strand simplification, either a fixed fraction of strands or one that falls off with the
+  // squared distance to the eye, keeping the number of strands per pixel roughly constant
+  Float lod = 1;
+  Float lod_distance = 0;
+  if (hair_node["lod"].IsDefined()) {
+    lod = parse_float(hair_node, "lod");
+    if (!(lod > 0 && lod <= 1)) {
+      throw parsing_error(hair_node["lod"].Mark().line, "hair `lod' must be in (0, 1]");
+    }
+  } else if (hair_node["lod_distance"].IsDefined()) {
+    lod_distance = parse_float(hair_node, "lod_distance");
+    if (!(lod_distance > 0)) {
+      throw parsing_error(
+          hair_node["lod_distance"].Mark().line, "hair `lod_distance' must be positive"
+          );
+    }
+  }
 
-  return hair.to_beziers(
-      shapes, tf, surface, hair_id, n_strands, thickness_scale, subbvh, subdivide
-      );
+  // converted curves are kept in a cache file, valid as long as the hair file and the
+  // settings above do not change
+  std::string cache_path;
+  if (hair_node["cache"].IsDefined()) {
+    cache_path = parse_string(hair_node, "cache");
+  }
+
+  tracer::hair_job job;
+  if (!cache_path.empty()) job.cache = std::make_shared<tracer::hair_cache>();
+  const auto hair_material = std::dynamic_pointer_cast<tracer::materials::hairpt>(surface);
+  job.dual_scattering = hair_material != nullptr && hair_material->dual_scattering();
+  if (hair_node["linear"].IsDefined()) {
+    const std::string basis = parse_string(hair_node, "linear");
+    if (basis == "round") {
+      job.basis = tracer::embree_accel::ROUND_LINEAR;
+    } else if (basis == "flat") {
+      job.basis = tracer::embree_accel::FLAT_LINEAR;
+    } else {
+      throw parsing_error(
+          hair_node["linear"].Mark().line, "linear hair must be `round' or `flat'"
+          );
+    }
+  }
+
+  // loading and converting hair files is slow, let it overlap with the rest of the setup
+  std::shared_ptr<tracer::hair_cache> cache = job.cache;
+  job.curves = thread_budget::global().dispatch(
+      [=]() {
+        tracer::primitive_arena<tracer::shapes::cubic_bezier> curves;
+        uint64_t cache_key = 0;
+        if (cache) {
+          cache_key = tracer::hair_cache::make_key(
+              fpath, tf, n_strands, thickness_scale, strand_walk, subdivide,
+              lod, lod_distance, eye_position
+              );
+          if (cache->open(cache_path, cache_key)) {
+            cache->to_beziers(curves, surface, tracer::hair::new_id());
+            for (tracer::shapes::cubic_bezier& curve : curves) curve.visibility = visibility;
+            return curves;
+          }
+        }
+
+        tracer::hair hair(fpath);
+        Float strand_lod = lod;
+        if (lod_distance > 0) {
+          static const Float MIN_LOD = 1.f / 64;
+          const Float distance = (tf(hair.bounds().centroid()) - eye_position).size();
+          strand_lod = math::clamp(math::pow2(lod_distance / distance), MIN_LOD, Float(1));
+        }
+        hair.to_beziers(
+            curves, tf, surface, n_strands, thickness_scale, strand_walk, subdivide, strand_lod
+            );
+        if (cache) {
+          if (tracer::hair_cache::write(cache_path, cache_key, curves)) {
+            // map what was just written so that Embree can share it as well
+            cache->open(cache_path, cache_key);
+          } else {
+            std::cerr << "warning: cannot write hair cache " << cache_path << std::endl;
+          }
+        }
+        for (tracer::shapes::cubic_bezier& curve : curves) curve.visibility = visibility;
+        return curves;
+      });
+  return job;
 }
 
 std::unique_ptr<tracer::camera::camera> parser::parse_camera(
@@ -576,9 +736,34 @@ std::shared_ptr<tracer::scene> parser::load_scene(
     if (render_config["mis"].IsDefined()) {
       params->mis = parse_bool(render_config, "mis");
     }
+    if (render_config["light_samples"].IsDefined()) {
+      params->light_samples = parse_int(render_config, "light_samples");
+      if (params->light_samples < 1) {
+        throw parsing_error(
+            render_config["light_samples"].Mark().line, "`light_samples' must be at least 1"
+            );
+      }
+    }
     if (render_config["legacy"].IsDefined()) {
       params->legacy = parse_bool(render_config, "legacy");
     }
+    if (render_config["hair_pixel_error"].IsDefined()) {
+      params->hair_pixel_error = parse_float(render_config, "hair_pixel_error");
+    }
+    if (render_config["hair_shadow_tolerance"].IsDefined()) {
+      params->hair_shadow_tolerance = parse_float(render_config, "hair_shadow_tolerance");
+      if (!(params->hair_shadow_tolerance >= 0 && params->hair_shadow_tolerance <= 1)) {
+        throw parsing_error(
+            render_config["hair_shadow_tolerance"].Mark().line,
+            "`hair_shadow_tolerance' must be in [0, 1]"
+            );
+      }
+    }
+    if (render_config["hair_shadow_exact_distance"].IsDefined()) {
+      params->hair_shadow_exact_distance = parse_float(
+          render_config, "hair_shadow_exact_distance"
+          );
+    }
   }
 
   // intersect options
@@ -598,75 +783,85 @@ std::shared_ptr<tracer::scene> parser::load_scene(
     }
   }
 
+  // Embree options
+  if (root["embree"].IsDefined()) {
+    YAML::Node embree_config = root["embree"];
+    if (embree_config["threads"].IsDefined()) {
+      params->embree_config.n_threads = parse_int(embree_config, "threads");
+    }
+    if (embree_config["affinity"].IsDefined()) {
+      params->embree_config.set_affinity = parse_bool(embree_config, "affinity");
+    }
+    if (embree_config["build_quality"].IsDefined()) {
+      params->embree_config.build_quality = parse_build_quality(embree_config, "build_quality");
+    }
+    if (embree_config["compact"].IsDefined()) {
+      params->embree_config.compact = parse_bool(embree_config, "compact");
+    }
+    if (embree_config["robust"].IsDefined()) {
+      params->embree_config.robust = parse_bool(embree_config, "robust");
+    }
+  }
+
   // define scene
   auto main_scene = std::make_shared<tracer::scene>();
   if (root["scene"].IsDefined()) {
     YAML::Node scene_config = root["scene"];
 
-    std::vector<std::shared_ptr<tracer::shape>> shapes;
-    std::vector<std::shared_ptr<tracer::shape>> hair_shapes;
+    // the camera comes first, hair level of detail depends on the eye position
+    if (scene_config["camera"].IsDefined()) {
+      main_scene->camera = parse_camera(
+          scene_config["camera"], params->img_res, &params->eye_position
+          );
+    } else {
+      throw parsing_error(scene_config.Mark().line, "`camera' must be specified");
+    }
+
+    std::vector<std::shared_ptr<tracer::shape>>& shapes = main_scene->primitives;
+    tracer::primitive_arena<tracer::shapes::triangle>& triangles = main_scene->triangles;
     if (scene_config["objects"].IsDefined()) {
       YAML::Node object_node = scene_config["objects"];
       if (object_node.IsSequence()) {
         for (size_t i = 0; i < object_node.size(); ++i) {
           YAML::Node object = object_node[i];
+          const size_t first_shape = shapes.size();
+          const size_t first_triangle = triangles.size();
           if (object["shape"].IsDefined()) {
             std::string shape_name = object["shape"].as<std::string>();
             shapes.push_back(parse_shape(object, shape_name));
           } else if (object["model"].IsDefined()) {
-            parse_model(shapes, object);
+            parse_model(triangles, object);
           } else if (object["hair"].IsDefined()) {
-            uintptr_t hair_id;
-            auto strand_bvh = parse_hair(hair_shapes, object, &hair_id);
-            main_scene->strand_bvh[hair_id] = strand_bvh;
-
-            if (params->legacy) {
-              std::wcout << L"* Using legacy BVH" << std::endl;
-              shapes.insert(shapes.end(), hair_shapes.begin(), hair_shapes.end());
-            } else {
-              main_scene->embree_shapes.add_hair(hair_shapes);
-              std::wcout << L"  * Building Embree acceleration structure containing "
-                << hair_shapes.size() << L" hair segments..." << std::flush;
-              main_scene->embree_shapes.commit();
-              std::wcout << L" done" << std::endl;
-            }
+            main_scene->hair_jobs.push_back(parse_hair(object, params->eye_position));
           } else {
             throw parsing_error(
                 object_node.Mark().line,
                 "an object's shape must be specified by attribute `shape'"
                 );
           }
+
+          const unsigned int visibility = parse_visibility(object);
+          for (size_t j = first_shape; j < shapes.size(); ++j) shapes[j]->visibility = visibility;
+          for (size_t j = first_triangle; j < triangles.size(); ++j) {
+            triangles[j].visibility = visibility;
+          }
         }
       } else {
         throw parsing_error(object_node.Mark().line, "`objects' must be a sequence");
       }
     }
 
-    std::wcout << L"  * Building legacy BVH containing "
-      << shapes.size() << L" shapes..." << std::flush;
-    bvh_tree scene_shapes(shapes);
-    std::wcout << L" done" << std::endl;
-
-    main_scene->legacy_shapes = scene_shapes;
-
+    // the scene gathers its lights once the accelerators are built
     bool light_found = false;
     for (const std::shared_ptr<tracer::shape>& s : shapes) {
-      if (s->surface->transport_model == tracer::material::EMIT) {
-        main_scene->direct_light_shape = s;
-        light_found = true;
-      }
+      if (s->surface->transport_model == tracer::material::EMIT) light_found = true;
+    }
+    for (const tracer::shapes::triangle& t : triangles) {
+      if (t.surface->transport_model == tracer::material::EMIT) light_found = true;
     }
 
     if (!light_found) std::cerr << "warning: rendering without any light source" << std::endl;
 
-    if (scene_config["camera"].IsDefined()) {
-      main_scene->camera = parse_camera(
-          scene_config["camera"], params->img_res, &params->eye_position
-          );
-    } else {
-      throw parsing_error(scene_config.Mark().line, "`camera' must be specified");
-    }
-
     if (scene_config["environment"].IsDefined()) {
       YAML::Node env_node = scene_config["environment"];
       if (env_node["hdr"].IsDefined()) {
@@ -0,0 +1,34 @@
+#include <algorithm>
+
+#include "thread_budget.hpp"
+
+thread_budget::thread_budget(int n_threads) {
+  resize(n_threads);
+}
+
+thread_budget& thread_budget::global() {
+  static thread_budget budget;
+  return budget;
+}
+
+void thread_budget::resize(int n_threads) {
+  this->n_threads = std::max(1, n_threads);
+  n_available = this->n_threads - 1;
+}
+
+int thread_budget::size() const {
+  return n_threads;
+}
+
+int thread_budget::reserve(int n) {
+  int available = n_available;
+  int taken;
+  do {
+    taken = std::min(n, std::max(available, 0));
+  } while (taken > 0 && !n_available.compare_exchange_weak(available, available - taken));
+  return taken;
+}
+
+void thread_budget::release(int n) {
+  n_available += n;
+}
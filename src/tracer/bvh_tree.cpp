@@ -1,18 +1,19 @@
 #include "tracer/bvh_tree.hpp"
 #include "tracer/shapes/de_box.hpp"
+#include "tracer/shapes/cubic_bezier.hpp"
 #include "math/util.hpp"
+#include "thread_budget.hpp"
 
 #define MAX_SHAPES_PER_NODE (4)
+#define MAX_TRIANGLES_PER_NODE (TRIANGLE_PACKET_WIDTH)
 #define N_BUCKETS (16)
 
 namespace tracer {
-  bvh_tree::bvh_tree(std::vector<std::shared_ptr<shape>> shapes) {
-    n_available_workers = std::thread::hardware_concurrency();
-    root = construct_tree(shapes, 0, shapes.size());
+  bvh_tree::bvh_tree(std::vector<shape*> shapes) : shapes(std::move(shapes)) {
+    root = construct_tree(0, this->shapes.size());
   }
 
   std::shared_ptr<bvh_tree::bvh_node> bvh_tree::construct_tree(
-      std::vector<std::shared_ptr<shape>>& shapes,
       int start,
       int end,
       std::shared_ptr<bvh_node>* ret_node
@@ -23,16 +24,34 @@ namespace tracer {
 
     std::shared_ptr<bvh_node> node = std::make_shared<bvh_node>();
 
-    // create leaf
+    // create leaf, triangle-only leaves may grow up to a full packet
     const int n_shapes_node = end - start;
-    if (n_shapes_node <= MAX_SHAPES_PER_NODE) {
+    bool triangles_only = n_shapes_node <= MAX_TRIANGLES_PER_NODE;
+    for (int i = start; triangles_only && i < end; ++i) {
+      triangles_only = dynamic_cast<const shapes::triangle*>(shapes[i]) != nullptr;
+    }
+    if (n_shapes_node <= MAX_SHAPES_PER_NODE || triangles_only) {
       // merge bounds
       node->bounds = shapes[start]->world_bounds();
       for (int i = start + 1; i < end; ++i) {
         node->bounds = node->bounds.merge(shapes[i]->world_bounds());
       }
-      for (int i = 0; i < n_shapes_node; ++i) {
-        node->shapes.push_back(shapes[start + i]);
+      // other shapes go first so the leaf can refer to them as a range
+      auto first_triangle = std::stable_partition(
+          shapes.begin() + start, shapes.begin() + end,
+          [](const shape* s) { return dynamic_cast<const shapes::triangle*>(s) == nullptr; }
+          );
+      node->shapes_offset = start;
+      node->shapes_count = first_triangle - (shapes.begin() + start);
+
+      for (int i = start; i < end; ++i) {
+        node->visibility |= shapes[i]->visibility;
+        if (i < start + (int) node->shapes_count) continue;
+
+        if (node->triangles.empty() || node->triangles.back().full()) {
+          node->triangles.emplace_back();
+        }
+        node->triangles.back().add(static_cast<const shapes::triangle*>(shapes[i]));
       }
     } else {
       // select partition dimension by determining which centroid bounds axis is the longest
@@ -72,7 +91,7 @@ namespace tracer {
 
       // partiion shapes by the selected axis
       auto pivot = std::partition(shapes.begin() + start, shapes.begin() + end,
-          [&](const std::shared_ptr<shape>& s) -> bool {
+          [&](shape* s) -> bool {
             // find bucket position
             Float bucket_i = centroid_bounds.uvw(
                 s->world_bounds().centroid()
@@ -84,11 +103,13 @@ namespace tracer {
       int split = pivot - shapes.begin();
       if (split <= start) split = std::max(start + 1, start + std::rand() % n_shapes_node);
 
-      std::thread *worker0, *worker1;
-      worker0 = dispatch_construction(shapes, start, split, &node->children[0]);
-      worker1 = dispatch_construction(shapes, split, end, &node->children[1]);
-      wait_worker(worker0);
-      wait_worker(worker1);
+      auto worker0 = dispatch_construction(start, split, &node->children[0]);
+      auto worker1 = dispatch_construction(split, end, &node->children[1]);
+      worker0.wait();
+      worker1.wait();
+
+      for (int i = 0; i < 2; ++i)
+        if (node->children[i]) node->visibility |= node->children[i]->visibility;
 
       // merge children bounds
       if (node->children[0] && node->children[1])
@@ -105,7 +126,9 @@ namespace tracer {
 
   size_t bvh_tree::n_shapes(const std::shared_ptr<bvh_node>& node) const {
     if (node == nullptr) return 0;
-    return node->shapes.size() + n_shapes(node->children[0]) + n_shapes(node->children[1]);
+    size_t n = node->shapes_count;
+    for (const shapes::triangle_packet& packet : node->triangles) n += packet.size();
+    return n + n_shapes(node->children[0]) + n_shapes(node->children[1]);
   }
 
   size_t bvh_tree::n_shapes() const {
@@ -118,22 +141,43 @@ namespace tracer {
       shape::intersect_result* result
       ) const
   {
-    return intersect(root, r, options, result);
+    if (root == nullptr) return false;
+    return intersect(root, r, options, result, nullptr);
+  }
+
+  bool bvh_tree::intersect(
+      const ray& r,
+      const shape::intersect_opts& options,
+      shape::intersect_result* result,
+      const shapes::cubic_bezier* strand
+      ) const
+  {
+    if (root == nullptr) return false;
+    return intersect(root, r, options, result, strand);
   }
 
   bool bvh_tree::intersect(
       const std::shared_ptr<bvh_node>& node,
       const ray& r,
       const shape::intersect_opts& options,
-      shape::intersect_result* result
+      shape::intersect_result* result,
+      const shapes::cubic_bezier* strand
       ) const
   {
+    // skip subtrees holding nothing visible to this ray type
+    if ((node->visibility & r.mask) == 0) return false;
     if (!node->bounds.intersect(r)) return false;
 
     bool hit = false;
-    for (size_t i = 0; i < node->shapes.size(); ++i) {
+    const shape* const* leaf_shapes = shapes.data() + node->shapes_offset;
+    for (uint32_t i = 0; i < node->shapes_count; ++i) {
+      if ((leaf_shapes[i]->visibility & r.mask) == 0) continue;
+      if (strand != nullptr) {
+        auto curve = dynamic_cast<const shapes::cubic_bezier*>(leaf_shapes[i]);
+        if (curve == nullptr || !curve->same_strand(*strand)) continue;
+      }
       shape::intersect_result inner_result;
-      bool inner_hit = node->shapes[i]->intersect(r, options, &inner_result);
+      bool inner_hit = leaf_shapes[i]->intersect(r, options, &inner_result);
       if (inner_hit) {
         hit = true;
         if (inner_result.t_hit < result->t_hit) {
@@ -142,20 +186,34 @@ namespace tracer {
       }
     }
 
+    // triangles are never part of a strand
+    if (strand == nullptr) {
+      for (const shapes::triangle_packet& packet : node->triangles) {
+        shape::intersect_result inner_result;
+        if (packet.intersect(r, &inner_result)) {
+          hit = true;
+          if (inner_result.t_hit < result->t_hit) {
+            *result = inner_result;
+          }
+        }
+      }
+    }
+
     int left = 0, right = 1;
     point3i negative_dir(r.dir.x < 0, r.dir.y < 0, r.dir.z < 0);
     if (node->split_dim >= 0) {
       if (negative_dir[node->split_dim]) std::swap(left, right);
       if (node->children[left])
-        hit |= intersect(node->children[left], r, options, result);
+        hit |= intersect(node->children[left], r, options, result, strand);
       if (node->children[right])
-        hit |= intersect(node->children[right], r, options, result);
+        hit |= intersect(node->children[right], r, options, result, strand);
     }
 
     return hit;
   }
 
   bool bvh_tree::occluded(const ray& r, const shape::intersect_opts& options) const {
+    if (root == nullptr) return false;
     return occluded(root, r, options);
   }
 
@@ -165,11 +223,17 @@ namespace tracer {
       const shape::intersect_opts& options
       ) const
   {
+    if ((node->visibility & r.mask) == 0) return false;
     if (!node->bounds.intersect(r)) return false;
 
     shape::intersect_result inner_result;
-    for (size_t i = 0; i < node->shapes.size(); ++i) {
-      if (node->shapes[i]->intersect(r, options, &inner_result)) return true;
+    const shape* const* leaf_shapes = shapes.data() + node->shapes_offset;
+    for (uint32_t i = 0; i < node->shapes_count; ++i) {
+      if ((leaf_shapes[i]->visibility & r.mask) == 0) continue;
+      if (leaf_shapes[i]->intersect(r, options, &inner_result)) return true;
+    }
+    for (const shapes::triangle_packet& packet : node->triangles) {
+      if (packet.occluded(r)) return true;
     }
 
     int left = 0, right = 1;
@@ -187,35 +251,15 @@ namespace tracer {
     return false;
   }
 
-  std::thread* bvh_tree::dispatch_construction(
-      std::vector<std::shared_ptr<shape>>& shapes,
+  std::future<std::shared_ptr<bvh_tree::bvh_node>> bvh_tree::dispatch_construction(
       int start,
       int end,
       std::shared_ptr<bvh_node>* ret_node
       )
   {
-    if (n_available_workers == 0) {
-      construct_tree(shapes, start, end, ret_node);
-      return nullptr;
-    }
-
-    --n_available_workers;
-
-    std::thread *worker = new std::thread(
-        &bvh_tree::construct_tree, this, std::ref(shapes), start, end, ret_node
-        );
-
-    return worker;
-  }
-
-  void bvh_tree::wait_worker(std::thread* worker) {
-    if (worker == nullptr) return;
-    worker->join();
-    ++n_available_workers;
-    delete worker;
-  }
-
-  bool bvh_tree::workers_available() const {
-    return n_available_workers > 0;
+    // subtrees are built on worker threads as long as the process-wide budget allows
+    return thread_budget::global().dispatch([this, start, end, ret_node]() {
+        return construct_tree(start, end, ret_node);
+        });
   }
 } /* namespace tracer */
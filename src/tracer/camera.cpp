@@ -35,6 +35,10 @@ namespace tracer {
       return tf_cam_to_world(ray(origin, dir, t_max));
     }
 
+    Float ortho::pixel_footprint(const point3f& p) const {
+      return ndc_res.y / img_res.y;
+    }
+
     persp::persp(
         const tf::transform& cam_to_world,
         const vector2i& img_res,
@@ -51,5 +55,10 @@ namespace tracer {
       const point3f origin(tf_raster_to_cam(point3f(img_point)));
       return tf_cam_to_world(ray(origin, origin, (far - near) / std::cos(fovy / 2)));
     }
+
+    Float persp::pixel_footprint(const point3f& p) const {
+      const Float dist = (p - tf_cam_to_world(point3f(0, 0, 0))).size();
+      return 2 * std::tan(fovy / 2) * dist / img_res.y;
+    }
   }
 }
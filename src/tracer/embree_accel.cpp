@@ -1,23 +1,45 @@
+#include <algorithm>
+
 #include "tracer/embree_accel.hpp"
+#include "thread_budget.hpp"
 
 namespace tracer {
-  embree_accel::embree_accel() {
-    embree_device = rtcNewDevice(nullptr);
+  void embree_accel::init(const device_config& config) {
+    // the calling thread joins the build, the other threads are held until the commit
+    budget_slots = thread_budget::global().reserve(
+        (config.n_threads > 0 ? config.n_threads : thread_budget::global().size()) - 1
+        );
+    const int n_threads = 1 + budget_slots;
+    const std::string device_config = "threads=" + std::to_string(n_threads)
+      + ",set_affinity=" + (config.set_affinity ? "1" : "0");
+
+    embree_device = rtcNewDevice(device_config.c_str());
+    if (embree_device == nullptr) {
+      throw std::runtime_error("failed to create Embree device");
+    }
     embree_scene = rtcNewScene(embree_device);
 
-    rtcSetSceneBuildQuality(embree_scene, RTC_BUILD_QUALITY_HIGH);
+    int scene_flags = RTC_SCENE_FLAG_NONE;
+    if (config.compact) scene_flags |= RTC_SCENE_FLAG_COMPACT;
+    if (config.robust)  scene_flags |= RTC_SCENE_FLAG_ROBUST;
+    if (config.count_hits) scene_flags |= RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION;
+    rtcSetSceneFlags(embree_scene, static_cast<RTCSceneFlags>(scene_flags));
+
+    build_quality = config.build_quality;
+    rtcSetSceneBuildQuality(embree_scene, build_quality);
   }
 
   embree_accel::~embree_accel() {
-    rtcReleaseScene(embree_scene);
-    rtcReleaseDevice(embree_device);
+    thread_budget::global().release(budget_slots);
+    if (embree_scene != nullptr) rtcReleaseScene(embree_scene);
+    if (embree_device != nullptr) rtcReleaseDevice(embree_device);
   }
 
-  embree_accel::geom_id embree_accel::add_hair(const std::vector<std::shared_ptr<shape>>& curves) {
-    for (size_t i = 0; i < curves.size(); ++i)
-      beziers.push_back(std::dynamic_pointer_cast<shapes::cubic_bezier>(curves[i]));
-
-    for (size_t i = 0; i < curves.size(); ++i) {
+  embree_accel::geom_id embree_accel::add_hair(
+      const primitive_arena<shapes::cubic_bezier>& curves,
+      const vector4f* shared_vertices)
+  {
+    for (const shapes::cubic_bezier& bezier : curves) {
       RTCGeometry geom = rtcNewGeometry(embree_device, RTC_GEOMETRY_TYPE_FLAT_BEZIER_CURVE);
       rtcSetGeometryVertexAttributeCount(geom, 1);
 
@@ -34,20 +56,39 @@ namespace tracer {
           );
 
       // initialize curve vertices
-      vector4f* curve_vertices = (vector4f*) rtcSetNewGeometryBuffer(
-          geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(vector4f), 4
-          );
+      if (shared_vertices != nullptr) {
+        rtcSetSharedGeometryBuffer(
+            geom,
+            RTC_BUFFER_TYPE_VERTEX,
+            0,
+            RTC_FORMAT_FLOAT4,
+            shared_vertices,
+            4 * bezier.curve_id * sizeof(vector4f),
+            sizeof(vector4f),
+            4
+            );
+      } else {
+        vector4f* curve_vertices = (vector4f*) rtcSetNewGeometryBuffer(
+            geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(vector4f), 4
+            );
 
-      Float u = 0;
-      for (size_t j = 0; j < 4; ++j) {
-        curve_vertices[j] = beziers[i]->tf_shape_to_world(beziers[i]->control_points[j]);
-        curve_vertices[j][3] = math::lerp(u, beziers[i]->thickness0, beziers[i]->thickness1);
-        u += 1.f / 3;
+        Float u = 0;
+        for (size_t j = 0; j < 4; ++j) {
+          curve_vertices[j] = bezier.control_points[j];
+          curve_vertices[j][3] = math::lerp(u, bezier.thickness0, bezier.thickness1);
+          u += 1.f / 3;
+        }
       }
 
       // build geometry
-      rtcSetGeometryUserData(geom, beziers[i].get());
-      rtcSetGeometryBuildQuality(geom, RTC_BUILD_QUALITY_HIGH);
+      rtcSetGeometryUserData(geom, const_cast<shapes::cubic_bezier*>(&bezier));
+      rtcSetGeometryMask(geom, bezier.visibility);
+      // only pay for filter callbacks on curves that can actually be rejected
+      if (bezier.hair_id != 0 || bezier.visibility != ray::ALL)
+        rtcSetGeometryIntersectFilterFunction(geom, hit_filter);
+      if (bezier.visibility != ray::ALL)
+        rtcSetGeometryOccludedFilterFunction(geom, hit_filter);
+      rtcSetGeometryBuildQuality(geom, build_quality);
       rtcCommitGeometry(geom);
       if (rtcGetDeviceError(embree_device) != RTC_ERROR_NONE) {
         throw std::runtime_error("curve geometry malformed");
@@ -60,8 +101,84 @@ namespace tracer {
     return curves.size();
   }
 
+  size_t embree_accel::add_linear_hair(
+      const primitive_arena<shapes::cubic_bezier>& curves,
+      const std::vector<uint32_t>& n_segments,
+      bool flat)
+  {
+    ASSERT(n_segments.size() == curves.size(), "segment count missing for some curves");
+    if (curves.empty()) return 0;
+
+    std::unique_ptr<linear_hair> hair(new linear_hair);
+    hair->curves = &curves;
+    size_t n_total = 0;
+    for (uint32_t n : n_segments) n_total += n;
+    hair->segment_curve.reserve(n_total);
+    hair->segment_u0.reserve(n_total);
+    hair->segment_du.reserve(n_total);
+
+    RTCGeometry geom = rtcNewGeometry(
+        embree_device,
+        flat ? RTC_GEOMETRY_TYPE_FLAT_LINEAR_CURVE : RTC_GEOMETRY_TYPE_ROUND_LINEAR_CURVE
+        );
+
+    // every curve contributes n + 1 vertices, segments start at all but the last one
+    vector4f* vertices = (vector4f*) rtcSetNewGeometryBuffer(
+        geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(vector4f),
+        n_total + curves.size()
+        );
+    unsigned int* indices = (unsigned int*) rtcSetNewGeometryBuffer(
+        geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, sizeof(unsigned int), n_total
+        );
+
+    unsigned int vertex = 0;
+    for (primitive_arena<shapes::cubic_bezier>::index i = 0; i < curves.size(); ++i) {
+      const shapes::cubic_bezier& bezier = curves[i];
+      const uint32_t n = n_segments[i];
+      const Float du = Float(1) / n;
+      for (uint32_t j = 0; j <= n; ++j) {
+        const Float u = j * du;
+        vertices[vertex + j] = shapes::cubic_bezier::evaluate(u, bezier.control_points);
+        vertices[vertex + j][3] = math::lerp(u, bezier.thickness0, bezier.thickness1);
+        if (j == n) continue;
+
+        *indices++ = vertex + j;
+        hair->segment_curve.push_back(i);
+        hair->segment_u0.push_back(u);
+        hair->segment_du.push_back(du);
+      }
+      vertex += n + 1;
+    }
+
+    // visibility and strands are set per hair object, the first curve speaks for all
+    const shapes::cubic_bezier& first = curves[0];
+    rtcSetGeometryUserData(geom, hair.get());
+    rtcSetGeometryMask(geom, first.visibility);
+    if (first.hair_id != 0 || first.visibility != ray::ALL)
+      rtcSetGeometryIntersectFilterFunction(geom, linear_hit_filter);
+    if (first.visibility != ray::ALL)
+      rtcSetGeometryOccludedFilterFunction(geom, linear_hit_filter);
+    rtcSetGeometryBuildQuality(geom, build_quality);
+    rtcCommitGeometry(geom);
+    if (rtcGetDeviceError(embree_device) != RTC_ERROR_NONE) {
+      throw std::runtime_error("linear curve geometry malformed");
+    }
+
+    const geom_id id = rtcAttachGeometry(embree_scene, geom);
+    rtcReleaseGeometry(geom);
+
+    if (linear_geoms.size() <= id) linear_geoms.resize(id + 1, nullptr);
+    linear_geoms[id] = hair.get();
+    linear_hairs.push_back(std::move(hair));
+
+    return n_total;
+  }
+
   void embree_accel::commit() {
     rtcCommitScene(embree_scene);
+    // the device threads only work on builds, tracing runs on the callers
+    thread_budget::global().release(budget_slots);
+    budget_slots = 0;
     if (rtcGetDeviceError(embree_device) != RTC_ERROR_NONE) {
       throw std::runtime_error("failed to commit scene");
     }
@@ -72,8 +189,67 @@ namespace tracer {
     return valid;
   }
 
-  bool embree_accel::intersect(const ray& r, shape::intersect_result* result) const {
-    RTCIntersectContext intersect_ctx;
+  void embree_accel::hit_filter(const RTCFilterFunctionNArguments* args) {
+    const intersect_context* ctx = reinterpret_cast<const intersect_context*>(args->context);
+    const shapes::cubic_bezier* bezier = (const shapes::cubic_bezier*) args->geometryUserPtr;
+
+    const bool visible = (bezier->visibility & ctx->mask) != 0;
+    if (visible && (ctx->strand == nullptr || bezier->same_strand(*ctx->strand))) return;
+
+    // reject the hit and let traversal continue
+    for (unsigned int i = 0; i < args->N; ++i) args->valid[i] = 0;
+  }
+
+  void embree_accel::linear_hit_filter(const RTCFilterFunctionNArguments* args) {
+    const intersect_context* ctx = reinterpret_cast<const intersect_context*>(args->context);
+    const linear_hair* hair = (const linear_hair*) args->geometryUserPtr;
+
+    // segments of one geometry may belong to different strands, so test lane by lane
+    for (unsigned int i = 0; i < args->N; ++i) {
+      if (args->valid[i] == 0) continue;
+      const unsigned int segment = RTCHitN_primID(args->hit, args->N, i);
+      const shapes::cubic_bezier& bezier = (*hair->curves)[hair->segment_curve[segment]];
+
+      const bool visible = (bezier.visibility & ctx->mask) != 0;
+      if (!visible || (ctx->strand != nullptr && !bezier.same_strand(*ctx->strand))) {
+        args->valid[i] = 0;
+      }
+    }
+  }
+
+  void embree_accel::count_filter(const RTCFilterFunctionNArguments* args) {
+    count_context* ctx = reinterpret_cast<count_context*>(
+        const_cast<RTCIntersectContext*>(args->context)
+        );
+
+    for (unsigned int i = 0; i < args->N; ++i) {
+      if (args->valid[i] == 0) continue;
+      // accepting the hit ends the query once enough curves are found
+      if (ctx->n_counted >= ctx->max_count) return;
+
+      const unsigned int geom = RTCHitN_geomID(args->hit, args->N, i);
+      const linear_hair* hair = geom < ctx->accel->linear_geoms.size() ?
+        ctx->accel->linear_geoms[geom] : nullptr;
+      const shapes::cubic_bezier* bezier = hair == nullptr ?
+        (const shapes::cubic_bezier*) args->geometryUserPtr
+        : &(*hair->curves)[hair->segment_curve[RTCHitN_primID(args->hit, args->N, i)]];
+
+      // round curves are entered and left, and neighbouring segments share their ends
+      const shapes::cubic_bezier** counted_end = ctx->counted + ctx->n_counted;
+      if (bezier != ctx->exclude && std::find(ctx->counted, counted_end, bezier) == counted_end) {
+        ctx->counted[ctx->n_counted++] = bezier;
+      }
+      args->valid[i] = 0;
+    }
+  }
+
+  bool embree_accel::intersect(
+      const ray& r,
+      shape::intersect_result* result,
+      const shapes::cubic_bezier* strand
+      ) const
+  {
+    intersect_context intersect_ctx;
     RTCRayHit rtc_io;
     rtc_io.hit.geomID = RTC_INVALID_GEOMETRY_ID;
     rtc_io.ray.dir_x = r.dir.x;
@@ -85,9 +261,12 @@ namespace tracer {
     rtc_io.ray.tnear = 0.f;
     rtc_io.ray.tfar = r.t_max;
     rtc_io.ray.flags = 0;
+    rtc_io.ray.mask = r.mask;
 
-    rtcInitIntersectContext(&intersect_ctx);
-    rtcIntersect1(embree_scene, &intersect_ctx, &rtc_io);
+    rtcInitIntersectContext(&intersect_ctx.rtc_ctx);
+    intersect_ctx.strand = strand;
+    intersect_ctx.mask = r.mask;
+    rtcIntersect1(embree_scene, &intersect_ctx.rtc_ctx, &rtc_io);
 
     if (rtcGetDeviceError(embree_device) != RTC_ERROR_NONE) {
       throw std::runtime_error(std::to_string(rtcGetDeviceError(embree_device)));
@@ -96,20 +275,40 @@ namespace tracer {
     if (rtc_io.hit.geomID != RTC_INVALID_GEOMETRY_ID) {
       using namespace shapes;
       RTCGeometry geom = rtcGetGeometry(embree_scene, rtc_io.hit.geomID);
-      const cubic_bezier* bezier =
-        (const cubic_bezier*) rtcGetGeometryUserData(geom);
-      result->object = bezier;
+      const linear_hair* hair = rtc_io.hit.geomID < linear_geoms.size() ?
+        linear_geoms[rtc_io.hit.geomID] : nullptr;
+
       result->t_hit = rtc_io.ray.tfar;
       result->hit_point = r(result->t_hit);
-      result->uv = { rtc_io.hit.u, 0.5f * (rtc_io.hit.v + 1.f) };
-      result->xbasis = cubic_bezier::evaluate_differential(
-          result->uv[0], bezier->control_points
-          ).normalized();
-      const tf::transform rotate90 = tf::rotate(result->xbasis, PI_OVER_TWO);
-      result->normal = bezier->tf_shape_to_world(rotate90(
-            bezier->tf_world_to_shape(result->hit_point).cross(result->xbasis).normalized()
-            ));
-      result->xbasis = bezier->tf_shape_to_world(result->xbasis).normalized();
+
+      const cubic_bezier* bezier;
+      if (hair == nullptr) {
+        bezier = (const cubic_bezier*) rtcGetGeometryUserData(geom);
+        result->uv = { rtc_io.hit.u, 0.5f * (rtc_io.hit.v + 1.f) };
+        result->xbasis = cubic_bezier::evaluate_differential(
+            result->uv[0], bezier->control_points
+            ).normalized();
+      } else {
+        // map the segment parameter back onto the bezier it was cut from
+        const unsigned int segment = rtc_io.hit.primID;
+        bezier = &(*hair->curves)[hair->segment_curve[segment]];
+        const Float u = hair->segment_u0[segment] + rtc_io.hit.u * hair->segment_du[segment];
+        result->xbasis = cubic_bezier::evaluate_differential(
+            u, bezier->control_points
+            ).normalized();
+
+        // Embree's v is not defined across round segments, measure the offset from the axis
+        // instead, in the same [0, 1] range the bezier curves report
+        const point3f axis = cubic_bezier::evaluate(u, bezier->control_points);
+        const vector3f side = r.dir.cross(result->xbasis).normalized();
+        const Float radius = math::lerp(u, bezier->thickness0, bezier->thickness1);
+        const Float h = math::clamp((result->hit_point - axis).dot(side) / radius, -1.f, 1.f);
+        result->uv = { u, 0.5f * (h + 1.f) };
+      }
+      result->object = bezier;
+      result->normal = cubic_bezier::fiber_normal(
+          result->uv[0], bezier->control_points, result->hit_point, result->xbasis, r.dir
+          );
       if (r.medium == INSIDE) result->normal = -result->normal;
       return true;
     }
@@ -118,7 +317,7 @@ namespace tracer {
   }
 
   bool embree_accel::occluded(const ray& r) const {
-    RTCIntersectContext intersect_ctx;
+    intersect_context intersect_ctx;
     RTCRay rtc_ray;
     rtc_ray.dir_x = r.dir.x;
     rtc_ray.dir_y = r.dir.y;
@@ -129,11 +328,46 @@ namespace tracer {
     rtc_ray.tnear = 0.f;
     rtc_ray.tfar = r.t_max;
     rtc_ray.flags = 0;
+    rtc_ray.mask = r.mask;
 
-    rtcInitIntersectContext(&intersect_ctx);
-    intersect_ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
-    rtcOccluded1(embree_scene, &intersect_ctx, &rtc_ray);
+    rtcInitIntersectContext(&intersect_ctx.rtc_ctx);
+    intersect_ctx.rtc_ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+    intersect_ctx.strand = nullptr;
+    intersect_ctx.mask = r.mask;
+    rtcOccluded1(embree_scene, &intersect_ctx.rtc_ctx, &rtc_ray);
 
     return rtc_ray.tfar < 0.f;
   }
+
+  int embree_accel::count_hits(
+      const ray& r,
+      int max_count,
+      const shapes::cubic_bezier* exclude
+      ) const
+  {
+    count_context count_ctx;
+    RTCRay rtc_ray;
+    rtc_ray.dir_x = r.dir.x;
+    rtc_ray.dir_y = r.dir.y;
+    rtc_ray.dir_z = r.dir.z;
+    rtc_ray.org_x = r.origin.x;
+    rtc_ray.org_y = r.origin.y;
+    rtc_ray.org_z = r.origin.z;
+    rtc_ray.tnear = 0.f;
+    rtc_ray.tfar = r.t_max;
+    rtc_ray.flags = 0;
+    rtc_ray.mask = r.mask;
+
+    rtcInitIntersectContext(&count_ctx.base.rtc_ctx);
+    count_ctx.base.rtc_ctx.filter = count_filter;
+    count_ctx.base.strand = nullptr;
+    count_ctx.base.mask = r.mask;
+    count_ctx.accel = this;
+    count_ctx.exclude = exclude;
+    count_ctx.n_counted = 0;
+    count_ctx.max_count = std::min(max_count, MAX_COUNTED_HITS);
+    rtcOccluded1(embree_scene, &count_ctx.base.rtc_ctx, &rtc_ray);
+
+    return count_ctx.n_counted;
+  }
 } /* namespace tracer */
@@ -1,5 +1,10 @@
 #include <sstream>
+#include <atomic>
+#include <numeric>
+#include <algorithm>
 #include "tracer/hair.hpp"
+#include "math/random.hpp"
+#include "thread_budget.hpp"
 
 namespace tracer {
   static const matrix4f CATMULLROM_TO_BEZIER{
@@ -23,7 +28,14 @@ namespace tracer {
     { 0, 0, 0, 0                }
   };
 
-  hair::hair(const std::string& fpath) {
+  // hair ids must be unique across hair objects, 0 is reserved for untagged curves
+  static std::atomic<uintptr_t> n_hairs_loaded(0);
+
+  uintptr_t hair::new_id() {
+    return ++n_hairs_loaded;
+  }
+
+  hair::hair(const std::string& fpath) : hair_id(new_id()) {
     int result = cyhair.LoadFromFile(fpath.c_str());
     switch (result) {
       case CY_HAIR_FILE_ERROR_CANT_OPEN_FILE:
@@ -73,6 +85,13 @@ namespace tracer {
     delete[] tangents;
   }
 
+  bounds3f hair::bounds() const {
+    if (cyhair_header.point_count == 0) return bounds3f();
+    bounds3f b(point_at(0));
+    for (size_t i = 1; i < cyhair_header.point_count; ++i) b = b.merge(bounds3f(point_at(i)));
+    return b;
+  }
+
   void hair::catmullrom_to_bezier(
       point3f bezier_cps[4],
       const point3f cps[4],
@@ -137,148 +156,199 @@ namespace tracer {
     right[3] = shapes::cubic_bezier::blossom({ 1, 1, 1 }, cpy);
   }
 
-  bvh_tree* hair::to_beziers(
-      std::vector<std::shared_ptr<shape>>& curves,
+  size_t hair::strand_segments(size_t strand) const {
+    return segments_count ? segments_count[strand] : cyhair_header.d_segments;
+  }
+
+  void hair::convert_strand(
+      bezier_record* out,
+      size_t strand,
+      const tf::shared_transform& shape_to_world,
+      Float thickness_scale,
+      bool subdivide
+      ) const
+  {
+    const uint16_t n_segments = strand_segments(strand);
+    for (uint16_t local_segment_id = 0; local_segment_id < n_segments; ++local_segment_id) {
+      const size_t offset = segments_offset[strand] + local_segment_id;
+      point3f catmullrom_cps[4];
+
+      cps_position mode = BODY;
+      int head_id, tail_id;
+      if (cyhair_header.point_count == 2) {
+        // straight line
+        catmullrom_cps[0] = point_at(offset);
+        catmullrom_cps[3] = point_at(offset + 1);
+        catmullrom_cps[1] = lerp(0.33f, catmullrom_cps[0], catmullrom_cps[3]);
+        catmullrom_cps[2] = lerp(0.66f, catmullrom_cps[0], catmullrom_cps[3]);
+        head_id = offset;
+        tail_id = offset + 1;
+      } else if (local_segment_id == 0) {
+        // head
+        mode = HEAD;
+        catmullrom_cps[0] = { 0, 0, 0 };
+        catmullrom_cps[1] = point_at(offset);
+        catmullrom_cps[2] = point_at(offset + 1);
+        catmullrom_cps[3] = point_at(offset + 2);
+        head_id = offset;
+        tail_id = offset + 2;
+      } else if (local_segment_id == n_segments - 1) {
+        // tail
+        mode = TAIL;
+        catmullrom_cps[0] = point_at(offset - 1);
+        catmullrom_cps[1] = point_at(offset);
+        catmullrom_cps[2] = point_at(offset + 1);
+        catmullrom_cps[3] = { 0, 0, 0 };
+        head_id = offset - 1;
+        tail_id = offset + 1;
+      } else {
+        // body
+        catmullrom_cps[0] = point_at(offset - 1);
+        catmullrom_cps[1] = point_at(offset);
+        catmullrom_cps[2] = point_at(offset + 1);
+        catmullrom_cps[3] = point_at(offset + 2);
+        head_id = offset - 1;
+        tail_id = offset + 2;
+      }
+
+      const Float thickness0 = thickness ? thickness[head_id] : cyhair_header.d_thickness;
+      const Float thickness1 = thickness ? thickness[tail_id] : cyhair_header.d_thickness;
+      point3f bezier_cps[4];
+      catmullrom_to_bezier(bezier_cps, catmullrom_cps, mode);
+
+      if (!subdivide) {
+        for (int k = 0; k < 4; ++k) out->cps[k] = shape_to_world(bezier_cps[k]);
+        out->thickness0 = thickness_scale * thickness0;
+        out->thickness1 = thickness_scale * thickness1;
+        ++out;
+        continue;
+      }
+
+      point3f sub_curve[8][4]; // subdivide into 8 curves
+      halve_bezier(sub_curve[0], sub_curve[4], bezier_cps);
+      halve_bezier(sub_curve[0], sub_curve[2], sub_curve[0]);
+      halve_bezier(sub_curve[0], sub_curve[1], sub_curve[0]);
+      halve_bezier(sub_curve[2], sub_curve[3], sub_curve[2]);
+      halve_bezier(sub_curve[4], sub_curve[6], sub_curve[4]);
+      halve_bezier(sub_curve[4], sub_curve[5], sub_curve[4]);
+      halve_bezier(sub_curve[6], sub_curve[7], sub_curve[6]);
+
+      constexpr Float one_eighth = 0.125f;
+      const Float sub_thickness[9] = {
+        thickness0,
+        math::lerp(one_eighth, thickness0, thickness1),
+        math::lerp(2 * one_eighth, thickness0, thickness1),
+        math::lerp(3 * one_eighth, thickness0, thickness1),
+        math::lerp(4 * one_eighth, thickness0, thickness1),
+        math::lerp(5 * one_eighth, thickness0, thickness1),
+        math::lerp(6 * one_eighth, thickness0, thickness1),
+        math::lerp(7 * one_eighth, thickness0, thickness1),
+        local_segment_id + 1 == n_segments ? 0.f : thickness1
+      };
+
+      for (size_t j = 0; j < 8; ++j) {
+        for (int k = 0; k < 4; ++k) out->cps[k] = shape_to_world(sub_curve[j][k]);
+        out->thickness0 = thickness_scale * sub_thickness[j];
+        out->thickness1 = thickness_scale * sub_thickness[j+1];
+        ++out;
+      }
+    } /* for local_segment_id */
+  }
+
+  void hair::to_beziers(
+      primitive_arena<shapes::cubic_bezier>& curves,
       const tf::transform& shape_to_world,
       const std::shared_ptr<material>& surface,
-      uintptr_t* hair_id,
       size_t n_strands,
       Float thickness_scale,
-      bool subbvh,
-      bool subdivide
+      bool strand_walk,
+      bool subdivide,
+      Float lod
       ) const
   {
     if (n_strands == 0) n_strands = cyhair_header.hair_count;
     else n_strands = math::clamp(n_strands, 0UL, (size_t) cyhair_header.hair_count);
 
-    bvh_tree* strand_bvh = new bvh_tree[n_strands];
+    // a partial Fisher-Yates shuffle picks the strands to keep, seeded by the file so that
+    // every render of the same groom keeps the same strands
+    std::vector<size_t> strands(n_strands);
+    std::iota(strands.begin(), strands.end(), 0);
+    lod = math::clamp(lod, Float(0), Float(1));
+    const size_t n_kept = std::max(size_t(std::ceil(lod * n_strands)), std::min(n_strands, 1UL));
+    if (n_kept < n_strands) {
+      random::rng rng(std::hash<std::string>()(file_path) ^ n_strands);
+      for (size_t i = 0; i < n_kept; ++i) {
+        std::swap(strands[i], strands[i + rng.next_ui() % (n_strands - i)]);
+      }
+      strands.resize(n_kept);
+      // walking strands in file order keeps neighbouring curves close in memory
+      std::sort(strands.begin(), strands.end());
+      thickness_scale *= Float(n_strands) / n_kept;
+    }
 
     std::wstringstream wss;
     wss << file_path.c_str();
     std::wcout << L"  * Processing hair file " << wss.str() << L"..." << std::flush;
 
-    size_t n_total_curves = 0;
-    for (size_t i = 0; i < n_strands; ++i) {
-      const uint16_t n_segments = segments_count ? segments_count[i] : cyhair_header.d_segments;
-      size_t n_curves = 0;
-      for (uint16_t local_segment_id = 0; local_segment_id < n_segments; ++local_segment_id) {
-        const size_t offset = segments_offset[i] + local_segment_id;
-        point3f catmullrom_cps[4];
-
-        cps_position mode = BODY;
-        int head_id, tail_id;
-        if (cyhair_header.point_count == 2) {
-          // straight line
-          catmullrom_cps[0] = point_at(offset);
-          catmullrom_cps[3] = point_at(offset + 1);
-          catmullrom_cps[1] = lerp(0.33f, catmullrom_cps[0], catmullrom_cps[3]);
-          catmullrom_cps[2] = lerp(0.66f, catmullrom_cps[0], catmullrom_cps[3]);
-          head_id = offset;
-          tail_id = offset + 1;
-        } else if (local_segment_id == 0) {
-          // head
-          mode = HEAD;
-          catmullrom_cps[0] = { 0, 0, 0 };
-          catmullrom_cps[1] = point_at(offset);
-          catmullrom_cps[2] = point_at(offset + 1);
-          catmullrom_cps[3] = point_at(offset + 2);
-          head_id = offset;
-          tail_id = offset + 2;
-        } else if (local_segment_id == n_segments - 1) {
-          // tail
-          mode = TAIL;
-          catmullrom_cps[0] = point_at(offset - 1);
-          catmullrom_cps[1] = point_at(offset);
-          catmullrom_cps[2] = point_at(offset + 1);
-          catmullrom_cps[3] = { 0, 0, 0 };
-          head_id = offset - 1;
-          tail_id = offset + 1;
-        } else {
-          // body
-          catmullrom_cps[0] = point_at(offset - 1);
-          catmullrom_cps[1] = point_at(offset);
-          catmullrom_cps[2] = point_at(offset + 1);
-          catmullrom_cps[3] = point_at(offset + 2);
-          head_id = offset - 1;
-          tail_id = offset + 2;
-        }
+    // every strand writes to its own slots, so the curve order does not depend on scheduling
+    const size_t curves_per_segment = subdivide ? 8 : 1;
+    std::vector<size_t> first_curve(strands.size() + 1, 0);
+    for (size_t k = 0; k < strands.size(); ++k) {
+      first_curve[k+1] = first_curve[k] + curves_per_segment * strand_segments(strands[k]);
+    }
+    std::vector<bezier_record> records(first_curve.back());
 
-        const Float thickness0 = thickness ? thickness[head_id] : cyhair_header.d_thickness;
-        const Float thickness1 = thickness ? thickness[tail_id] : cyhair_header.d_thickness;
-        point3f bezier_cps[4];
-        catmullrom_to_bezier(bezier_cps, catmullrom_cps, mode);
-
-        point3f sub_curve[8][4]; // subdivide into 8 curves
-        halve_bezier(sub_curve[0], sub_curve[4], bezier_cps);
-        halve_bezier(sub_curve[0], sub_curve[2], sub_curve[0]);
-        halve_bezier(sub_curve[0], sub_curve[1], sub_curve[0]);
-        halve_bezier(sub_curve[2], sub_curve[3], sub_curve[2]);
-        halve_bezier(sub_curve[4], sub_curve[6], sub_curve[4]);
-        halve_bezier(sub_curve[4], sub_curve[5], sub_curve[4]);
-        halve_bezier(sub_curve[6], sub_curve[7], sub_curve[6]);
-
-        constexpr Float one_eighth = 0.125f;
-        const Float sub_thickness[9] = {
-          thickness0,
-          math::lerp(one_eighth, thickness0, thickness1),
-          math::lerp(2 * one_eighth, thickness0, thickness1),
-          math::lerp(3 * one_eighth, thickness0, thickness1),
-          math::lerp(4 * one_eighth, thickness0, thickness1),
-          math::lerp(5 * one_eighth, thickness0, thickness1),
-          math::lerp(6 * one_eighth, thickness0, thickness1),
-          math::lerp(7 * one_eighth, thickness0, thickness1),
-          local_segment_id + 1 == n_segments ? 0.f : thickness1
-        };
-
-        for (size_t j = 0; j < (subdivide ? 8 : 1); ++j) {
-          shapes::cubic_bezier* bezier;
-          if (subdivide) {
-            bezier = new shapes::cubic_bezier(
-                shape_to_world,
-                surface,
-                sub_curve[j],
-                thickness_scale * sub_thickness[j],
-                thickness_scale * sub_thickness[j+1],
-                nullptr
-                );
-          } else {
-            bezier = new shapes::cubic_bezier(
-                shape_to_world,
-                surface,
-                bezier_cps,
-                thickness_scale * thickness0,
-                thickness_scale * thickness1,
-                nullptr
-                );
-          }
-          if (subbvh) {
-            bezier->strand_id = i;
-            bezier->hair_id = (uintptr_t) this;
-          }
-          bezier->curve_id = n_curves + n_total_curves;
-          curves.push_back(std::shared_ptr<shape>(bezier));
-          ++n_curves;
-        }
-      } /* for local_segment_id */
-
-      if (subbvh) {
-        std::wcout << L"\r    * Constructing sub BVH for strand "
-          << i+1 << L"/" << n_strands << std::flush;
-        strand_bvh[i] = bvh_tree(std::vector<std::shared_ptr<shape>>(
-              curves.begin() + n_total_curves,
-              curves.begin() + n_total_curves + n_curves
-              ));
-        n_total_curves += n_curves;
+    // interned once here rather than once per curve
+    const tf::shared_transform shared_shape_to_world(shape_to_world);
+
+    thread_budget& budget = thread_budget::global();
+    const size_t n_ranges = std::min(
+        strands.size(), size_t(RANGES_PER_THREAD * std::max(budget.size(), 1))
+        );
+    std::atomic<size_t> n_converted(0);
+    std::vector<std::future<void>> ranges;
+    ranges.reserve(n_ranges);
+    for (size_t r = 0; r < n_ranges; ++r) {
+      const size_t begin = strands.size() * r / n_ranges;
+      const size_t end = strands.size() * (r + 1) / n_ranges;
+      ranges.push_back(budget.dispatch([&, begin, end]() {
+            for (size_t k = begin; k < end; ++k) {
+              convert_strand(
+                  &records[first_curve[k]], strands[k],
+                  shared_shape_to_world, thickness_scale, subdivide
+                  );
+              n_converted.fetch_add(1, std::memory_order_relaxed);
+            }
+            }));
+    }
+
+    // report progress at most once per period while waiting, deferred ranges run in get()
+    for (std::future<void>& range : ranges) {
+      while (range.wait_for(PROGRESS_PERIOD) == std::future_status::timeout) {
+        std::wcout << L" " << 100 * n_converted.load(std::memory_order_relaxed) / strands.size()
+          << L"%" << std::flush;
       }
-    } /* for i */
+      range.get();
+    }
 
-    if (subbvh) {
-      *hair_id = (uintptr_t) this;
-      std::wcout << std::endl;
+    // control points are in world space already
+    const tf::shared_transform identity;
+    for (size_t k = 0; k < strands.size(); ++k) {
+      for (size_t c = first_curve[k]; c < first_curve[k+1]; ++c) {
+        const bezier_record& record = records[c];
+        const primitive_arena<shapes::cubic_bezier>::index curve_id = curves.emplace(
+            identity, surface, record.cps, record.thickness0, record.thickness1, nullptr
+            );
+        shapes::cubic_bezier& bezier = curves[curve_id];
+        if (strand_walk) {
+          bezier.strand_id = strands[k];
+          bezier.hair_id = hair_id;
+        }
+        bezier.curve_id = curve_id;
+      }
     }
 
     std::wcout << L" done" << std::endl;
-    return strand_bvh;
   } /* to_beziers() */
 
 } /* namespace tracer */
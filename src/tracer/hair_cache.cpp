@@ -0,0 +1,200 @@
+#include <fstream>
+#include <vector>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tracer/hair_cache.hpp"
+
+namespace tracer {
+  static uint64_t align_up(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+  }
+
+  // FNV-1a
+  static void hash_bytes(uint64_t* hash, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+      *hash ^= bytes[i];
+      *hash *= 1099511628211u;
+    }
+  }
+
+  template <typename T>
+  static void hash_value(uint64_t* hash, const T& value) {
+    hash_bytes(hash, &value, sizeof(T));
+  }
+
+  hair_cache::~hair_cache() {
+    if (mapping != nullptr) munmap(mapping, mapping_size);
+  }
+
+  uint64_t hair_cache::make_key(
+      const std::string& hair_path,
+      const tf::transform& shape_to_world,
+      size_t n_strands,
+      Float thickness_scale,
+      bool strand_walk,
+      bool subdivide,
+      Float lod,
+      Float lod_distance,
+      const point3f& eye_position)
+  {
+    uint64_t key = 14695981039346656037u;
+    hash_value(&key, VERSION);
+    hash_bytes(&key, hair_path.data(), hair_path.size());
+
+    struct stat status;
+    if (stat(hair_path.c_str(), &status) == 0) {
+      hash_value(&key, uint64_t(status.st_size));
+      hash_value(&key, int64_t(status.st_mtime));
+    }
+
+    const matrix4f& m = shape_to_world.mat;
+    for (int row = 0; row < 4; ++row) {
+      for (int col = 0; col < 4; ++col) hash_value(&key, m.value[row][col]);
+    }
+    hash_value(&key, uint64_t(n_strands));
+    hash_value(&key, thickness_scale);
+    hash_value(&key, strand_walk);
+    hash_value(&key, subdivide);
+    hash_value(&key, lod);
+    hash_value(&key, lod_distance);
+    if (lod_distance > 0) {
+      for (int i = 0; i < 3; ++i) hash_value(&key, eye_position[i]);
+    }
+    return key;
+  }
+
+  bool hair_cache::write(
+      const std::string& path,
+      uint64_t key,
+      const primitive_arena<shapes::cubic_bezier>& curves)
+  {
+    header h;
+    h.magic = MAGIC;
+    h.version = VERSION;
+    h.key = key;
+    h.n_curves = curves.size();
+    h.vertices_offset = align_up(sizeof(header), ALIGNMENT);
+    // Embree reads shared vertex buffers up to 16 bytes past their end
+    h.strand_ids_offset = align_up(
+        h.vertices_offset + 4 * h.n_curves * sizeof(vector4f) + 16, ALIGNMENT
+        );
+    h.flags = (!curves.empty() && curves[0].hair_id != 0) ? uint32_t(STRAND_WALK) : 0;
+    const uint64_t file_size = h.strand_ids_offset + h.n_curves * sizeof(uint32_t);
+
+    std::vector<char> buffer(file_size, 0);
+    std::copy_n(reinterpret_cast<const char*>(&h), sizeof(header), buffer.data());
+    vector4f* vertices = reinterpret_cast<vector4f*>(buffer.data() + h.vertices_offset);
+    uint32_t* strand_ids = reinterpret_cast<uint32_t*>(buffer.data() + h.strand_ids_offset);
+    for (const shapes::cubic_bezier& bezier : curves) {
+      for (int j = 0; j < 4; ++j) {
+        *vertices = bezier.control_points[j];
+        (*vertices)[3] = math::lerp(j / 3.f, bezier.thickness0, bezier.thickness1);
+        ++vertices;
+      }
+      *strand_ids++ = bezier.strand_id;
+    }
+
+    // write aside and rename, so that concurrent renders never map a partial file
+    const std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    std::ofstream out(tmp_path, std::ios::binary);
+    out.write(buffer.data(), buffer.size());
+    out.close();
+    if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  bool hair_cache::open(const std::string& path, uint64_t key) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || size_t(status.st_size) < sizeof(header)) {
+      close(fd);
+      return false;
+    }
+
+    void* map = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    // offsets and counts are bounded by the file size first, so that the sums cannot overflow
+    const header* h = static_cast<const header*>(map);
+    const uint64_t file_size = status.st_size;
+    const bool valid = h->magic == MAGIC && h->version == VERSION && h->key == key
+      && h->vertices_offset % ALIGNMENT == 0 && h->strand_ids_offset % ALIGNMENT == 0
+      && h->vertices_offset <= file_size && h->strand_ids_offset <= file_size
+      && h->n_curves <= file_size / (4 * sizeof(vector4f))
+      && h->strand_ids_offset >= h->vertices_offset + 4 * h->n_curves * sizeof(vector4f) + 16
+      && file_size - h->strand_ids_offset >= h->n_curves * sizeof(uint32_t);
+    if (!valid) {
+      munmap(map, status.st_size);
+      return false;
+    }
+
+    if (mapping != nullptr) munmap(mapping, mapping_size);
+    mapping = map;
+    mapping_size = status.st_size;
+    return true;
+  }
+
+  bool hair_cache::is_open() const {
+    return mapping != nullptr;
+  }
+
+  const hair_cache::header* hair_cache::file_header() const {
+    return static_cast<const header*>(mapping);
+  }
+
+  size_t hair_cache::size() const {
+    return is_open() ? file_header()->n_curves : 0;
+  }
+
+  const vector4f* hair_cache::vertices() const {
+    ASSERT(is_open(), "hair cache is not open");
+    return reinterpret_cast<const vector4f*>(
+        static_cast<const char*>(mapping) + file_header()->vertices_offset
+        );
+  }
+
+  void hair_cache::to_beziers(
+      primitive_arena<shapes::cubic_bezier>& curves,
+      const std::shared_ptr<material>& surface,
+      uintptr_t hair_id) const
+  {
+    ASSERT(is_open(), "hair cache is not open");
+    const header* h = file_header();
+    const vector4f* vertices = this->vertices();
+    const uint32_t* strand_ids = reinterpret_cast<const uint32_t*>(
+        static_cast<const char*>(mapping) + h->strand_ids_offset
+        );
+
+    // control points are in world space already
+    const tf::shared_transform identity;
+    for (uint64_t i = 0; i < h->n_curves; ++i) {
+      const vector4f* v = vertices + 4 * i;
+      const point3f cps[4] = {
+        point3f(v[0].x, v[0].y, v[0].z),
+        point3f(v[1].x, v[1].y, v[1].z),
+        point3f(v[2].x, v[2].y, v[2].z),
+        point3f(v[3].x, v[3].y, v[3].z)
+      };
+      const primitive_arena<shapes::cubic_bezier>::index curve_id = curves.emplace(
+          identity, surface, cps, v[0].w, v[3].w, nullptr
+          );
+      shapes::cubic_bezier& bezier = curves[curve_id];
+      if (h->flags & STRAND_WALK) {
+        bezier.strand_id = strand_ids[i];
+        bezier.hair_id = hair_id;
+      }
+      bezier.curve_id = curve_id;
+    }
+  }
+} /* namespace tracer */
@@ -0,0 +1,137 @@
+#include <cmath>
+#include <future>
+
+#include "tracer/hair_shadow_grid.hpp"
+#include "thread_budget.hpp"
+
+namespace tracer {
+  size_t hair_shadow_grid::index(int x, int y, int z) const {
+    return (size_t(z) * res[1] + y) * res[0] + x;
+  }
+
+  void hair_shadow_grid::locate(const point3f& p, int i[3], Float d[3]) const {
+    // lower corner of the surrounding voxel centers and the offset from it
+    for (int a = 0; a < 3; ++a) {
+      const Float x = math::clamp(
+          (p[a] - grid_bounds.p_min[a]) / voxel_size - 0.5f, 0.f, Float(res[a] - 1)
+          );
+      i[a] = std::min(int(x), res[a] - 2);
+      d[a] = x - i[a];
+    }
+  }
+
+  void hair_shadow_grid::splat(std::vector<Float>& grid, const point3f& p, Float value) const {
+    int i[3];
+    Float d[3];
+    locate(p, i, d);
+    for (int corner = 0; corner < 8; ++corner) {
+      const int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+      const Float w = (dx ? d[0] : 1 - d[0]) * (dy ? d[1] : 1 - d[1]) * (dz ? d[2] : 1 - d[2]);
+      grid[index(i[0] + dx, i[1] + dy, i[2] + dz)] += w * value;
+    }
+  }
+
+  Float hair_shadow_grid::interpolate(const std::vector<Float>& grid, const point3f& p) const {
+    int i[3];
+    Float d[3];
+    locate(p, i, d);
+    Float value = 0;
+    for (int corner = 0; corner < 8; ++corner) {
+      const int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+      const Float w = (dx ? d[0] : 1 - d[0]) * (dy ? d[1] : 1 - d[1]) * (dz ? d[2] : 1 - d[2]);
+      value += w * grid[index(i[0] + dx, i[1] + dy, i[2] + dz)];
+    }
+    return value;
+  }
+
+  void hair_shadow_grid::build(
+      const std::deque<primitive_arena<shapes::cubic_bezier>>& curves,
+      const point3f& light_position,
+      Float tolerance)
+  {
+    bool first = true;
+    for (const primitive_arena<shapes::cubic_bezier>& hair : curves) {
+      for (const shapes::cubic_bezier& bezier : hair) {
+        grid_bounds = first ? bezier.bounds() : grid_bounds.merge(bezier.bounds());
+        first = false;
+      }
+    }
+    if (first) return;
+
+    const Float n_voxels = std::ceil(1 / tolerance);
+    voxel_size = grid_bounds.longest() / math::clamp(n_voxels, Float(MIN_RES), Float(MAX_RES));
+    for (int a = 0; a < 3; ++a) {
+      res[a] = std::max(int(std::ceil(grid_bounds.diagonal()[a] / voxel_size)), 2);
+    }
+    grid_bounds = bounds3f(
+        grid_bounds.p_min,
+        grid_bounds.p_min + voxel_size * vector3f(res[0], res[1], res[2])
+        );
+
+    // A randomly oriented cylinder shows 2 r l pi / 4 of its side on average, samples every
+    // half voxel deposit that cross section per unit volume
+    std::vector<Float> density(size_t(res[0]) * res[1] * res[2], 0);
+    const Float inv_volume = 1 / math::pow3(voxel_size);
+    for (const primitive_arena<shapes::cubic_bezier>& hair : curves) {
+      for (const shapes::cubic_bezier& bezier : hair) {
+        const point3f* cps = bezier.control_points;
+        const Float polygon = (cps[1] - cps[0]).size() + (cps[2] - cps[1]).size()
+          + (cps[3] - cps[2]).size();
+        const int n_steps = std::max(int(std::ceil(2 * polygon / voxel_size)), 1);
+        for (int s = 0; s < n_steps; ++s) {
+          const Float u = (s + 0.5f) / n_steps;
+          const Float length =
+            shapes::cubic_bezier::evaluate_differential(u, cps).size() / n_steps;
+          const Float radius = math::lerp(u, bezier.thickness0, bezier.thickness1);
+          splat(
+              density,
+              shapes::cubic_bezier::evaluate(u, cps),
+              PI_OVER_TWO * radius * length * inv_volume
+              );
+        }
+      }
+    }
+
+    // march every voxel center towards the light, slices run in parallel
+    values.assign(density.size(), 1);
+    const Float step = 0.5f * voxel_size;
+    thread_budget& budget = thread_budget::global();
+    std::vector<std::future<void>> slices;
+    slices.reserve(res[2]);
+    for (int z = 0; z < res[2]; ++z) {
+      slices.push_back(budget.dispatch([&, z]() {
+            for (int y = 0; y < res[1]; ++y) {
+              for (int x = 0; x < res[0]; ++x) {
+                const point3f center = grid_bounds.p_min
+                  + voxel_size * vector3f(x + 0.5f, y + 0.5f, z + 0.5f);
+                const vector3f to_light = light_position - center;
+                const Float distance = to_light.size();
+                const vector3f dir = to_light / std::max(distance, FLOAT_TOLERANT);
+
+                // the march starts a voxel out, shadow rays skip the fiber they leave as well
+                Float optical_depth = 0;
+                for (Float t = voxel_size + 0.5f * step; t < distance; t += step) {
+                  const point3f p = center + t * dir;
+                  if (!grid_bounds.contains(p)) break;
+                  optical_depth += interpolate(density, p) * step;
+                }
+                values[index(x, y, z)] = std::exp(-optical_depth);
+              }
+            }
+            }));
+    }
+    for (std::future<void>& slice : slices) slice.get();
+  }
+
+  bool hair_shadow_grid::empty() const {
+    return values.empty();
+  }
+
+  bool hair_shadow_grid::contains(const point3f& p) const {
+    return !empty() && grid_bounds.contains(p);
+  }
+
+  Float hair_shadow_grid::transmittance(const point3f& p) const {
+    return interpolate(values, p);
+  }
+} /* namespace tracer */
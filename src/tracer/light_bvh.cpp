@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <cmath>
+
+#include "tracer/light_bvh.hpp"
+#include "math/util.hpp"
+
+namespace tracer {
+  light_bvh::light_bounds light_bvh::light_bounds::merge(const light_bounds& other) const {
+    light_bounds merged;
+    merged.bounds = bounds.merge(other.bounds);
+    merged.power = power + other.power;
+    merged.axis = axis;
+    merged.theta = PI;
+    if (theta >= PI || other.theta >= PI) return merged;
+
+    // normals count up to their sign, so the other cone may be flipped towards this one
+    const vector3f other_axis = axis.dot(other.axis) < 0 ? -other.axis : other.axis;
+    const Float theta_d = std::acos(clamp(axis.dot(other_axis), Float(-1), Float(1)));
+    if (std::min(theta_d + other.theta, PI) <= theta) {
+      merged.theta = theta;
+      return merged;
+    }
+    if (std::min(theta_d + theta, PI) <= other.theta) {
+      merged.axis = other_axis;
+      merged.theta = other.theta;
+      return merged;
+    }
+
+    // a cone past the plane holds every normal up to its sign
+    const Float theta_o = 0.5f * (theta + theta_d + other.theta);
+    const vector3f ortho = other_axis - axis * axis.dot(other_axis);
+    if (theta_o >= PI_OVER_TWO || ortho.is_zero()) return merged;
+
+    const Float theta_r = theta_o - theta;
+    merged.axis = (std::cos(theta_r) * axis + std::sin(theta_r) * ortho.normalized()).normalized();
+    merged.theta = theta_o;
+    return merged;
+  }
+
+  Float light_bvh::light_bounds::importance(const point3f& p) const {
+    const vector3f d = p - bounds.centroid();
+    const Float dist2 = d.size_sq();
+    // points within the bounds see the whole cluster at its radius
+    const Float radius2 = 0.25f * bounds.diagonal().size_sq();
+    if (dist2 <= radius2 || theta >= PI) return power / std::max(dist2, radius2);
+
+    // smallest angle between p and a normal of the cluster, seen from anywhere in its bounds
+    const Float theta_w = std::acos(std::min(std::abs(axis.dot(d)) / std::sqrt(dist2), Float(1)));
+    const Float theta_b = asin_clamp(std::sqrt(radius2 / dist2));
+    const Float theta_min = std::max(theta_w - theta - theta_b, Float(0));
+    if (theta_min >= PI_OVER_TWO) return 0;
+    return power * std::cos(theta_min) / dist2;
+  }
+
+  uint32_t light_bvh::build(
+      std::vector<std::pair<uint32_t, light_bounds>>& items,
+      size_t start,
+      size_t end,
+      uint64_t trail,
+      int depth)
+  {
+    const uint32_t index = nodes.size();
+    nodes.emplace_back();
+    if (end - start == 1) {
+      nodes[index].lb = items[start].second;
+      nodes[index].second_child_or_light = items[start].first;
+      nodes[index].leaf = true;
+      trails[lights[items[start].first]] = trail;
+      return index;
+    }
+
+    // median split along the widest extent of the centroids
+    bounds3f centroids(items[start].second.bounds.centroid());
+    for (size_t i = start + 1; i < end; ++i) {
+      centroids = centroids.merge(bounds3f(items[i].second.bounds.centroid()));
+    }
+    const vector3f extent = centroids.diagonal();
+    const int axis = extent.x > extent.y ?
+      (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    const size_t mid = (start + end) / 2;
+    std::nth_element(
+        items.begin() + start, items.begin() + mid, items.begin() + end,
+        [axis](const std::pair<uint32_t, light_bounds>& a,
+          const std::pair<uint32_t, light_bounds>& b)
+        {
+          return a.second.bounds.centroid()[axis] < b.second.bounds.centroid()[axis];
+        });
+
+    ASSERT(depth < 64, "light BVH is too deep for its trails");
+    build(items, start, mid, trail, depth + 1);
+    const uint32_t second = build(items, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+    nodes[index].second_child_or_light = second;
+    nodes[index].lb = nodes[index + 1].lb.merge(nodes[second].lb);
+    return index;
+  }
+
+  void light_bvh::build(const std::vector<const shape*>& emitters) {
+    lights.clear();
+    nodes.clear();
+    trails.clear();
+
+    std::vector<std::pair<uint32_t, light_bounds>> items;
+    for (const shape* s : emitters) {
+      light_bounds lb;
+      lb.bounds = s->world_bounds_explicit();
+      lb.power = s->surface->emittance.luminance() / s->pdf();
+      if (!(lb.power > 0)) continue;
+      lb.axis = s->normal_cone(&lb.theta);
+      items.emplace_back(lights.size(), lb);
+      lights.push_back(s);
+    }
+    if (!items.empty()) build(items, 0, items.size(), 0, 0);
+  }
+
+  bool light_bvh::empty() const {
+    return lights.empty();
+  }
+
+  size_t light_bvh::size() const {
+    return lights.size();
+  }
+
+  const shape* light_bvh::strongest() const {
+    const shape* light = nullptr;
+    Float power = 0;
+    for (const node& n : nodes) {
+      if (n.leaf && n.lb.power > power) {
+        light = lights[n.second_child_or_light];
+        power = n.lb.power;
+      }
+    }
+    return light;
+  }
+
+  const shape* light_bvh::sample(const point3f& p, Float u, Float* pmf) const {
+    *pmf = 0;
+    if (nodes.empty()) return nullptr;
+
+    uint32_t i = 0;
+    Float prob = 1;
+    while (!nodes[i].leaf) {
+      const uint32_t second = nodes[i].second_child_or_light;
+      const Float w0 = nodes[i + 1].lb.importance(p);
+      const Float w1 = nodes[second].lb.importance(p);
+      if (!(w0 + w1 > 0)) return nullptr;
+
+      // reuse u for the next level
+      const Float p0 = w0 / (w0 + w1);
+      if (u < p0) {
+        u = std::min(u / p0, ONE_MINUS_FLOAT_TOLERANT);
+        prob *= p0;
+        i = i + 1;
+      } else {
+        u = std::min((u - p0) / (1 - p0), ONE_MINUS_FLOAT_TOLERANT);
+        prob *= 1 - p0;
+        i = second;
+      }
+    }
+    *pmf = prob;
+    return lights[nodes[i].second_child_or_light];
+  }
+
+  Float light_bvh::pmf(const point3f& p, const shape* light) const {
+    const auto found = trails.find(light);
+    if (found == trails.end()) return 0;
+
+    uint64_t trail = found->second;
+    uint32_t i = 0;
+    Float prob = 1;
+    while (!nodes[i].leaf) {
+      const uint32_t second = nodes[i].second_child_or_light;
+      const Float w0 = nodes[i + 1].lb.importance(p);
+      const Float w1 = nodes[second].lb.importance(p);
+      if (!(w0 + w1 > 0)) return 0;
+
+      const bool take_second = trail & 1;
+      trail >>= 1;
+      prob *= (take_second ? w1 : w0) / (w0 + w1);
+      i = take_second ? second : i + 1;
+    }
+    return prob;
+  }
+} /* namespace tracer */
@@ -28,30 +28,7 @@ namespace tracer {
                 - 10.73f * pow3(beta_n) + 5.574f * pow4(beta_n) + 0.245f * pow5(beta_n)));
         }
       }
-      sigma_t = this->sigma_a + sigma_s;
-      albedo = sigma_s / sigma_t;
-      sigma_tr = (3.f * this->sigma_a * sigma_t).sqrt();
-    }
-
-    sampled_spectrum dipole::Rd(Float r) const {
-      // here z is y
-      if (COMPARE_EQ(r, 0)) return 0;
-      Float Fdr = fresnel_diffuse(eta_t / eta_i);
-      Float A = (1 + Fdr) / (1 - Fdr);
-      sampled_spectrum zr = sigma_t.inverse();
-      sampled_spectrum zv = -(1 + 4 * A / 3) * zr;
-      sampled_spectrum r2(pow2(r));
-      sampled_spectrum dr = (r2 + zr.pow(2)).sqrt();
-      sampled_spectrum dv = (r2 + zv.pow(2)).sqrt();
-
-      sampled_spectrum first_term, second_term;
-      sampled_spectrum one(1.f);
-      sampled_spectrum dr3 = dr.pow(3);
-      sampled_spectrum dv3 = dv.pow(3);
-      if (dr3.has_zero()) return 0;
-      first_term = zr * (one + sigma_tr * dr) * (-1.f * sigma_tr * dr).exp() / dr3;
-      second_term = zv * (one + sigma_tr * dv) * (-1.f * sigma_tr * dv).exp() / dv3;
-      return INV_FOUR_PI * albedo * (first_term - second_term);
+      profile = std::make_shared<const dipole_profile>(this->sigma_a, sigma_s, eta_i, eta_t);
     }
 
     sampled_spectrum dipole::Sd(Float ft_in, Float ft_out, const sampled_spectrum& rd) const {
@@ -82,7 +59,7 @@ namespace tracer {
       Float ft_out = 1.f - fresnel(refl_out, normal, eta_i, eta_t);
       Float r = mf_normal.size();
 
-      return k / std::abs(omega_in.y) * Sd(ft_in, ft_out, Rd(r));
+      return k / std::abs(omega_in.y) * Sd(ft_in, ft_out, profile->evaluate(r));
     }
 
     material::light_transport dipole::sample(
@@ -96,13 +73,22 @@ namespace tracer {
     {
       *omega_in = sampler::sample_cosine_hemisphere(point2f(u));
 
-      mf_normal->x = standard_normal.sample(u[0]);
+      // the offset from the entry follows the luminance of the profile, its pdf is per area.
+      // u[0] and u[1] are spent on the direction, so the angle of the offset comes from the low
+      // bits of u[2], which only tie it to the radius within a 1/4096 slice of the profile
+      static const Float SPLIT = 4096;
+      const Float r = profile->sample(u[2], pdf);
+      const Float phi = TWO_PI * (u[2] * SPLIT - std::floor(u[2] * SPLIT));
+      mf_normal->x = r * std::cos(phi);
       mf_normal->y = 0.f;
-      mf_normal->z = standard_normal.sample(u[1]);
+      mf_normal->z = r * std::sin(phi);
 
       *omega_in = (*omega_in + *mf_normal).normalized();
-      *pdf = Rd(mf_normal->size()).luminance();
       return { REFLECT, OUTSIDE };
     }
+
+    bool dipole::has_pdf() const {
+      return false;
+    }
   }
 }
@@ -0,0 +1,122 @@
+#include <algorithm>
+
+#include "tracer/materials/dipole_profile.hpp"
+#include "math/util.hpp"
+
+namespace tracer {
+  namespace materials {
+    dipole_profile::dipole_profile(
+        const sampled_spectrum& sigma_a,
+        const sampled_spectrum& sigma_s,
+        Float eta_i,
+        Float eta_t)
+    {
+      const sampled_spectrum sigma_t = (sigma_a + sigma_s).clamp(FLOAT_TOLERANT);
+      albedo = sigma_s / sigma_t;
+      sigma_tr = (3.f * sigma_a * sigma_t).sqrt();
+
+      const Float Fdr = fresnel_diffuse(eta_t / eta_i);
+      const Float A = (1 + Fdr) / (1 - Fdr);
+      zr = sigma_t.inverse();
+      zv = -(1 + 4 * A / 3) * zr;
+
+      // Rd falls off like exp(-sigma_tr r), without absorption it only fades as 1 / r^2
+      r_max = std::min(
+          16 / std::max(sigma_tr.min(), FLOAT_TOLERANT),
+          64 / sigma_t.min()
+          );
+
+      const size_t n_samples = sigma_tr.get_n_samples();
+      table.resize(RES * n_samples);
+      lum_table.resize(RES);
+      cdf.resize(RES);
+      for (int i = 0; i < RES; ++i) {
+        const sampled_spectrum rd = exact(radius(i));
+        for (size_t s = 0; s < n_samples; ++s) table[i * n_samples + s] = rd[s];
+        lum_table[i] = std::max(rd.luminance(), Float(0));
+      }
+
+      cdf[0] = 0;
+      for (int i = 0; i + 1 < RES; ++i) {
+        const Float r0 = radius(i), r1 = radius(i + 1);
+        cdf[i + 1] = cdf[i] + PI * (r0 * lum_table[i] + r1 * lum_table[i + 1]) * (r1 - r0);
+      }
+    }
+
+    Float dipole_profile::radius(int i) const {
+      return r_max * pow2(Float(i) / (RES - 1));
+    }
+
+    int dipole_profile::locate(Float r, Float* d) const {
+      const int i = std::min(int(std::sqrt(r / r_max) * (RES - 1)), RES - 2);
+      const Float r0 = radius(i);
+      *d = clamp((r - r0) / (radius(i + 1) - r0), Float(0), Float(1));
+      return i;
+    }
+
+    sampled_spectrum dipole_profile::exact(Float r) const {
+      // here z is y
+      const sampled_spectrum r2(pow2(r));
+      const sampled_spectrum dr = (r2 + zr.pow(2)).sqrt();
+      const sampled_spectrum dv = (r2 + zv.pow(2)).sqrt();
+
+      const sampled_spectrum one(1.f);
+      const sampled_spectrum first_term =
+        zr * (one + sigma_tr * dr) * (-1.f * sigma_tr * dr).exp() / dr.pow(3);
+      const sampled_spectrum second_term =
+        zv * (one + sigma_tr * dv) * (-1.f * sigma_tr * dv).exp() / dv.pow(3);
+      return INV_FOUR_PI * albedo * (first_term - second_term);
+    }
+
+    sampled_spectrum dipole_profile::evaluate(Float r) const {
+      if (r < 0 || r >= r_max) return 0;
+
+      Float d;
+      const int i = locate(r, &d);
+      const size_t n_samples = sigma_tr.get_n_samples();
+      const Float* v0 = &table[i * n_samples];
+      const Float* v1 = &table[(i + 1) * n_samples];
+      sampled_spectrum rd;
+      for (size_t s = 0; s < n_samples; ++s) rd[s] = math::lerp(d, v0[s], v1[s]);
+      return rd;
+    }
+
+    Float dipole_profile::luminance(Float r) const {
+      if (r < 0 || r >= r_max) return 0;
+
+      Float d;
+      const int i = locate(r, &d);
+      return math::lerp(d, lum_table[i], lum_table[i + 1]);
+    }
+
+    Float dipole_profile::max_radius() const {
+      return r_max;
+    }
+
+    Float dipole_profile::total() const {
+      return cdf.back();
+    }
+
+    Float dipole_profile::sample(Float u, Float* pdf) const {
+      // radii are uniform inside a segment, which keeps the pdf piecewise constant in r
+      const Float target = u * total();
+      const int i = clamp(
+          int(std::upper_bound(cdf.begin(), cdf.end(), target) - cdf.begin()) - 1, 0, RES - 2
+          );
+      const Float mass = cdf[i + 1] - cdf[i];
+      const Float d = mass > 0 ? clamp((target - cdf[i]) / mass, Float(0), Float(1)) : 0;
+      const Float r = math::lerp(d, radius(i), radius(i + 1));
+      *pdf = this->pdf(r);
+      return r;
+    }
+
+    Float dipole_profile::pdf(Float r) const {
+      if (r <= 0 || r >= r_max || total() <= 0) return 0;
+
+      Float d;
+      const int i = locate(r, &d);
+      const Float r0 = radius(i), r1 = radius(i + 1);
+      return (cdf[i + 1] - cdf[i]) / (total() * (r1 - r0) * TWO_PI * r);
+    }
+  }
+}
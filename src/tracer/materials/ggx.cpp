@@ -1,5 +1,4 @@
 #include "tracer/materials/ggx.hpp"
-#include "math/sampler.hpp"
 
 namespace tracer {
   namespace materials {
@@ -25,6 +24,64 @@ namespace tracer {
       return alpha2 * chi_plus(mf_normal.dot(normal)) * INV_PI * pow2(sec2) / pow2(alpha2 + tan2);
     }
 
+    normal3f ggx::sample_visible_normal(const vector3f& omega_out, const point2f& u) const {
+      // stretch the view into the hemisphere configuration
+      const vector3f vh = vector3f(alpha * omega_out.x, omega_out.y, alpha * omega_out.z)
+        .normalized();
+      const Float len2 = pow2(vh.x) + pow2(vh.z);
+      const vector3f t1 = len2 > 0 ?
+        vector3f(vh.z, 0, -vh.x) / std::sqrt(len2) : vector3f(1, 0, 0);
+      const vector3f t2 = vh.cross(t1);
+
+      // uniform disk, squeezed onto the part of the hemisphere visible from vh
+      const Float r = std::sqrt(u.x);
+      const Float phi = TWO_PI * u.y;
+      const Float p1 = r * std::cos(phi);
+      const Float p2 = math::lerp(
+          0.5f * (1 + vh.y), std::sqrt(max0(1 - pow2(p1))), r * std::sin(phi)
+          );
+      const vector3f nh = p1 * t1 + p2 * t2 + std::sqrt(max0(1 - pow2(p1) - pow2(p2))) * vh;
+
+      // and back to the ellipsoid
+      return vector3f(alpha * nh.x, std::max(nh.y, Float(0)), alpha * nh.z).normalized();
+    }
+
+    Float ggx::visible_normal_pdf(const vector3f& omega_out, const normal3f& mf_normal) const {
+      const normal3f normal(0, 1, 0);
+      if (COMPARE_LEQ(omega_out.y, 0)) return 0;
+      return geometry(normal, mf_normal, omega_out) * max0(omega_out.dot(mf_normal))
+        * distribution(normal, mf_normal) / omega_out.y;
+    }
+
+    bool ggx::half_vector(
+        normal3f* mf_normal,
+        Float* eta_out,
+        Float* eta_in,
+        const vector3f& omega_in,
+        const vector3f& omega_out,
+        const light_transport& lt
+        ) const
+    {
+      const bool reflection = omega_in.y * omega_out.y > 0;
+      if (!is_refractive(transport_model)) {
+        *eta_out = *eta_in = 1;
+        if (!reflection) return false;
+        *mf_normal = (omega_in + omega_out).normalized();
+        return true;
+      }
+
+      // sample() reports the medium the sampled direction travels in
+      const bool outside = (reflection ? lt.med : medium(lt.med ^ 1)) == OUTSIDE;
+      *eta_out = outside ? eta_i : eta_t;
+      *eta_in = outside ? eta_t : eta_i;
+
+      const vector3f h = reflection ?
+        omega_in + omega_out : -(*eta_out * omega_out + *eta_in * omega_in);
+      if (h.is_zero()) return false;
+      *mf_normal = h.y < 0 ? -h.normalized() : h.normalized();
+      return true;
+    }
+
     sampled_spectrum ggx::bxdf(
         const vector3f& omega_in,
         const vector3f& omega_out,
@@ -32,20 +89,66 @@ namespace tracer {
         const light_transport& lt
         ) const
     {
-      if (COMPARE_EQ(std::abs(omega_in.y), 0)) return sampled_spectrum(0.f);
-      if ((omega_in + omega_out).is_zero()) return sampled_spectrum(1.f);
+      if (COMPARE_EQ(omega_in.y, 0) || COMPARE_LEQ(omega_out.y, 0)) return sampled_spectrum(0.f);
 
-      const normal3f normal(0, 1, 0);
+      const bool reflection = omega_in.y * omega_out.y > 0;
+      const bool outside = (reflection ? lt.med : medium(lt.med ^ 1)) == OUTSIDE;
+      const sampled_spectrum& tint = (reflection && outside) ? refl : refr;
+
+      // index-matched boundaries pass light straight through
+      if (is_refractive(transport_model) && COMPARE_EQ(eta_i, eta_t)) {
+        return (omega_in + omega_out).is_zero() ?
+          sampled_spectrum(tint / std::abs(omega_in.y)) : sampled_spectrum(0.f);
+      }
+
+      normal3f h;
+      Float eta_out, eta_in;
+      if (!half_vector(&h, &eta_out, &eta_in, omega_in, omega_out, lt)) {
+        return sampled_spectrum(0.f);
+      }
 
+      const normal3f normal(0, 1, 0);
       // Smith geometry term G = G1_in * G1_out
-      const Float G = geometry(normal, mf_normal, omega_in)
-        * geometry(normal, mf_normal, omega_out);
+      const Float DG = distribution(normal, h)
+        * geometry(normal, h, omega_in) * geometry(normal, h, omega_out);
+      const Float cos_in = omega_in.dot(h), cos_out = omega_out.dot(h);
+      const Float F = is_refractive(transport_model) ? fresnel(omega_out, h, eta_out, eta_in) : 1;
+
+      if (reflection) return (F * DG / (4 * omega_in.y * omega_out.y)) * tint;
+
+      // radiance is compressed into the denser side
+      return ((1 - F) * DG * std::abs(cos_in * cos_out) * pow2(eta_out)
+          / (std::abs(omega_in.y * omega_out.y) * pow2(eta_out * cos_out + eta_in * cos_in)))
+        * tint;
+    }
+
+    Float ggx::pdf(
+        const vector3f& omega_in,
+        const vector3f& omega_out,
+        const normal3f& mf_normal,
+        const light_transport& lt
+        ) const
+    {
+      if (COMPARE_EQ(omega_in.y, 0) || COMPARE_LEQ(omega_out.y, 0)) return 0;
+
+      if (is_refractive(transport_model) && COMPARE_EQ(eta_i, eta_t)) {
+        return (omega_in + omega_out).is_zero() ? 1 : 0;
+      }
 
-      const Float inv_sample_weight = absdot(omega_in, normal) * absdot(mf_normal, normal)
-        / (absdot(omega_in, mf_normal) * G);
+      normal3f h;
+      Float eta_out, eta_in;
+      if (!half_vector(&h, &eta_out, &eta_in, omega_in, omega_out, lt)) return 0;
 
-      return clamp(inv_sample_weight, Float(0), Float(1))
-        * (lt.transport == REFLECT ? refl : refr) / absdot(omega_in, { 0, 1, 0 });
+      const Float cos_in = omega_in.dot(h), cos_out = omega_out.dot(h);
+      const Float pdf_h = visible_normal_pdf(omega_out, h);
+      if (omega_in.y * omega_out.y > 0) {
+        const Float F = is_refractive(transport_model) ?
+          fresnel(omega_out, h, eta_out, eta_in) : 1;
+        return F * pdf_h / (4 * std::abs(cos_out));
+      }
+      if (cos_in * cos_out >= 0) return 0;
+      return (1 - fresnel(omega_out, h, eta_out, eta_in)) * pdf_h * pow2(eta_in)
+        * std::abs(cos_in) / pow2(eta_out * cos_out + eta_in * cos_in);
     }
 
     material::light_transport ggx::sample(
@@ -57,33 +160,47 @@ namespace tracer {
         const point3f& u
         ) const
     {
-      const Float theta = std::atan2(alpha * std::sqrt(u.x) , std::sqrt(1 - u.x));
-      const Float phi = TWO_PI * u.y;
-      const normal3f m = spherical_coords(theta, phi);
+      *pdf = 0;
+      if (is_refractive(transport_model) && COMPARE_EQ(eta_i, eta_t)) {
+        *omega_in = -omega_out;
+        *mf_normal = normal3f(0, 1, 0);
+        *pdf = 1;
+        return { REFRACT, medium(lt.med ^ 1) };
+      }
 
+      const normal3f m = sample_visible_normal(omega_out, point2f(u.x, u.y));
+      const Float cos_out = omega_out.dot(m);
+      const Float pdf_m = visible_normal_pdf(omega_out, m);
       *mf_normal = m;
-      *pdf = 1.f; // we already know sample weight, hacking this gives nice result
-
-      if (is_refractive(transport_model)) {
-        Float eta_i_chk = eta_i, eta_t_chk = eta_t;
-        if (lt.med == OUTSIDE) std::swap(eta_i_chk, eta_t_chk);
-
-        // check for external & internal reflection
-        const vector3f refl = reflect(omega_out, m);
-        if (u.z < fresnel(refl, m, eta_t_chk, eta_i_chk)) {
-          *omega_in = refl;
-          return { lt.med == INSIDE ? REFRACT : REFLECT, lt.med };
-        }
-
-        bool tir = false;
-        *omega_in = refract(omega_out, m, eta_t_chk / eta_i_chk, &tir);
-        if (tir) return { REFRACT, lt.med };
-        return { REFRACT, medium(lt.med ^ 1) };
+
+      if (!is_refractive(transport_model)) {
+        // directions below the horizon carry no weight, the path ends there
+        *omega_in = reflect(omega_out, m);
+        if (omega_in->y > 0) *pdf = pdf_m / (4 * cos_out);
+        return { REFLECT, OUTSIDE };
+      }
+
+      Float eta_out = eta_i, eta_in = eta_t;
+      if (lt.med == INSIDE) std::swap(eta_out, eta_in);
+
+      // check for external & internal reflection
+      const Float F = fresnel(omega_out, m, eta_out, eta_in);
+      if (u.z < F) {
+        *omega_in = reflect(omega_out, m);
+        if (omega_in->y > 0) *pdf = F * pdf_m / (4 * cos_out);
+        return { lt.med == INSIDE ? REFRACT : REFLECT, lt.med };
       }
 
-      *omega_in = reflect(omega_out, m);
-      if (omega_in->y < 0) *omega_in = sampler::sample_cosine_hemisphere(point2f(u));
-      return { REFLECT, OUTSIDE };
+      bool tir = false;
+      *omega_in = refract(omega_out, m, eta_out / eta_in, &tir);
+      if (tir) return { REFRACT, lt.med };
+
+      const Float cos_in = omega_in->dot(m);
+      if (omega_in->y < 0) {
+        *pdf = (1 - F) * pdf_m * pow2(eta_in) * std::abs(cos_in)
+          / pow2(eta_out * cos_out + eta_in * cos_in);
+      }
+      return { REFRACT, medium(lt.med ^ 1) };
     }
   }
 }
@@ -53,9 +53,310 @@ namespace tracer {
       // map azimuthal roughness to logistic scale factor s
       logistic_s = 0.265f * beta_n + 1.194f * pow2(beta_n) + 5.372f * pow20(beta_n) * pow2(beta_n);
       logistic_s = sqrt_pi_over_eight * logistic_s;
+
+      build_tables();
     }
 
-    sampled_spectrum hairpt::transmittance(
+    void hairpt::build_tables() {
+      for (int lobe = 0; lobe < 3; ++lobe) {
+        mp_table& table = mp_tables[lobe];
+        const Float lobe_width = std::sqrt(v[lobe]);
+        const Float res = std::ceil(4.f * PI / lobe_width) + 1;
+        if (!(res <= MAX_MP_RES)) continue;
+
+        table.res = std::max(int(res), MIN_MP_RES);
+        table.values.resize(table.res * table.res);
+        const Float step = PI / (table.res - 1);
+        for (int j = 0; j < table.res; ++j) {
+          const Float theta_out = -PI_OVER_TWO + j * step;
+          const Float sin_theta_out = std::sin(theta_out);
+          const Float cos_theta_out = std::max(std::cos(theta_out), 0.f);
+          for (int i = 0; i < table.res; ++i) {
+            const Float theta_in = -PI_OVER_TWO + i * step;
+            table.values[j * table.res + i] = lsdf(
+                std::sin(theta_in), sin_theta_out,
+                std::max(std::cos(theta_in), 0.f), cos_theta_out, v[lobe]
+                );
+          }
+        }
+      }
+
+      const Float res = std::ceil(TWO_PI / (0.25f * logistic_s)) + 1;
+      if (res <= MAX_DETECTOR_RES) {
+        detector_table.resize(std::max(int(res), MIN_DETECTOR_RES));
+        const Float step = TWO_PI / (detector_table.size() - 1);
+        for (size_t i = 0; i < detector_table.size(); ++i) {
+          detector_table[i] = logistic_pdf_finite_norm(logistic_s, -PI + i * step, -PI, PI);
+        }
+      }
+
+      const size_t n_samples = sigma_a.get_n_samples();
+      const int n_points = ATTENUATION_THETA_RES * ATTENUATION_GAMMA_RES;
+      attenuation_table.resize(n_points * 4 * n_samples);
+      attenuation_prob_table.resize(n_points * 4);
+      sampled_spectrum A[4];
+      Float prob[4];
+      for (int j = 0; j < ATTENUATION_THETA_RES; ++j) {
+        const Float theta_out = j * PI_OVER_TWO / (ATTENUATION_THETA_RES - 1);
+        for (int i = 0; i < ATTENUATION_GAMMA_RES; ++i) {
+          const Float gamma_o = i * PI_OVER_TWO / (ATTENUATION_GAMMA_RES - 1);
+          exact_attenuation(A, prob, std::sin(theta_out), std::sin(gamma_o));
+
+          const int point = j * ATTENUATION_GAMMA_RES + i;
+          for (int lobe = 0; lobe < 4; ++lobe) {
+            Float* values = &attenuation_table[(point * 4 + lobe) * n_samples];
+            for (size_t s = 0; s < n_samples; ++s) values[s] = A[lobe][s];
+            attenuation_prob_table[point * 4 + lobe] = prob[lobe];
+          }
+        }
+      }
+    }
+
+    void hairpt::exact_attenuation(
+        sampled_spectrum A[4],
+        Float prob[4],
+        Float sin_theta_out,
+        Float h
+        ) const
+    {
+      const Float cos_theta_out = cos_from_sin(sin_theta_out);
+      Float sin_gamma_o, sin_gamma_t;
+      const sampled_spectrum T = transmittance(
+          sin_theta_out, cos_theta_out, h, &sin_gamma_o, &sin_gamma_t
+          );
+      const Float f = fresnel_cosine(cos_theta_out * cos_from_sin(sin_gamma_o), eta_i, eta_t);
+      attenuation(A, f, T);
+      if (prob != nullptr) attenuation_prob(prob, A);
+    }
+
+    void hairpt::lobe_attenuation(
+        sampled_spectrum A[4],
+        Float prob[4],
+        Float sin_theta_out,
+        Float h
+        ) const
+    {
+      const Float x = std::abs(asin_clamp(sin_theta_out))
+        * ((ATTENUATION_THETA_RES - 1) * 2 * INV_PI);
+      const Float y = std::abs(asin_clamp(h)) * ((ATTENUATION_GAMMA_RES - 1) * 2 * INV_PI);
+      const int j = std::min(int(x), ATTENUATION_THETA_RES - 2);
+      const int i = std::min(int(y), ATTENUATION_GAMMA_RES - 2);
+      const Float dx = x - j;
+      const Float dy = y - i;
+      const Float w[4] = { (1 - dx) * (1 - dy), (1 - dx) * dy, dx * (1 - dy), dx * dy };
+      const int points[4] = {
+        j * ATTENUATION_GAMMA_RES + i,
+        j * ATTENUATION_GAMMA_RES + i + 1,
+        (j + 1) * ATTENUATION_GAMMA_RES + i,
+        (j + 1) * ATTENUATION_GAMMA_RES + i + 1
+      };
+
+      // plain loops over contiguous samples, which the compiler vectorizes
+      const size_t n_samples = sigma_a.get_n_samples();
+      for (int lobe = 0; A != nullptr && lobe < 4; ++lobe) {
+        const Float* v00 = &attenuation_table[(points[0] * 4 + lobe) * n_samples];
+        const Float* v01 = &attenuation_table[(points[1] * 4 + lobe) * n_samples];
+        const Float* v10 = &attenuation_table[(points[2] * 4 + lobe) * n_samples];
+        const Float* v11 = &attenuation_table[(points[3] * 4 + lobe) * n_samples];
+        Float* a = &A[lobe][0];
+        for (size_t s = 0; s < n_samples; ++s) {
+          a[s] = w[0] * v00[s] + w[1] * v01[s] + w[2] * v10[s] + w[3] * v11[s];
+        }
+      }
+
+      if (prob == nullptr) return;
+      for (int lobe = 0; lobe < 4; ++lobe) {
+        prob[lobe] = w[0] * attenuation_prob_table[points[0] * 4 + lobe]
+          + w[1] * attenuation_prob_table[points[1] * 4 + lobe]
+          + w[2] * attenuation_prob_table[points[2] * 4 + lobe]
+          + w[3] * attenuation_prob_table[points[3] * 4 + lobe];
+      }
+    }
+
+    void hairpt::longitudinal(Float M[4], Float sin_theta_in, Float sin_theta_out) const {
+      // grid coordinates in [0, 1], shared by all tables
+      const Float u = (asin_clamp(sin_theta_in) + PI_OVER_TWO) * INV_PI;
+      const Float w = (asin_clamp(sin_theta_out) + PI_OVER_TWO) * INV_PI;
+
+      for (int lobe = 0; lobe < 3; ++lobe) {
+        const mp_table& table = mp_tables[lobe];
+        if (table.res == 0) {
+          M[lobe] = lsdf(
+              sin_theta_in, sin_theta_out,
+              cos_from_sin(sin_theta_in), cos_from_sin(sin_theta_out), v[lobe]
+              );
+          continue;
+        }
+
+        const Float x = u * (table.res - 1);
+        const Float y = w * (table.res - 1);
+        const int i = std::min(int(x), table.res - 2);
+        const int j = std::min(int(y), table.res - 2);
+        const Float dx = x - i;
+        const Float dy = y - j;
+        const Float* row0 = &table.values[j * table.res + i];
+        const Float* row1 = row0 + table.res;
+        M[lobe] = math::lerp(
+            dy, math::lerp(dx, row0[0], row0[1]), math::lerp(dx, row1[0], row1[1])
+            );
+      }
+
+      // TRT and the residual lobe share their variance
+      M[3] = M[2];
+    }
+
+    Float hairpt::detector(int lobe, Float phi, Float gamma_o, Float gamma_t) const {
+      if (detector_table.empty()) return gaussian_detector(lobe, phi, gamma_o, gamma_t, logistic_s);
+
+      Float dphi = phi - net_deflection(lobe, gamma_o, gamma_t);
+      dphi -= TWO_PI * std::floor((dphi + PI) * INV_TWO_PI);
+
+      const Float x = (dphi + PI) * ((detector_table.size() - 1) * INV_TWO_PI);
+      const size_t i = std::min(size_t(std::max(x, 0.f)), detector_table.size() - 2);
+      return math::lerp(x - i, detector_table[i], detector_table[i + 1]);
+    }
+
+    void hairpt::enable_dual_scattering(Float forward_density, Float backward_density) {
+      this->forward_density = forward_density;
+      this->backward_density = backward_density;
+      build_dual_scattering();
+    }
+
+    bool hairpt::dual_scattering() const {
+      return !ds_table.empty();
+    }
+
+    void hairpt::build_dual_scattering() {
+      ds_table.resize(DS_THETA_RES);
+      const Float phi_step = TWO_PI / DS_PHI_SAMPLES;
+      for (int k = 0; k < DS_THETA_RES; ++k) {
+        const Float theta = (k + 0.5f) * PI_OVER_TWO / DS_THETA_RES;
+        const Float sin_theta = std::sin(theta);
+        const Float cos_theta = std::cos(theta);
+
+        // split the lobes into the forward (|phi| > pi/2) and backward hemispheres, averaged
+        // over the fiber width. phi = 0 is back towards the light, where R peaks at h = 0.
+        sampled_spectrum a_f_lobe[4] = { 0.f, 0.f, 0.f, 0.f };
+        sampled_spectrum a_b_lobe[4] = { 0.f, 0.f, 0.f, 0.f };
+        for (int i = 0; i < DS_H_SAMPLES; ++i) {
+          const Float h = -1 + (2 * i + 1.f) / DS_H_SAMPLES;
+          Float sin_gamma_o, sin_gamma_t;
+          refracted_offsets(sin_theta, cos_theta, h, &sin_gamma_o, &sin_gamma_t);
+          sampled_spectrum A[4];
+          exact_attenuation(A, nullptr, sin_theta, h);
+          const Float gamma_o = asin_clamp(sin_gamma_o);
+          const Float gamma_t = asin_clamp(sin_gamma_t);
+
+          for (int lobe = 0; lobe < 3; ++lobe) {
+            Float forward = 0;
+            for (int j = 0; j < DS_PHI_SAMPLES; ++j) {
+              const Float phi = -PI + (j + 0.5f) * phi_step;
+              if (std::abs(phi) > PI_OVER_TWO) {
+                forward += detector(lobe, phi, gamma_o, gamma_t) * phi_step;
+              }
+            }
+            forward = math::clamp(forward, 0.f, 1.f);
+            a_f_lobe[lobe] += A[lobe] * forward;
+            a_b_lobe[lobe] += A[lobe] * (1 - forward);
+          }
+          // the residual lobe is isotropic in phi
+          a_f_lobe[3] += A[3] * 0.5f;
+          a_b_lobe[3] += A[3] * 0.5f;
+        }
+
+        dual_scattering_entry& entry = ds_table[k];
+        sampled_spectrum a_f(0.f), a_b(0.f);
+        Float beta_f = 0, beta_b = 0, weight_f = 0, weight_b = 0;
+        for (int lobe = 0; lobe < 4; ++lobe) {
+          a_f_lobe[lobe] = a_f_lobe[lobe] / DS_H_SAMPLES;
+          a_b_lobe[lobe] = a_b_lobe[lobe] / DS_H_SAMPLES;
+          entry.a_f_lobe[lobe] = a_f_lobe[lobe];
+          a_f += a_f_lobe[lobe];
+          a_b += a_b_lobe[lobe];
+
+          const Float beta = std::sqrt(v[lobe]);
+          beta_f += a_f_lobe[lobe].luminance() * beta;
+          beta_b += a_b_lobe[lobe].luminance() * beta;
+          weight_f += a_f_lobe[lobe].luminance();
+          weight_b += a_b_lobe[lobe].luminance();
+        }
+        beta_f = weight_f > 0 ? beta_f / weight_f : 0;
+        beta_b = weight_b > 0 ? beta_b / weight_b : 0;
+        entry.a_f = a_f;
+        entry.beta_f_sq = pow2(beta_f);
+
+        // back scattering after one and after three bounces, summed over all forward paths
+        for (size_t i = 0; i < a_f.get_n_samples(); ++i) {
+          const Float af2 = pow2(std::min(a_f[i], 0.999f));
+          const Float ab = a_b[i];
+          entry.A_b[i] = ab * af2 / (1 - af2) + pow3(ab) * af2 / pow3(1 - af2);
+        }
+
+        // the lobes carry no cuticle shift, so the back scattering is centered
+        const Float ab = a_b.luminance();
+        const Float af2 = pow2(std::min(a_f.luminance(), 0.999f));
+        const Float denom = ab + pow3(ab) * (2 * beta_f + 3 * beta_b);
+        const Float sigma_b = denom > 0 ?
+          (1 + backward_density * af2)
+          * (ab * std::sqrt(2 * pow2(beta_f) + pow2(beta_b))
+              + pow3(ab) * std::sqrt(2 * pow2(beta_f) + 3 * pow2(beta_b)))
+          / denom
+          : beta_b;
+        entry.sigma_b_sq = pow2(sigma_b);
+      }
+    }
+
+    // Normalized gaussian in theta_in around the specular cone of theta_out, evaluated at the
+    // half angle theta_h = (theta_in + theta_out) / 2 like the longitudinal lobes
+    static Float cone_gaussian(Float theta_h, Float variance) {
+      return 0.5f * std::exp(-0.5f * pow2(theta_h) / variance) / std::sqrt(TWO_PI * variance);
+    }
+
+    sampled_spectrum hairpt::multiple_scattering(
+        const vector3f& omega_in,
+        const vector3f& omega_out,
+        int n_occluders
+        ) const
+    {
+      const Float theta_in = asin_clamp(omega_in.x);
+      const Float theta_out = asin_clamp(omega_out.x);
+      const Float theta_d = 0.5f * std::abs(theta_in - theta_out);
+      const Float theta_h = 0.5f * (theta_in + theta_out);
+      const int k = std::min(int(theta_d * (DS_THETA_RES / PI_OVER_TWO)), DS_THETA_RES - 1);
+      const dual_scattering_entry& entry = ds_table[k];
+
+      // Both terms spread uniformly over their half of the azimuth. Their density is over
+      // (theta_in, phi), dividing by cos(theta_in) turns it into one over solid angle.
+      const Float phi = std::atan2(omega_in.y, omega_in.z) - std::atan2(omega_out.y, omega_out.z);
+      const bool backward = std::cos(phi) > 0;
+      const Float azimuthal = INV_PI / std::max(cos_from_sin(omega_in.x), FLOAT_TOLERANT);
+
+      if (n_occluders == 0) {
+        // direct illumination, only local back scattering adds to single scattering
+        if (!backward) return 0.f;
+        return backward_density * entry.A_b
+          * (cone_gaussian(theta_h, entry.sigma_b_sq) * azimuthal);
+      }
+
+      // forward scattering through the occluders attenuates and widens the light
+      sampled_spectrum T_f(forward_density);
+      for (size_t i = 0; i < T_f.get_n_samples(); ++i) {
+        T_f[i] *= std::pow(entry.a_f[i], Float(n_occluders));
+      }
+      const Float sigma_f_sq = n_occluders * entry.beta_f_sq;
+
+      if (backward) {
+        return T_f * entry.A_b
+          * (backward_density * cone_gaussian(theta_h, entry.sigma_b_sq + sigma_f_sq) * azimuthal);
+      }
+      sampled_spectrum f_scatter(0.f);
+      for (int lobe = 0; lobe < 4; ++lobe) {
+        f_scatter += entry.a_f_lobe[lobe] * cone_gaussian(theta_h, v[lobe] + sigma_f_sq);
+      }
+      return T_f * f_scatter * azimuthal;
+    }
+
+    void hairpt::refracted_offsets(
         Float sin_theta_out,
         Float cos_theta_out,
         Float h,
@@ -63,12 +364,22 @@ namespace tracer {
         Float* sin_gamma_t
         ) const
     {
-      Float sin_theta_t = sin_theta_out / eta_t;
-      Float cos_theta_t = cos_from_sin(sin_theta_t);
-
       Float modified_eta = std::sqrt(pow2(eta_t) - pow2(sin_theta_out)) / cos_theta_out;
       *sin_gamma_o = h;
       *sin_gamma_t = h / modified_eta;
+    }
+
+    sampled_spectrum hairpt::transmittance(
+        Float sin_theta_out,
+        Float cos_theta_out,
+        Float h,
+        Float* sin_gamma_o,
+        Float* sin_gamma_t
+        ) const
+    {
+      Float sin_theta_t = sin_theta_out / eta_t;
+      Float cos_theta_t = cos_from_sin(sin_theta_t);
+      refracted_offsets(sin_theta_out, cos_theta_out, h, sin_gamma_o, sin_gamma_t);
 
       Float dist = 2.f * cos_from_sin(*sin_gamma_t) / cos_theta_t;
       return (-dist * sigma_a).exp();
@@ -160,40 +471,27 @@ namespace tracer {
       const Float phi_out = std::atan2(omega_out.y, omega_out.z);
 
       const Float sin_theta_in = omega_in.x;
-      const Float cos_theta_in = cos_from_sin(sin_theta_in);
       const Float phi_in = std::atan2(omega_in.y, omega_in.z);
 
       const Float phi = phi_in - phi_out;
 
       // longitudinal scattering for each lobe
       Float M[4];
-      for (int i = 0; i < 4; ++i) {
-        M[i] = lsdf(sin_theta_in, sin_theta_out, cos_theta_in, cos_theta_out, v[i]);
-      }
+      longitudinal(M, sin_theta_in, sin_theta_out);
 
       // attenuation for each lobe
       // offset from surface to central medulla in range [-1,1]
       Float h = 2.f * uvw[1] - 1.f;
       Float sin_gamma_o, sin_gamma_t;
-      sampled_spectrum T = transmittance(
-          sin_theta_out,
-          cos_theta_out,
-          h,
-          &sin_gamma_o,
-          &sin_gamma_t
-          );
-      Float cos_gamma_o = cos_from_sin(sin_gamma_o);
+      refracted_offsets(sin_theta_out, cos_theta_out, h, &sin_gamma_o, &sin_gamma_t);
       sampled_spectrum A[4];
-      Float f = fresnel_cosine(cos_theta_out * cos_gamma_o, eta_i, eta_t);
-      attenuation(A, f, T);
+      lobe_attenuation(A, nullptr, sin_theta_out, h);
 
-      Float D[4];
+      Float D[3];
       Float gamma_o = asin_clamp(sin_gamma_o);
       Float gamma_t = asin_clamp(sin_gamma_t);
 
-      for (int i = 0; i < 4; ++i) {
-        D[i] = gaussian_detector(i, phi, gamma_o, gamma_t, logistic_s);
-      }
+      for (int i = 0; i < 3; ++i) D[i] = detector(i, phi, gamma_o, gamma_t);
 
       sampled_spectrum bcsdf(M[3] * A[3] * INV_TWO_PI);
       for (int i = 0; i < 3; ++i) {
@@ -214,6 +512,43 @@ namespace tracer {
       return bcsdf / std::abs(omega_in.y);
     } /* weight() */
 
+    Float hairpt::lobe_pdf(
+        const Float A_prob[4],
+        Float sin_theta_in,
+        Float sin_theta_out,
+        Float phi,
+        Float gamma_o,
+        Float gamma_t
+        ) const
+    {
+      Float M[4];
+      longitudinal(M, sin_theta_in, sin_theta_out);
+
+      Float pdf = M[3] * A_prob[3] * INV_TWO_PI;
+      for (int i = 0; i < 3; ++i) pdf += M[i] * A_prob[i] * detector(i, phi, gamma_o, gamma_t);
+      return pdf;
+    }
+
+    Float hairpt::pdf(
+        const vector3f& omega_in,
+        const vector3f& omega_out,
+        const normal3f& uvw,
+        const light_transport& lt
+        ) const
+    {
+      const Float sin_theta_out = omega_out.x;
+      const Float h = 2.f * uvw[1] - 1.f;
+      Float sin_gamma_o, sin_gamma_t;
+      refracted_offsets(sin_theta_out, cos_from_sin(sin_theta_out), h, &sin_gamma_o, &sin_gamma_t);
+      Float A_prob[4];
+      lobe_attenuation(nullptr, A_prob, sin_theta_out, h);
+
+      const Float phi = std::atan2(omega_in.y, omega_in.z) - std::atan2(omega_out.y, omega_out.z);
+      return lobe_pdf(
+          A_prob, omega_in.x, sin_theta_out, phi, asin_clamp(sin_gamma_o), asin_clamp(sin_gamma_t)
+          );
+    }
+
     material::light_transport hairpt::sample(
         vector3f* omega_in,
         normal3f* mf_normal, // this value is exceptionally valid (bad practice, though)
@@ -231,20 +566,10 @@ namespace tracer {
       const Float cos_theta_out = cos_from_sin(sin_theta_out);
       const Float phi_out = std::atan2(omega_out.y, omega_out.z);
       Float sin_gamma_o, sin_gamma_t;
-      sampled_spectrum T = transmittance(
-          sin_theta_out,
-          cos_theta_out,
-          h,
-          &sin_gamma_o,
-          &sin_gamma_t
-          );
-      Float cos_gamma_o = cos_from_sin(sin_gamma_o);
-      sampled_spectrum A[4];
-
-      Float f = fresnel_cosine(cos_theta_out * cos_gamma_o, eta_i, eta_t);
-      attenuation(A, f, T);
+      refracted_offsets(sin_theta_out, cos_theta_out, h, &sin_gamma_o, &sin_gamma_t);
+      // sampling only needs the lobe probabilities
       Float A_prob[4];
-      attenuation_prob(A_prob, A);
+      lobe_attenuation(nullptr, A_prob, sin_theta_out, h);
       Float gamma_o = asin_clamp(sin_gamma_o);
       Float gamma_t = asin_clamp(sin_gamma_t);
 
@@ -281,21 +606,7 @@ namespace tracer {
             sin_theta_in, cos_theta_in * cos_phi_in, cos_theta_in * sin_phi_in
             ));
 
-      // Calculate sampling PDF
-      Float M[4];
-      for (int i = 0; i < 4; ++i) {
-        M[i] = lsdf(sin_theta_in, sin_theta_out, cos_theta_in, cos_theta_out, v[i]);
-      }
-
-      Float D[4];
-      for (int i = 0; i < 4; ++i) {
-        D[i] = gaussian_detector(i, phi_in - phi_out, gamma_o, gamma_t, logistic_s);
-      }
-
-      *pdf = M[3] * A_prob[3] * INV_TWO_PI;
-      for (int i = 0; i < 3; ++i) {
-        *pdf += M[i] * A_prob[i] * D[i];
-      }
+      *pdf = lobe_pdf(A_prob, sin_theta_in, sin_theta_out, phi_in - phi_out, gamma_o, gamma_t);
 
       // FIXME
       //if (lobe < 3) {
@@ -10,7 +10,7 @@ namespace tracer {
         const light_transport& lt
         ) const 
     {
-      return refl;
+      return refl * INV_PI;
     }
 
     material::light_transport lambert::sample(
@@ -23,8 +23,18 @@ namespace tracer {
         ) const
     {
       *omega_in = sampler::sample_cosine_hemisphere(point2f(u));
-      *pdf = std::abs(omega_in->y);
+      *pdf = std::abs(omega_in->y) * INV_PI;
       return { REFLECT, OUTSIDE };
     }
+
+    Float lambert::pdf(
+        const vector3f& omega_in,
+        const vector3f& omega_out,
+        const normal3f& mf_normal,
+        const light_transport& lt
+        ) const
+    {
+      return omega_in.y * omega_out.y > 0 ? std::abs(omega_in.y) * INV_PI : 0;
+    }
   }
 }
@@ -10,16 +10,24 @@ namespace tracer {
         Float eta_t,
         const sampled_spectrum& sigma_a,
         const sampled_spectrum& sigma_s,
-        Float g)
+        Float g,
+        walk_mode walk)
       : ggx(refl, refr, emittance, roughness, eta_i, eta_t, transport_type::SSS),
       sigma_a(sigma_a), sigma_s(sigma_s), sigma(sigma_a + sigma_s), inv_sigma(sigma.inverse()),
-      g(g), absorp_prob((sigma_a * inv_sigma).average()) {}
+      sigma_max(sigma.max()), sigma_n(sampled_spectrum(sigma.max()) - sigma),
+      g(g), absorp_prob((sigma_a * inv_sigma).average()), walk(walk),
+      profile(walk == DIFFUSION ?
+          std::make_shared<const dipole_profile>(sigma_a, sigma_s, eta_i, eta_t) : nullptr) {}
 
     sss::sss(const sss& cpy)
       : ggx(cpy), sigma_a(cpy.sigma_a), sigma_s(cpy.sigma_s),
-      sigma(cpy.sigma), inv_sigma(cpy.inv_sigma), g(cpy.g), absorp_prob(cpy.absorp_prob) {}
+      sigma(cpy.sigma), inv_sigma(cpy.inv_sigma), sigma_max(cpy.sigma_max),
+      sigma_n(cpy.sigma_n), g(cpy.g), absorp_prob(cpy.absorp_prob), walk(cpy.walk),
+      profile(cpy.profile) {}
 
     Float sss::sample_distance(random::rng& rng) const {
+      if (walk == DELTA_TRACKING) return -std::log(1 - rng.next_uf()) / sigma_max;
+
       const int channel = clamp(
           (int) (rng.next_uf() * inv_sigma.get_n_samples()),
           0,
@@ -32,16 +40,47 @@ namespace tracer {
       return (-1.f * sigma * std::min(dist, std::numeric_limits<Float>::max())).exp();
     }
 
-    sampled_spectrum sss::density(const sampled_spectrum& tr, bool inside) const {
-      return inside ? tr : static_cast<sampled_spectrum>(sigma * tr);
-    }
+    sampled_spectrum sss::escape_weight(Float dist) const {
+      // tracking passes the boundary with the majorant's own probability
+      if (walk == DELTA_TRACKING) return sampled_spectrum(1.f);
 
-    sampled_spectrum sss::beta(const sampled_spectrum& tr, bool inside) const {
-      return inside ? tr : static_cast<sampled_spectrum>(tr * sigma_s);
+      // the channels are picked uniformly, so the flight's pdf is their average
+      const sampled_spectrum tr = transmittance(dist);
+      const Float pdf = tr.average();
+      return COMPARE_EQ(pdf, 0) ? sampled_spectrum(0.f) : sampled_spectrum(tr / pdf);
     }
 
-    Float sss::pdf(const sampled_spectrum& density_spec) const {
-      return density_spec.average();
+    sss::collision sss::collide(sampled_spectrum* weight, Float dist, random::rng& rng) const {
+      // diffusion only walks inside strands, where it falls back to the spectral MIS
+      if (walk != DELTA_TRACKING) {
+        // absorption is left to the weight, every collision scatters
+        const sampled_spectrum tr = transmittance(dist);
+        const Float pdf = (sigma * tr).average();
+        if (COMPARE_EQ(pdf, 0)) return ABSORB;
+        *weight *= sigma_s * tr / pdf;
+        return SCATTER;
+      }
+
+      // Event probabilities follow the coefficients scaled by the current weight, which keeps
+      // the weight bounded even for strongly chromatic media
+      Float p_absorb = 0, p_scatter = 0, p_null = 0;
+      for (size_t i = 0; i < sigma.get_n_samples(); ++i) {
+        const Float w = std::abs((*weight)[i]);
+        p_absorb += sigma_a[i] * w;
+        p_scatter += sigma_s[i] * w;
+        p_null += sigma_n[i] * w;
+      }
+      const Float total = p_absorb + p_scatter + p_null;
+      if (COMPARE_EQ(total, 0)) return ABSORB;
+
+      const Float xi = rng.next_uf() * total;
+      if (xi < p_absorb) return ABSORB;
+      if (xi < p_absorb + p_scatter) {
+        *weight *= sigma_s * (total / (sigma_max * p_scatter));
+        return SCATTER;
+      }
+      *weight *= sigma_n * (total / (sigma_max * p_null));
+      return NULL_COLLISION;
     }
   }
 }
@@ -12,7 +12,7 @@ namespace tracer {
       const std::string& fpath)
     : tf_shape_to_world(tf_shape_to_world), surface(surface), fpath(fpath) {}
 
-  void model::load(std::vector<std::shared_ptr<shape>>& shapes) {
+  void model::load(primitive_arena<shapes::triangle>& triangles) {
     std::wstringstream wss;
     wss << fpath.c_str();
     std::wcout << L"  * Loading " << wss.str() << L"..." << std::flush;
@@ -27,12 +27,12 @@ namespace tracer {
     if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
       throw std::runtime_error(std::string("unable to load model: ") + importer.GetErrorString());
 
-    load_node(shapes, scene->mRootNode, scene);
+    load_node(triangles, scene->mRootNode, scene);
 
     std::wcout << L" done" << std::endl;
   }
 
-  void model::load_mesh(std::vector<std::shared_ptr<shape>>& shapes, aiMesh* mesh) {
+  void model::load_mesh(primitive_arena<shapes::triangle>& triangles, aiMesh* mesh) {
     for (size_t i = 0; i < mesh->mNumFaces; ++i) {
       ASSERT(mesh->mFaces[i].mNumIndices == 3, "mesh->mFaces[i].mNumIndices == 3");
       const int id0 = mesh->mFaces[i].mIndices[0];
@@ -50,29 +50,22 @@ namespace tracer {
         + normal3f(mesh->mNormals[id2].x, mesh->mNormals[id2].y, mesh->mNormals[id2].z));
         if (!normal.is_zero()) normal = -normal.normalized();
       }
-      std::shared_ptr<shape> triangle_mesh(new shapes::triangle(
-            tf_shape_to_world,
-            surface,
-            a, b, c,
-            normal
-            )
-          );
-      shapes.push_back(triangle_mesh);
+      triangles.emplace(tf_shape_to_world, surface, a, b, c, normal);
     }
   }
 
   void model::load_node(
-      std::vector<std::shared_ptr<shape>>& shapes,
+      primitive_arena<shapes::triangle>& triangles,
       aiNode* node,
       const aiScene* scene
       )
   {
     if (node == nullptr) return;
     for (size_t i = 0; i < node->mNumMeshes; ++i) {
-      load_mesh(shapes, scene->mMeshes[node->mMeshes[i]]);
+      load_mesh(triangles, scene->mMeshes[node->mMeshes[i]]);
     }
     for (size_t i = 0; i < node->mNumChildren; ++i) {
-      load_node(shapes, node->mChildren[i], scene);
+      load_node(triangles, node->mChildren[i], scene);
     }
   }
 }
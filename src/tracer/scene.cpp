@@ -6,13 +6,149 @@
 #include "tracer/shapes/cubic_bezier.hpp"
 #include "tracer/material.hpp"
 #include "tracer/materials/sss.hpp"
+#include "tracer/materials/hairpt.hpp"
 #include "math/random.hpp"
 #include "math/util.hpp"
 #include "math/pdf.hpp"
 #include "math/sampler.hpp"
+#include "thread_budget.hpp"
 
 namespace tracer {
 
+  void scene::build_accel(const render_params& params) {
+    std::vector<shape*> legacy_list;
+    legacy_list.reserve(primitives.size() + triangles.size());
+    for (const std::shared_ptr<shape>& s : primitives) legacy_list.push_back(s.get());
+    for (shapes::triangle& t : triangles) legacy_list.push_back(&t);
+
+    if (params.legacy) {
+      std::wcout << L"  * Using legacy BVH for hair" << std::endl;
+      for (hair_job& job : hair_jobs) {
+        curves.push_back(job.curves.get());
+        // the legacy BVH works on the curves alone, the mapping is not needed anymore
+        job.cache = nullptr;
+        for (shapes::cubic_bezier& c : curves.back()) legacy_list.push_back(&c);
+      }
+      hair_jobs.clear();
+    }
+
+    std::wcout << L"  * Building acceleration structures..." << std::flush;
+
+    // every object parses its own material, so that tells subsurface objects apart
+    std::unordered_map<const material*, std::vector<shape*>> medium_lists;
+    for (shape* s : legacy_list) {
+      if (s->surface->transport_model != material::SSS) continue;
+      // strands walk within themselves
+      if (dynamic_cast<const shapes::cubic_bezier*>(s) != nullptr) continue;
+      medium_lists[s->surface.get()].push_back(s);
+    }
+    for (auto& medium : medium_lists) {
+      medium_shapes[medium.first] = bvh_tree(std::move(medium.second));
+    }
+
+    // hair conversion and Embree commit run alongside the legacy BVH construction
+    std::future<size_t> embree_job;
+    if (!hair_jobs.empty()) {
+      embree_accel::device_config embree_config = params.embree_config;
+      for (const hair_job& job : hair_jobs) embree_config.count_hits |= job.dual_scattering;
+      embree_job = thread_budget::global().dispatch([this, &params, embree_config]() {
+          // the device takes whatever slots the legacy build has left
+          embree_shapes.init(embree_config);
+          size_t n_curves = 0;
+          for (hair_job& job : hair_jobs) {
+            curves.push_back(job.curves.get());
+            const bool cached = job.cache != nullptr && job.cache->is_open();
+            if (cached) hair_caches.push_back(job.cache);
+            if (job.basis == embree_accel::BEZIER) {
+              n_curves += embree_shapes.add_hair(
+                  curves.back(), cached ? job.cache->vertices() : nullptr
+                  );
+            } else {
+              n_curves += embree_shapes.add_linear_hair(
+                  curves.back(),
+                  linear_segments(curves.back(), params),
+                  job.basis == embree_accel::FLAT_LINEAR
+                  );
+            }
+          }
+          embree_shapes.commit();
+          return n_curves;
+          });
+    }
+
+    const size_t n_legacy_shapes = legacy_list.size();
+    legacy_shapes = bvh_tree(std::move(legacy_list));
+    const size_t n_hair_segments = embree_job.valid() ? embree_job.get() : 0;
+    hair_jobs.clear();
+
+    std::wcout << L" done (" << n_legacy_shapes << L" legacy shapes, "
+      << n_hair_segments << L" hair segments on Embree, "
+      << medium_shapes.size() << L" subsurface objects)" << std::endl;
+
+    // lights are only sampled with MIS, shapes that cannot be sampled still shine when hit
+    if (params.mis) {
+      std::vector<const shape*> emitters;
+      size_t n_unsampled = 0;
+      for (const std::shared_ptr<shape>& s : primitives) {
+        if (s->surface->transport_model != material::EMIT) continue;
+        if (s->can_sample()) {
+          emitters.push_back(s.get());
+        } else {
+          ++n_unsampled;
+        }
+      }
+      for (const shapes::triangle& t : triangles) {
+        if (t.surface->transport_model == material::EMIT) emitters.push_back(&t);
+      }
+      if (n_unsampled > 0) {
+        std::cerr << "warning: " << n_unsampled << " emissive shapes cannot be sampled, "
+          << "they only light what bounces into them" << std::endl;
+      }
+      lights.build(emitters);
+      std::wcout << L"  * " << lights.size() << L" lights" << std::endl;
+    }
+
+    // an environment with any light shares the light samples evenly with the lights
+    const bool environment_light =
+      environment_texture != nullptr && environment_texture->has_distribution();
+    environment_prob = environment_light ? (lights.empty() ? 1.f : 0.5f) : 0.f;
+
+    // the grid stands in for the curves on Embree, the legacy BVH still has to trace them,
+    // its shadows are cast by the strongest light
+    if (params.hair_shadow_tolerance > 0 && !params.legacy && !curves.empty()
+        && !lights.empty())
+    {
+      std::wcout << L"  * Building hair shadow grid..." << std::flush;
+      // shapes bound themselves in object space
+      hair_shadow_light = lights.strongest();
+      const point3f light_center = hair_shadow_light->world_bounds_explicit().centroid();
+      hair_shadows.build(curves, light_center, params.hair_shadow_tolerance);
+      std::wcout << L" done" << std::endl;
+    }
+  }
+
+  std::vector<uint32_t> scene::linear_segments(
+      const primitive_arena<shapes::cubic_bezier>& hair_curves,
+      const render_params& params) const
+  {
+    static const uint32_t MAX_SEGMENTS = 16;
+
+    std::vector<uint32_t> n_segments(hair_curves.size(), 1);
+    for (primitive_arena<shapes::cubic_bezier>::index i = 0; i < hair_curves.size(); ++i) {
+      const shapes::cubic_bezier& curve = hair_curves[i];
+      const point3f center = curve.bounds().centroid();
+      const Float max_error = std::max(
+          params.hair_pixel_error * camera->pixel_footprint(center), Float(1e-6)
+          );
+
+      // n uniform chords stay within max|p''| / (8 n^2) of the curve
+      const Float n = std::ceil(std::sqrt(6 * curve.second_difference() / (8 * max_error)));
+      n_segments[i] = n < MAX_SEGMENTS ? std::max(uint32_t(n), uint32_t(1)) : MAX_SEGMENTS;
+    }
+
+    return n_segments;
+  }
+
   bool scene::intersect(
       const ray& r,
       const shape::intersect_opts& opts,
@@ -34,15 +170,147 @@ namespace tracer {
     return hit;
   }
 
+  int scene::count_hair_occluders(
+      const ray& r,
+      const render_params& params,
+      const shapes::cubic_bezier* self
+      ) const
+  {
+    // Embree only holds hair, everything else lives in the legacy BVH
+    if (!params.legacy && embree_shapes.is_valid()) {
+      if (legacy_shapes.occluded(r, params.intersect_options)) return -1;
+      return embree_shapes.count_hits(r, MAX_HAIR_OCCLUDERS, self);
+    }
+
+    // step through the hits one by one
+    ray r_step(r);
+    const shape* prev_hit = self;
+    int n_occluders = 0;
+    while (n_occluders < MAX_HAIR_OCCLUDERS) {
+      shape::intersect_result result;
+      if (!intersect(r_step, params.intersect_options, &result)) break;
+      if (result.object->surface->transport_model != material::HAIR) return -1;
+
+      if (result.object != prev_hit) ++n_occluders;
+      prev_hit = result.object;
+      const Float step = result.t_hit + params.intersect_options.bias_epsilon;
+      r_step = ray(r_step(step), r_step.dir, r_step.t_max - step, r_step.medium, r_step.mask);
+      if (r_step.t_max <= 0) break;
+    }
+    return n_occluders;
+  }
+
+  bool scene::intersect_medium(
+      const ray& r,
+      const render_params& params,
+      const material* medium,
+      const shapes::cubic_bezier* strand,
+      shape::intersect_result* result
+      ) const
+  {
+    if (strand == nullptr) {
+      const auto medium_bvh = medium_shapes.find(medium);
+      if (medium_bvh != medium_shapes.end()) {
+        return medium_bvh->second.intersect(r, params.intersect_options, result);
+      }
+      return legacy_shapes.intersect(r, params.intersect_options, result);
+    }
+    if (params.legacy || !embree_shapes.is_valid()) {
+      return legacy_shapes.intersect(r, params.intersect_options, result, strand);
+    }
+    return embree_shapes.intersect(r, result, strand);
+  }
+
+  bool scene::sample_diffusion_exit(
+      ray* r_exit,
+      sampled_spectrum* weight,
+      shape::intersect_result* exit,
+      const shape::intersect_result& entry,
+      const ray& r,
+      const render_params& params,
+      const materials::sss& medium,
+      random::rng& rng
+      ) const
+  {
+    const materials::dipole_profile& profile = *medium.profile;
+    const normal3f normal(entry.normal.dot(r.dir) > 0 ? -entry.normal : entry.normal);
+
+    // probes run along the normal or one of the tangents, each through the sphere of
+    // negligible profile, the tangents catch exits on steep or curved parts of the object
+    static const int MAX_EXITS = 16;
+    static const Float AXIS_PROB[3] = { 0.5f, 0.25f, 0.25f };
+    vector3f u, v;
+    sampler::sample_orthogonals(normal, &u, &v, rng);
+    const vector3f axes[3] = { normal, u, v };
+    const Float u_axis = rng.next_uf();
+    const int axis = u_axis < AXIS_PROB[0] ? 0 : (u_axis < AXIS_PROB[0] + AXIS_PROB[1] ? 1 : 2);
+
+    Float pdf;
+    const Float radius = profile.sample(rng.next_uf(), &pdf);
+    if (pdf <= 0) return false;
+
+    const Float phi = TWO_PI * rng.next_uf();
+    const Float half_chord = std::sqrt(
+        std::max(pow2(profile.max_radius()) - pow2(radius), Float(0))
+        );
+    const vector3f offset = radius
+      * (std::cos(phi) * axes[(axis + 1) % 3] + std::sin(phi) * axes[(axis + 2) % 3]);
+    ray probe(
+        entry.hit_point + offset + half_chord * axes[axis],
+        -axes[axis],
+        2 * half_chord,
+        OUTSIDE,
+        ray::SUBSURFACE
+        );
+
+    // every boundary crossed by the probe is a candidate, one of them is picked uniformly
+    shape::intersect_result exits[MAX_EXITS];
+    int n_exits = 0;
+    while (n_exits < MAX_EXITS
+        && intersect_medium(probe, params, &medium, nullptr, &exits[n_exits]))
+    {
+      const Float step = exits[n_exits].t_hit + params.intersect_options.bias_epsilon;
+      probe.origin = probe.origin + step * probe.dir;
+      probe.t_max -= step;
+      ++n_exits;
+      if (probe.t_max <= 0) break;
+    }
+    if (n_exits == 0) return false;
+    *exit = exits[std::min(int(rng.next_uf() * n_exits), n_exits - 1)];
+
+    // the exit's normal points out of the medium, on the side of the entry's
+    const normal3f exit_normal(exit->normal.dot(normal) < 0 ? -exit->normal : exit->normal);
+    const vector3f d = exit->hit_point - entry.hit_point;
+
+    // a disk sample lands on the surface with its pdf times the cosine to the probe, the three
+    // probe directions are combined by MIS
+    Float pdf_area = 0;
+    for (int i = 0; i < 3; ++i) {
+      const Float r_projected = std::sqrt(max0(d.size_sq() - pow2(d.dot(axes[i]))));
+      pdf_area += AXIS_PROB[i] * profile.pdf(r_projected) * std::abs(exit_normal.dot(axes[i]));
+    }
+    pdf_area /= n_exits;
+    if (!(pdf_area > 0)) return false;
+
+    *weight *= profile.evaluate(d.size()) / pdf_area;
+    exit->normal = exit_normal;
+
+    vector3f basis0, basis1;
+    sampler::sample_orthogonals(exit_normal, &basis0, &basis1, rng);
+    const vector3f dir = matrix3f(basis0, exit_normal, basis1).dot(
+        vector3f(sampler::sample_cosine_hemisphere(rng.next_2uf()))
+        );
+    *r_exit = ray(exit->hit_point, dir, r.t_max, INSIDE, ray::SUBSURFACE);
+    return true;
+  }
+
   material::light_transport scene::trace_bsdf(
       ray* r_next,
       vector3f* omega_in,
       vector3f* omega_out,
       normal3f* mf_normal,
-      vector3f* omega_in_dl,
       Float* pdf,
-      Float* pdf_dl,
-      sampled_spectrum* direct_light,
+      matrix3f* to_tangent_space,
       const shape::intersect_result& result,
       const render_params& params,
       const ray& r,
@@ -67,10 +335,10 @@ namespace tracer {
       }
     }
 
-    matrix3f to_tangent_space(from_tangent_space.t());
+    *to_tangent_space = from_tangent_space.t();
 
     // vectors in tangent space
-    *omega_out = to_tangent_space.dot(-r.dir);
+    *omega_out = to_tangent_space->dot(-r.dir);
 
     // sample incident direction and microsurface (microfacet) normal
     Float xi = rng.next_uf();
@@ -93,66 +361,200 @@ namespace tracer {
           result.hit_point + offset * world_omega_in,
           world_omega_in,
           r.t_max,
-          next_lt.med
+          next_lt.med,
+          ray::BOUNCE
           );
     } else {
       *r_next = ray(
           result.hit_point + params.intersect_options.bias_epsilon * bias,
           from_tangent_space.dot(*omega_in),
           r.t_max,
-          next_lt.med
+          next_lt.med,
+          ray::BOUNCE
           );
     }
 
-    // sample direct lighting
-    if (params.mis) {
-      const point3f light_position = direct_light_shape->sample(sample);
-      const ray r_dl(
-          r_next->origin,
-          (light_position - result.hit_point).normalized(),
-          r.t_max
-          );
-      if (occluded(r_dl, params.intersect_options)) {
-        *pdf_dl = 0;
+    return next_lt;
+  }
+
+  void scene::sample_light(
+      vector3f* omega_in_dl,
+      Float* pdf_dl,
+      sampled_spectrum* direct_light,
+      int* hair_occluders,
+      const shape::intersect_result& result,
+      const render_params& params,
+      const ray& r_next,
+      const matrix3f& to_tangent_space,
+      const point2f& sample,
+      Float u_light
+      ) const
+  {
+    *hair_occluders = -1;
+    *pdf_dl = 0;
+    // one strategy picks between the environment and the lights, u is reused for the latter
+    const bool from_environment = params.mis && u_light < environment_prob;
+    Float light_pmf = 0;
+    const shape* light = params.mis && !from_environment ?
+      lights.sample(r_next.origin, mintol((u_light - environment_prob) / (1 - environment_prob)),
+          &light_pmf)
+      : nullptr;
+    if (from_environment || light != nullptr) {
+      ray r_dl;
+      sampled_spectrum light_emittance;
+      if (from_environment) {
+        Float pdf_env;
+        const vector3f dir = environment_texture->sample_direction(sample, &pdf_env);
+        r_dl = ray(r_next.origin, dir, r_next.t_max, OUTSIDE, ray::SHADOW);
+        *pdf_dl = environment_prob * pdf_env;
+        light_emittance = environment_texture->sample(dir);
       } else {
-        *pdf_dl = direct_light_shape->pdf();
+        Float pdf_light;
+        const point3f light_position =
+          light->sample_solid_angle(r_next.origin, sample, &pdf_light);
+        r_dl = ray(
+            r_next.origin,
+            (light_position - r_next.origin).normalized(),
+            r_next.t_max,
+            OUTSIDE,
+            ray::SHADOW
+            );
+        *pdf_dl = (1 - environment_prob) * light_pmf * pdf_light;
+        light_emittance = light->surface->emittance;
+      }
+      // samples hidden on the light's back would only waste a shadow ray
+      if (!(*pdf_dl > 0)) return;
+
+      // with dual scattering, light behind other fibers still reaches the hair through
+      // multiple scattering, so the fibers are counted rather than just blocking
+      const shapes::cubic_bezier* curve =
+        result.object->surface->transport_model == material::HAIR ?
+        dynamic_cast<const shapes::cubic_bezier*>(result.object) : nullptr;
+      const materials::hairpt* hair = curve != nullptr ?
+        dynamic_cast<const materials::hairpt*>(result.object->surface.get()) : nullptr;
+      const bool dual_scattering = hair != nullptr && hair->dual_scattering();
+
+      // inside the groom, shadows of the strongest light come from the grid unless the eye is
+      // close enough to resolve single fibers, other lights trace their shadow rays
+      Float hair_transmittance = 1;
+      int n_occluders;
+      if (dual_scattering) {
+        n_occluders = count_hair_occluders(r_dl, params, curve);
+      } else if (!from_environment && light == hair_shadow_light
+          && hair_shadows.contains(result.hit_point)
+          && (result.hit_point - params.eye_position).size() >= params.hair_shadow_exact_distance)
+      {
+        n_occluders = legacy_shapes.occluded(r_dl, params.intersect_options) ? -1 : 0;
+        hair_transmittance = hair_shadows.transmittance(result.hit_point);
+      } else {
+        n_occluders = occluded(r_dl, params.intersect_options) ? -1 : 0;
+      }
+
+      *hair_occluders = n_occluders;
+      if (n_occluders >= 0) {
         *omega_in_dl = to_tangent_space.dot(r_dl.dir);
-        *direct_light = direct_light_shape->surface->emittance
-          / (light_position - result.hit_point).size_sq();
+        *direct_light = light_emittance * hair_transmittance;
       }
     }
-
-    return next_lt;
   }
 
   void scene::estimate_radiance(
       sampled_spectrum* bxdf_estimator,
-      sampled_spectrum* direct_estimator,
-      const render_params& params,
       const vector3f& omega_in,
       const vector3f& omega_out,
       const normal3f& mf_normal,
-      const normal3f& omega_in_dl,
       const material::light_transport& next_lt,
       const shape::intersect_result& result,
-      Float pdf,
-      Float pdf_dl
+      Float pdf
       ) const
   {
-    sampled_spectrum bxdf_radiance = result.object->surface->bxdf(
-        omega_in, omega_out, mf_normal, next_lt
-        );
-    sampled_spectrum direct_radiance = result.object->surface->bxdf(
-        omega_in_dl, omega_out, mf_normal, next_lt
-        );
-    Float bxdf_weight = balance_heuristic(params.spp, pdf, params.spp, pdf_dl);
-    Float direct_weight = balance_heuristic(params.spp, pdf_dl, params.spp, pdf);
+    // the bxdf sample's weight is left to the light it may hit, see trace_path
     *bxdf_estimator = COMPARE_EQ(pdf, 0) ?
       sampled_spectrum(0.f)
-      : (bxdf_weight * std::abs(omega_in.y)) * bxdf_radiance / pdf;
-    *direct_estimator = COMPARE_EQ(pdf_dl, 0) ?
-      sampled_spectrum(0.f)
-      : (direct_weight * std::abs(omega_in_dl.y)) * direct_radiance / pdf_dl;
+      : std::abs(omega_in.y) * result.object->surface->bxdf(omega_in, omega_out, mf_normal, next_lt)
+      / pdf;
+  }
+
+  sampled_spectrum scene::estimate_direct(
+      const shape::intersect_result& result,
+      const shape::intersect_result& shading,
+      const render_params& params,
+      const ray& r_next,
+      const matrix3f& to_tangent_space,
+      const vector3f& omega_out,
+      const normal3f& mf_normal,
+      material::medium med_out,
+      bool with_light,
+      int n_samples,
+      const point2f& sample,
+      random::rng& rng
+      ) const
+  {
+    if (!params.mis) return sampled_spectrum(0.f);
+
+    const material& surface = *shading.object->surface;
+    // light samples on dual scattering hair also gather the light scattered between fibers
+    const materials::hairpt* ds_hair = surface.transport_model == material::HAIR ?
+      dynamic_cast<const materials::hairpt*>(&surface) : nullptr;
+    if (ds_hair != nullptr && !ds_hair->dual_scattering()) ds_hair = nullptr;
+
+    // a single sample is the path's own, split ones are stratified over the lights
+    std::vector<point2f> samples;
+    if (n_samples > 1) {
+      const int side = std::sqrt(n_samples);
+      sampler::sample_stratified_2d(
+          samples,
+          n_samples,
+          side * side == n_samples ? point2i(side) : point2i(n_samples, 1),
+          rng
+          );
+    }
+
+    sampled_spectrum direct(0.f);
+    for (int i = 0; i < n_samples; ++i) {
+      vector3f omega_in_dl;
+      Float pdf_dl;
+      sampled_spectrum direct_light;
+      int hair_occluders;
+      sample_light(&omega_in_dl, &pdf_dl, &direct_light, &hair_occluders, result, params, r_next,
+          to_tangent_space, n_samples > 1 ? samples[i] : sample, rng.next_uf());
+      if (hair_occluders < 0 || !(pdf_dl > 0)) continue;
+
+      sampled_spectrum estimate(0.f);
+      if (hair_occluders == 0) {
+        // the light direction may lie on the other side than the bxdf sample
+        const material::light_transport light_lt = omega_in_dl.y * omega_out.y > 0 ?
+          material::light_transport{ material::REFLECT, med_out }
+          : material::light_transport{ material::REFRACT, material::medium(med_out ^ 1) };
+        const Float direct_weight = balance_heuristic(
+            n_samples, pdf_dl, 1, surface.pdf(omega_in_dl, omega_out, mf_normal, light_lt)
+            );
+        estimate = (direct_weight * std::abs(omega_in_dl.y))
+          * surface.bxdf(omega_in_dl, omega_out, mf_normal, light_lt) / pdf_dl;
+      }
+      // light scattered by the surrounding fibers can only arrive through the light sample
+      if (ds_hair != nullptr) {
+        estimate += ds_hair->multiple_scattering(omega_in_dl, omega_out, hair_occluders) / pdf_dl;
+      }
+      direct += with_light ? estimate * direct_light : estimate;
+    }
+    return direct / n_samples;
+  }
+
+  int scene::light_samples(
+      const material& surface,
+      const render_params& params,
+      Float throughput,
+      random::rng& rng
+      ) const
+  {
+    const int n = surface.light_samples > 0 ? surface.light_samples : params.light_samples;
+    if (n <= 1) return 1;
+
+    // rounded at random so the expected count follows the throughput, at least one is kept
+    const Float expected = n * clamp(throughput, Float(0), Float(1));
+    const int split = int(expected) + (rng.next_uf() < expected - int(expected) ? 1 : 0);
+    return std::max(split, 1);
   }
 
   nspectrum scene::trace_path(
@@ -161,7 +563,9 @@ namespace tracer {
       const material::light_transport& prev_lt,
       const point2f& sample,
       random::rng& rng,
-      int bounce)
+      int bounce,
+      Float prev_pdf,
+      Float throughput)
   {
     if (bounce > params.max_bounce) return sampled_spectrum(0.f);
 
@@ -171,7 +575,16 @@ namespace tracer {
     if (result.object == nullptr) {
       if (r.medium == OUTSIDE) {
         if (environment_texture != nullptr) {
-          return environment_texture->sample(r.dir);
+          // the previous vertex's light sample may have drawn this direction as well
+          Float weight = 1;
+          if (params.mis && prev_pdf < 0 && environment_prob > 0) {
+            weight = 0;
+          } else if (params.mis && prev_pdf > 0 && environment_prob > 0) {
+            weight = balance_heuristic(
+                1, prev_pdf, 1, environment_prob * environment_texture->pdf(r.dir)
+                );
+          }
+          return weight * environment_texture->sample(r.dir);
         }
         return environment_color;
       }
@@ -181,9 +594,28 @@ namespace tracer {
     if (params.show_normal) return rgb_spectrum(result.normal.x, result.normal.y, result.normal.z);
     if (params.show_depth) return rgb_spectrum(result.t_hit);
 
+    // dual scattering hair accounts for all light scattered between fibers on its own
+    const materials::hairpt* ds_hair =
+      result.object->surface->transport_model == material::HAIR ?
+      dynamic_cast<const materials::hairpt*>(result.object->surface.get()) : nullptr;
+    if (ds_hair != nullptr && !ds_hair->dual_scattering()) ds_hair = nullptr;
+    if (ds_hair != nullptr && prev_lt.transport == material::HAIR) return sampled_spectrum(0);
+    // the light samples take that estimate, without MIS the path has to gather it instead
+    const bool ds_estimated = ds_hair != nullptr && params.mis;
+
     switch (result.object->surface->transport_model) {
-      case material::EMIT:
-        return result.object->surface->emittance;
+      case material::EMIT: {
+        // the previous vertex's light sample may have found this light as well
+        Float weight = 1;
+        if (params.mis && prev_pdf != 0) {
+          const Float pdf_light = (1 - environment_prob) * lights.pmf(r.origin, result.object)
+            * result.object->pdf_solid_angle(r.origin, r.dir);
+          // a vertex without a pdf leaves the lights its samples can reach to them
+          weight = prev_pdf < 0 ?
+            (pdf_light > 0 ? 0 : 1) : balance_heuristic(1, prev_pdf, 1, pdf_light);
+        }
+        return weight * result.object->surface->emittance;
+      }
       case material::NONE:
         return sampled_spectrum(0);
       default:
@@ -192,101 +624,98 @@ namespace tracer {
 
     // evaluate estimator
     sampled_spectrum bxdf_radiance[2] = { 1.f, 1.f }, direct_radiance[2] = { 1.f, 1.f };
-    sampled_spectrum direct_light(1.f);
     ray r_next;
     vector3f omega_in, omega_out;
-    vector3f omega_in_dl;
     normal3f mf_normal;
-    Float pdf = 1.f, pdf_dl = 0.f;
+    matrix3f to_tangent_space;
+    Float pdf = 1.f;
 
     material::light_transport next_lt = trace_bsdf(
-        &r_next, &omega_in, &omega_out, &mf_normal, &omega_in_dl,
-        &pdf, &pdf_dl, &direct_light, result, params, r, prev_lt, sample, rng
+        &r_next, &omega_in, &omega_out, &mf_normal, &pdf, &to_tangent_space,
+        result, params, r, prev_lt, sample, rng
         );
+    const bool enters_volume =
+      result.object->surface->transport_model == material::SSS && next_lt.med == INSIDE;
 
-    // incoming bsdf
-    estimate_radiance(&bxdf_radiance[0], &direct_radiance[0], params, omega_in, omega_out,
-        mf_normal, omega_in_dl, next_lt, result, pdf, pdf_dl);
+    // incoming bsdf, the light itself is gathered where a subsurface walk comes out
+    estimate_radiance(&bxdf_radiance[0], omega_in, omega_out, mf_normal, next_lt, result, pdf);
+    int n_light_samples = light_samples(*result.object->surface, params, throughput, rng);
+    direct_radiance[0] = estimate_direct(result, result, params, r_next, to_tangent_space,
+        omega_out, mf_normal, prev_lt.med, !enters_volume, n_light_samples, sample, rng);
 
     // do volumetric path tracing
     sampled_spectrum volume_weight(1.f);
-    if (result.object->surface->transport_model == material::SSS && next_lt.med == INSIDE) {
+    if (enters_volume) {
       const auto volume = std::dynamic_pointer_cast<materials::sss>(result.object->surface);
       ASSERT(volume != nullptr);
 
-      bvh_tree* bvh = &legacy_shapes;
-
       // if the shape is a part of hair segment, only search in the strand
-      auto curve = dynamic_cast<const shapes::cubic_bezier*>(result.object);
-      if (curve != nullptr) {
-        if (curve->hair_id != 0) {
-          bvh = &strand_bvh[curve->hair_id][curve->strand_id];
-        }
-      }
+      auto strand = dynamic_cast<const shapes::cubic_bezier*>(result.object);
+      if (strand != nullptr && strand->hair_id == 0) strand = nullptr;
 
       ray r_sss(r_next);
+      r_sss.mask = ray::SUBSURFACE;
 
       shape::intersect_result sss_result;
-      bvh->intersect(r_sss, params.intersect_options, &sss_result);
-
-      bool hit = false;
-      Float dist = volume->sample_distance(rng);
-      r_sss.t_max = dist;
-      while (true) {
-        // reset intersect result
-        sss_result = shape::intersect_result();
-
-        hit = bvh->intersect(r_sss, params.intersect_options, &sss_result);
-
-        if (++bounce > params.max_bounce) return sampled_spectrum(0);
-
-        sampled_spectrum tr = volume->transmittance(dist);
-        sampled_spectrum density = volume->density(tr, true);
-        Float p = volume->pdf(density);
-
-        if (COMPARE_EQ(p, 0)) return sampled_spectrum(0);
-        volume_weight *= volume->beta(tr, true) / p;
+      // strands are too thin for the dipole, they always walk
+      if (volume->walk == materials::sss::DIFFUSION && strand == nullptr) {
+        if (!sample_diffusion_exit(
+              &r_sss, &volume_weight, &sss_result, result, r, params, *volume, rng))
+        {
+          return sampled_spectrum(0);
+        }
+      } else {
+        r_sss.t_max = volume->sample_distance(rng);
+        while (true) {
+          // reset intersect result
+          sss_result = shape::intersect_result();
+
+          if (intersect_medium(r_sss, params, volume.get(), strand, &sss_result)) {
+            // the boundary comes before the next collision
+            volume_weight *= volume->escape_weight(sss_result.t_hit);
+            break;
+          }
 
-        if (hit) break; // break after last volume weight is contributed
+          const materials::sss::collision event =
+            volume->collide(&volume_weight, r_sss.t_max, rng);
+          if (event == materials::sss::ABSORB) return sampled_spectrum(0);
 
-        Float next_dist = volume->sample_distance(rng);
+          // null collisions carry on in the same direction and are not bounces
+          vector3f dir(r_sss.dir);
+          if (event == materials::sss::SCATTER) {
+            if (++bounce > params.max_bounce) return sampled_spectrum(0);
 
-        vector3f basis0, basis1;
-        sampler::sample_orthogonals(r_sss.dir, &basis0, &basis1, rng);
-        matrix3f prev_space(basis0, r_sss.dir, basis1);
-        vector3f dir(
-            prev_space.dot(-sampler::sample_henyey_greenstein(volume->g, rng.next_2uf()))
-            );
+            vector3f basis0, basis1;
+            sampler::sample_orthogonals(r_sss.dir, &basis0, &basis1, rng);
+            matrix3f prev_space(basis0, r_sss.dir, basis1);
+            dir = prev_space.dot(-sampler::sample_henyey_greenstein(volume->g, rng.next_2uf()));
+          }
 
-        r_sss = ray(
-            r_sss.origin + r_sss.dir * dist,
-            dir,
-            next_dist,
-            INSIDE);
-        dist = next_dist;
-      } /* while !hit */
+          r_sss = ray(
+              r_sss.origin + r_sss.dir * r_sss.t_max,
+              dir,
+              volume->sample_distance(rng),
+              INSIDE,
+              ray::SUBSURFACE);
+        } /* while !hit */
+      }
 
-      // ray comes out of medium
+      // ray comes out of medium where the walk met its boundary
       if (++bounce > params.max_bounce) return sampled_spectrum(0);
-      sss_result = shape::intersect_result();
       r_sss.t_max = r_next.t_max;
-      hit = intersect(r_sss, params.intersect_options, &sss_result);
-      if (!hit) return sampled_spectrum(0);
-      sampled_spectrum tr = volume->transmittance(sss_result.t_hit);
-      sampled_spectrum density = volume->density(tr, false);
-      Float p = volume->pdf(density);
-
-      if (COMPARE_EQ(p, 0)) return sampled_spectrum(0);
-      volume_weight *= volume->beta(tr, false) / p;
 
       next_lt = trace_bsdf(
-          &r_sss, &omega_in, &omega_out, &mf_normal, &omega_in_dl, &pdf, &pdf_dl, &direct_light,
+          &r_sss, &omega_in, &omega_out, &mf_normal, &pdf, &to_tangent_space,
           sss_result, params, r_sss, { material::REFRACT, INSIDE }, sample, rng
           );
 
       // outgoing btdf
-      estimate_radiance(&bxdf_radiance[1], &direct_radiance[1], params, omega_in, omega_out,
-          mf_normal, omega_in_dl, next_lt, result, pdf, pdf_dl);
+      estimate_radiance(&bxdf_radiance[1], omega_in, omega_out, mf_normal, next_lt, result, pdf);
+      const Float exit_throughput =
+        throughput * sampled_spectrum(volume_weight * bxdf_radiance[0]).luminance();
+      n_light_samples = light_samples(*result.object->surface, params, exit_throughput, rng);
+      direct_radiance[1] = estimate_direct(sss_result, result, params, r_sss, to_tangent_space,
+          omega_out, mf_normal, INSIDE, true, n_light_samples, sample, rng);
 
       Float old_t_max = r_next.t_max;
       r_next = r_sss;
@@ -304,11 +733,24 @@ namespace tracer {
       if (rng.next_uf() < rr_prob) return sampled_spectrum(0);
     }
 
-    // recursively trace next incident light
+    // recursively trace next incident light, samples without weight end the path here
+    const sampled_spectrum path_weight = bxdf_radiance[0] * bxdf_radiance[1];
+    sampled_spectrum indirect(0.f);
+    if (!path_weight.is_black()) {
+      indirect = path_weight * trace_path(
+          params,
+          r_next,
+          ds_estimated ? material::light_transport{ material::HAIR, next_lt.med } : next_lt,
+          sample,
+          rng,
+          bounce + 1,
+          result.object->surface->has_pdf() ? pdf / n_light_samples : -1,
+          throughput * sampled_spectrum(volume_weight * path_weight).luminance() / (1 - rr_prob)
+          );
+    }
     return (volume_weight / (1 - rr_prob)) * (result.object->surface->emittance
-        + (bxdf_radiance[0] * bxdf_radiance[1])
-        * trace_path(params, r_next, next_lt, sample, rng, bounce + 1)
-        + (direct_radiance[0] * direct_radiance[1]) * direct_light
+        + indirect
+        + direct_radiance[0] * direct_radiance[1]
         );
   } /* trace_path() */
 
@@ -348,7 +790,8 @@ namespace tracer {
           for (size_t subpixel = 0; subpixel < n_subpixels; ++subpixel) {
             sampled_spectrum color(0.0f);
             const point2f img_point(point2f(x, y) + img_point_offsets[subpixel]);
-            const ray r = camera->generate_ray(img_point).normalized();
+            ray r = camera->generate_ray(img_point).normalized();
+            r.mask = ray::CAMERA;
 
             sampler::sample_stratified_2d(
                 bsdf_samples,
@@ -364,7 +807,9 @@ namespace tracer {
                   { material::REFLECT, OUTSIDE },
                   bsdf_samples[s],
                   j.rng,
-                  0
+                  0,
+                  0,
+                  1
                   );
             }
 
@@ -462,10 +907,4 @@ namespace tracer {
   bool scene::rendering() const {
     return ird_rgb->size() > pixel_counter;
   }
-
-  scene::~scene() {
-    for (auto it = strand_bvh.begin(); it != strand_bvh.end(); ++it) {
-      delete[] it->second;
-    }
-  }
 } /* namespace tracer */
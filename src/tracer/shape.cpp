@@ -6,7 +6,7 @@
 namespace tracer {
 
   shape::shape(
-      const tf::transform& shape_to_world,
+      const tf::shared_transform& shape_to_world,
       const std::shared_ptr<material>& surface
       )
     : surface(surface),
@@ -18,8 +18,13 @@ namespace tracer {
     : surface(cpy.surface),
     tf_shape_to_world(cpy.tf_shape_to_world),
     tf_world_to_shape(cpy.tf_world_to_shape),
+    visibility(cpy.visibility),
     world_bounds_cached(cpy.world_bounds_cached) {}
 
+  bool shape::can_sample() const {
+    return false;
+  }
+
   point3f shape::sample(const point2f& u) const {
     ASSERT(false, "shape sampling function not implemented");
     return 0;
@@ -30,6 +35,37 @@ namespace tracer {
     return 0;
   }
 
+  point3f shape::sample_solid_angle(const point3f& ref, const point2f& u, Float* pdf) const {
+    const point3f p = sample(u);
+    const vector3f d = p - ref;
+    const Float dist = d.size();
+    *pdf = 0;
+    if (dist <= 0) return p;
+
+    // samples on the back are found behind the shape's front, the slack covers the error of
+    // intersecting the shape again
+    intersect_result hit;
+    const intersect_opts options;
+    const Float slack = 1e-3f * dist + options.bias_epsilon;
+    if (intersect(ray(ref, d / dist), options, &hit) && hit.t_hit > dist - slack) {
+      const Float cos_light = absdot(hit.normal, d / dist);
+      if (cos_light > 0) *pdf = this->pdf() * pow2(dist) / cos_light;
+    }
+    return p;
+  }
+
+  Float shape::pdf_solid_angle(const point3f& ref, const vector3f& dir) const {
+    intersect_result hit;
+    if (!intersect(ray(ref, dir), intersect_opts(), &hit)) return 0;
+    const Float cos_light = absdot(hit.normal, dir);
+    return cos_light > 0 ? pdf() * pow2(hit.t_hit) / cos_light : 0;
+  }
+
+  vector3f shape::normal_cone(Float* theta) const {
+    *theta = PI;
+    return vector3f(0, 1, 0);
+  }
+
   bounds3f shape::world_bounds_explicit() const {
     return tf_shape_to_world(bounds());
   }
@@ -46,7 +82,9 @@ namespace tracer {
       const intersect_opts& options,
       intersect_result* result) const
   {
-    const ray sray(tf_world_to_shape(r).normalized());
+    // translations keep the direction as is, no need to normalize it again
+    const ray sray(tf_world_to_shape.preserves_length() ?
+        tf_world_to_shape(r) : tf_world_to_shape(r).normalized());
     const bool hit = intersect_shape(sray, options, result);
     if (hit && result != nullptr) {
       const vector3f td = result->hit_point - r.origin;
@@ -59,7 +97,7 @@ namespace tracer {
   }
 
   destimator::destimator(
-      const tf::transform& shape_to_world,
+      const tf::shared_transform& shape_to_world,
       const std::shared_ptr<material>& surface
       )
     : shape(shape_to_world, surface) {}
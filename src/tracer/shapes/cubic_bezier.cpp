@@ -1,43 +1,32 @@
 #include "tracer/shapes/cubic_bezier.hpp"
-#include "math/sampler.hpp"
 
 namespace tracer {
   namespace shapes {
     cubic_bezier::cubic_bezier(
-        const tf::transform& shape_to_world,
+        const tf::shared_transform& shape_to_world,
         const std::shared_ptr<material>& surface,
         const point3f cps[4],
         Float thickness0,
         Float thickness1,
         const normal3f normal[4]
         ) :
-      shape(shape_to_world, surface),
+      shape(tf::shared_transform(), surface),
       thickness0(thickness0),
       thickness1(thickness1)
     {
-      control_points[0] = cps[0];
-      control_points[1] = cps[1];
-      control_points[2] = cps[2];
-      control_points[3] = cps[3];
+      // thickness is left as is, it is a world-space width just like on the Embree path
+      control_points[0] = shape_to_world(cps[0]);
+      control_points[1] = shape_to_world(cps[1]);
+      control_points[2] = shape_to_world(cps[2]);
+      control_points[3] = shape_to_world(cps[3]);
       if (normal) {
         vertex_normal = std::make_unique<normal3f[]>(4);
-        vertex_normal[0] = normal[0];
-        vertex_normal[1] = normal[1];
-        vertex_normal[2] = normal[2];
-        vertex_normal[3] = normal[3];
+        vertex_normal[0] = shape_to_world(normal[0]);
+        vertex_normal[1] = shape_to_world(normal[1]);
+        vertex_normal[2] = shape_to_world(normal[2]);
+        vertex_normal[3] = shape_to_world(normal[3]);
       }
-    }
-
-    bounds3f cubic_bezier::world_bounds_explicit() const {
-      point3f t_cps[4];
-      for (int i = 0; i < 4; ++i) {
-        t_cps[i] = tf_shape_to_world(control_points[i]);
-      }
-      return bounds3f(t_cps[0])
-        .merge(t_cps[1])
-        .merge(t_cps[2])
-        .merge(t_cps[3])
-        .expand(0.22 * std::max(thickness0, thickness1));
+      depth = wang_depth();
     }
 
     bounds3f cubic_bezier::bounds() const {
@@ -53,131 +42,156 @@ namespace tracer {
         const intersect_opts& options,
         intersect_result* result) const
     {
-      vector3f basis0, basis1;
-      random::rng rng;
-      sampler::sample_orthogonals(r.dir, &basis0, &basis1, rng);
-
-      if (COMPARE_EQ(std::abs(r.dir.dot(basis0)), 1)) std::swap(basis0, basis1);
-      if (COMPARE_EQ(std::abs(r.dir.dot(basis0)), 1)) return false;
-
-      const tf::transform proj(tf::look_at(r.origin + r.dir, r.origin, basis0).inverse());
-      const point3f cps[4] = {
-        proj(control_points[0]),
-        proj(control_points[1]),
-        proj(control_points[2]),
-        proj(control_points[3])
+      // project onto a ray-aligned frame where the ray starts at the origin and runs along +z,
+      // the frame follows from the direction alone (Duff et al. 2017)
+      const Float dir_len = r.dir.size();
+      const vector3f dz = r.dir / dir_len;
+      const Float sign = std::copysign(Float(1), dz.z);
+      const Float a = -1 / (sign + dz.z);
+      const Float b = dz.x * dz.y * a;
+      const vector3f dx(1 + sign * pow2(dz.x) * a, sign * b, -sign * dz.x);
+      const vector3f dy(b, sign + pow2(dz.y) * a, -dz.y);
+
+      struct segment {
+        Float x[4], y[4], z[4];
+        Float u_min, u_max;
+        int depth;
       };
 
-      normal3f normals[4];
-      if (vertex_normal != nullptr) {
-        normals[0] = proj(vertex_normal[0]);
-        normals[1] = proj(vertex_normal[1]);
-        normals[2] = proj(vertex_normal[2]);
-        normals[3] = proj(vertex_normal[3]);
-      }
-
-      result->t_hit = std::numeric_limits<Float>::max();
-      const bool hit = intersect_recursive(r, result, cps, normals, 0, 1, wang_depth(cps));
-      if (hit) {
-        point3f shape_hit_point = result->hit_point;
-        vector3f shape_xbasis   = evaluate_differential(result->uv[0], control_points);
-
-        result->hit_point = tf_shape_to_world(shape_hit_point);
-        result->xbasis = shape_xbasis.is_zero() ?
-          vector3f(1, 0, 0)
-          : tf_shape_to_world(shape_xbasis).normalized();
-
-        vector3f left = shape_hit_point.cross(shape_xbasis);
-        result->normal = tf_shape_to_world(
-            tf::rotate(shape_xbasis, PI_OVER_TWO)
-            (left.normalized())
-            );
-
-        if (r.medium == INSIDE) result->normal = -result->normal;
+      segment stack[MAX_DEPTH + 1];
+      int stack_size = 1;
+      for (int i = 0; i < 4; ++i) {
+        const vector3f p = control_points[i] - r.origin;
+        stack[0].x[i] = p.dot(dx);
+        stack[0].y[i] = p.dot(dy);
+        stack[0].z[i] = p.dot(dz);
       }
-      return hit;
-    }
-
-    bool cubic_bezier::intersect_recursive(
-        const ray& r,
-        intersect_result* result,
-        const point3f cps[4],
-        const normal3f normals[4],
-        Float u_min,
-        Float u_max,
-        int depth
-        ) const
-    {
-      const Float max_thickness = std::max(
-          math::lerp(u_min, thickness0, thickness1),
-          math::lerp(u_max, thickness0, thickness1));
-      const Float half_max_thickness = 0.5 * max_thickness;
-      const bounds3f curve_bounds = bounds3f(cps[0])
-        .merge(cps[1])
-        .merge(cps[2])
-        .merge(cps[3])
-        .expand(half_max_thickness);
-      if (!curve_bounds.intersect(ray({ 0, 0, 0 }, { 0, 0, 1 }, r.t_max)))
-        return false;
-
-      if (depth == 0) {
-        const vector3f dir = cps[3] - cps[0];
-        vector3f dp0 = cps[1] - cps[0];
-        vector3f dp3 = cps[3] - cps[2];
+      stack[0].u_min = 0;
+      stack[0].u_max = 1;
+      stack[0].depth = depth;
+
+      Float z_max = r.t_max * dir_len;
+      Float u_hit = 0, v_hit = 0;
+      bool hit = false;
+
+      while (stack_size > 0) {
+        const segment seg = stack[--stack_size];
+
+        if (seg.depth > 0) {
+          // halve with de Casteljau and cull both halves at once, lane 0 is the left half
+          segment half[2];
+          for (int l = 0; l < 2; ++l) {
+            half[l].depth = seg.depth - 1;
+          }
+          const Float u_mid = 0.5f * (seg.u_min + seg.u_max);
+          half[0].u_min = seg.u_min; half[0].u_max = u_mid;
+          half[1].u_min = u_mid;     half[1].u_max = seg.u_max;
+
+          const Float* const src[3] = { seg.x, seg.y, seg.z };
+          Float* const left[3]  = { half[0].x, half[0].y, half[0].z };
+          Float* const right[3] = { half[1].x, half[1].y, half[1].z };
+          for (int d = 0; d < 3; ++d) {
+            const Float a0 = 0.5f * (src[d][0] + src[d][1]);
+            const Float a1 = 0.5f * (src[d][1] + src[d][2]);
+            const Float a2 = 0.5f * (src[d][2] + src[d][3]);
+            const Float b0 = 0.5f * (a0 + a1);
+            const Float b1 = 0.5f * (a1 + a2);
+            const Float c  = 0.5f * (b0 + b1);
+            left[d][0]  = src[d][0]; left[d][1]  = a0; left[d][2]  = b0; left[d][3]  = c;
+            right[d][0] = c;         right[d][1] = b1; right[d][2] = a2; right[d][3] = src[d][3];
+          }
+
+          bool keep[2];
+          Float z_near[2];
+          for (int l = 0; l < 2; ++l) {
+            const Float half_thickness = 0.5f * std::max(
+                math::lerp(half[l].u_min, thickness0, thickness1),
+                math::lerp(half[l].u_max, thickness0, thickness1));
+            const segment& h = half[l];
+            const Float x_min = std::min(std::min(h.x[0], h.x[1]), std::min(h.x[2], h.x[3]));
+            const Float x_max = std::max(std::max(h.x[0], h.x[1]), std::max(h.x[2], h.x[3]));
+            const Float y_min = std::min(std::min(h.y[0], h.y[1]), std::min(h.y[2], h.y[3]));
+            const Float y_max = std::max(std::max(h.y[0], h.y[1]), std::max(h.y[2], h.y[3]));
+            const Float z_min = std::min(std::min(h.z[0], h.z[1]), std::min(h.z[2], h.z[3]));
+            const Float z_top = std::max(std::max(h.z[0], h.z[1]), std::max(h.z[2], h.z[3]));
+            keep[l] = x_min - half_thickness <= 0 && x_max + half_thickness >= 0
+              && y_min - half_thickness <= 0 && y_max + half_thickness >= 0
+              && z_min - half_thickness <= z_max && z_top + half_thickness >= 0;
+            z_near[l] = z_min - half_thickness;
+          }
+
+          // the nearer half goes on top so it shrinks z_max before the other one is tested
+          const int near = z_near[1] < z_near[0] ? 1 : 0;
+          if (keep[1 - near]) stack[stack_size++] = half[1 - near];
+          if (keep[near])     stack[stack_size++] = half[near];
+          continue;
+        }
+
+        const vector3f p0(seg.x[0], seg.y[0], seg.z[0]);
+        const vector3f p1(seg.x[1], seg.y[1], seg.z[1]);
+        const vector3f p2(seg.x[2], seg.y[2], seg.z[2]);
+        const vector3f p3(seg.x[3], seg.y[3], seg.z[3]);
+        const point3f cps[4] = { p0, p1, p2, p3 };
+
+        // the segment is flat enough to be treated as a line from p0 to p3
+        const vector3f dir = p3 - p0;
+        vector3f dp0 = p1 - p0;
+        vector3f dp3 = p3 - p2;
         if (dotproj(dp0, dir) < 0) dp0 = -dp0;
         if (dotproj(dp3, dir) < 0) dp3 = -dp3;
-        if (dotproj(dp0, -cps[0]) < 0) return false;
-        if (dotproj(dp3, cps[3]) < 0) return false;
+        if (dotproj(dp0, -p0) < 0) continue;
+        if (dotproj(dp3, p3) < 0) continue;
 
         Float w = pow2(dir.x) + pow2(dir.y);
-        if (COMPARE_EQ(w, 0)) return false;
-        w = math::clamp(-dotproj(cps[0], dir) / w, Float(0), Float(1));
+        if (COMPARE_EQ(w, 0)) continue;
+        w = math::clamp(-dotproj(p0, dir) / w, Float(0), Float(1));
 
         const point3f p = evaluate(w, cps);
-        const Float u = math::clamp(math::lerp(w, u_min, u_max), Float(0), Float(1));
+        const Float u = math::clamp(math::lerp(w, seg.u_min, seg.u_max), Float(0), Float(1));
         const Float half_thickness = 0.5f * math::lerp(u, thickness0, thickness1);
         const Float dist2 = pow2(p.x) + pow2(p.y);
-        if (dist2 > pow2(half_thickness) * 0.05f) return false;
+        if (dist2 > pow2(half_thickness) * 0.05f) continue;
 
-        // calculate t and normal
-        vector2f tangent(evaluate_differential(u, cps));
-        vector3f down(-tangent.y, tangent.x, 0);
+        const vector2f tangent(evaluate_differential(w, cps));
         const Float dist = std::sqrt(dist2);
         const Float inv_half_thickness = 1 / half_thickness;
-        Float v = tangent.x * -p.y + tangent.y * p.x > 0 ?
+        const Float v = math::clamp(tangent.x * -p.y + tangent.y * p.x > 0 ?
           0.5f + dist * inv_half_thickness     // upper
-          : 0.5f - dist * inv_half_thickness;  // lower
-        v = math::clamp(v, Float(0), Float(1));
+          : 0.5f - dist * inv_half_thickness,  // lower
+          Float(0), Float(1));
+
+        const Float z = r.medium == INSIDE ? p.z + half_thickness : p.z - half_thickness;
+        if (z < 0 || z > z_max) continue;
 
-        const Float offset = half_thickness; // * std::sin(math::lerp(v, 0, PI));
-        const Float t = r.medium == INSIDE ? p.z + offset : p.z - offset;
-        if (t < 0) return false;
+        z_max = z;
+        u_hit = u;
+        v_hit = v;
+        hit = true;
+      }
 
-        if (tangent.is_zero()) tangent = { 1, 0 };
+      if (hit && result != nullptr) {
+        const Float t = z_max / dir_len;
+        const point3f hit_point = r(t);
+        const vector3f xbasis = evaluate_differential(u_hit, control_points);
 
         result->object = this;
-        result->hit_point = r(t);
-        result->normal = down;
-        result->xbasis = tangent;
-        result->uv = { u, v };
-        return true;
-      }
+        result->t_hit = t;
+        result->uv = { u_hit, v_hit };
+        result->hit_point = tf_shape_to_world(hit_point);
+        result->xbasis = xbasis.is_zero() ?
+          vector3f(1, 0, 0)
+          : tf_shape_to_world(xbasis).normalized();
 
-      // recursively split the curve
-      const Float u_mid = (u_min + u_max) * 0.5f;
-      const point3f cp_split[7] = {
-        blossom({ 0, 0, 0 }, cps),
-        blossom({ 0, 0, 0.5 }, cps),
-        blossom({ 0, 0.5, 0.5 }, cps),
-        blossom({ 0.5, 0.5, 0.5 }, cps), // mutual control point
-        blossom({ 0.5, 0.5, 1 }, cps),
-        blossom({ 0.5, 1, 1 }, cps),
-        blossom({ 1, 1, 1 }, cps)
-      };
+        result->normal = xbasis.is_zero() ?
+          normal3f(0, 1, 0)
+          : tf_shape_to_world(
+              fiber_normal(u_hit, control_points, hit_point, xbasis.normalized(), r.dir)
+              );
 
-      return intersect_recursive(r, result, &cp_split[0], normals, u_min, u_mid, depth - 1)
-        || intersect_recursive(r, result, &cp_split[3], normals, u_mid, u_max, depth - 1);
-    } /* intersect_recursive() */
+        if (r.medium == INSIDE) result->normal = -result->normal;
+      }
+      return hit;
+    }
 
   } /* namespace shapes */
 } /* namespace tracer */
@@ -1,5 +1,6 @@
 #include "tracer/shapes/disk.hpp"
 #include "math/sampler.hpp"
+#include "math/util.hpp"
 
 namespace tracer {
   namespace shapes {
@@ -40,13 +41,33 @@ namespace tracer {
       return true;
     }
 
+    bool disk::can_sample() const {
+      return true;
+    }
+
     point3f disk::sample(const point2f& u) const {
-      point2f samp = sampler::sample_disk(u);
+      point2f samp = radius * sampler::sample_disk(u);
       return tf_shape_to_world(point3f(samp[0], 0, samp[1]));
     }
 
+    point3f disk::sample_solid_angle(const point3f& ref, const point2f& u, Float* pdf) const {
+      // a flat shape never hides its own points, the area sample converts without a ray
+      const point3f p = sample(u);
+      const vector3f d = p - ref;
+      const Float dist2 = d.size_sq();
+      const vector3f normal = tf_shape_to_world(normal3f(0, 1, 0)).normalized();
+      const Float cos_light = dist2 > 0 ? absdot(normal, d) / std::sqrt(dist2) : 0;
+      *pdf = cos_light > 0 ? this->pdf() * dist2 / cos_light : 0;
+      return p;
+    }
+
     Float disk::pdf() const {
       return INV_PI / pow2(radius);
     }
+
+    vector3f disk::normal_cone(Float* theta) const {
+      *theta = 0;
+      return tf_shape_to_world(normal3f(0, 1, 0)).normalized();
+    }
   }
 }
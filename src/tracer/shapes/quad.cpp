@@ -1,8 +1,12 @@
 #include "tracer/shapes/quad.hpp"
 #include "math/sampler.hpp"
+#include "math/util.hpp"
 
 #warning quad sampling only supports rectangular geometry
 
+// smaller rectangles are sampled by area, the spherical rectangle loses its precision
+static const Float MIN_SOLID_ANGLE = 3e-4f;
+
 namespace tracer {
   namespace shapes {
     quad::quad(
@@ -55,16 +59,83 @@ namespace tracer {
       return true;
     }
 
+    bool quad::can_sample() const {
+      return true;
+    }
+
     point3f quad::sample(const point2f& u) const {
-      Float w = b.x - d.x;
-      Float h = b.z - d.z;
-      return tf_shape_to_world(point3f(c.x + u[0] * w, 0, c.z + u[1] * h));
+      return tf_shape_to_world(a + u[0] * ab - u[1] * da);
     }
 
     Float quad::pdf() const {
-      Float w = b.x - d.x;
-      Float h = b.z - d.z;
-      return 1.f / (w * h);
+      return 1.f / (ab.size() * da.size());
+    }
+
+    Float quad::spherical_rectangle(const point3f& o, const point2f* u, point3f* p) const {
+      // frame of the rectangle spanned by ab and ad, with o at its origin and the rectangle
+      // below it
+      const Float ex = ab.size();
+      const Float ey = da.size();
+      const vector3f x = ab / ex;
+      const vector3f y = -da / ey;
+      vector3f z = x.cross(y);
+      const vector3f oa = a - o;
+      Float z0 = oa.dot(z);
+      if (z0 > 0) {
+        z = -z;
+        z0 = -z0;
+      }
+      if (COMPARE_EQ(z0, 0)) return 0;
+      const Float x0 = oa.dot(x), x1 = x0 + ex;
+      const Float y0 = oa.dot(y), y1 = y0 + ey;
+
+      // the solid angle follows from the angles between the planes through o and each edge
+      const vector3f v00(x0, y0, z0), v01(x0, y1, z0), v10(x1, y0, z0), v11(x1, y1, z0);
+      const vector3f n0 = v00.cross(v10).normalized();
+      const vector3f n1 = v10.cross(v11).normalized();
+      const vector3f n2 = v11.cross(v01).normalized();
+      const vector3f n3 = v01.cross(v00).normalized();
+      const Float g0 = std::acos(clamp(-n0.dot(n1), Float(-1), Float(1)));
+      const Float g1 = std::acos(clamp(-n1.dot(n2), Float(-1), Float(1)));
+      const Float g2 = std::acos(clamp(-n2.dot(n3), Float(-1), Float(1)));
+      const Float g3 = std::acos(clamp(-n3.dot(n0), Float(-1), Float(1)));
+      const Float k = TWO_PI - g2 - g3;
+      const Float solid_angle = g0 + g1 - k;
+      if (u == nullptr || !(solid_angle > 0)) return solid_angle;
+
+      // x from the fraction u.x of the solid angle, then y uniform in its projected height
+      const Float au = u->x * solid_angle + k;
+      const Float fu = (std::cos(au) * n0.z - n2.z) / std::sin(au);
+      const Float cu =
+        clamp(std::copysign(1 / std::sqrt(pow2(fu) + pow2(n0.z)), fu), Float(-1), Float(1));
+      const Float xu = clamp(-(cu * z0) / std::sqrt(std::max(Float(0), 1 - pow2(cu))), x0, x1);
+      const Float dist = std::sqrt(pow2(xu) + pow2(z0));
+      const Float h0 = y0 / std::sqrt(pow2(dist) + pow2(y0));
+      const Float h1 = y1 / std::sqrt(pow2(dist) + pow2(y1));
+      const Float hv = math::lerp(u->y, h0, h1);
+      const Float yv =
+        pow2(hv) < ONE_MINUS_FLOAT_TOLERANT ? hv * dist / std::sqrt(1 - pow2(hv)) : y1;
+      *p = o + xu * x + clamp(yv, y0, y1) * y + z0 * z;
+      return solid_angle;
+    }
+
+    point3f quad::sample_solid_angle(const point3f& ref, const point2f& u, Float* pdf) const {
+      point3f p;
+      const Float solid_angle = spherical_rectangle(tf_world_to_shape(ref), &u, &p);
+      if (!(solid_angle > MIN_SOLID_ANGLE)) return shape::sample_solid_angle(ref, u, pdf);
+      *pdf = 1 / solid_angle;
+      return tf_shape_to_world(p);
+    }
+
+    Float quad::pdf_solid_angle(const point3f& ref, const vector3f& dir) const {
+      const Float solid_angle = spherical_rectangle(tf_world_to_shape(ref), nullptr, nullptr);
+      if (!(solid_angle > MIN_SOLID_ANGLE)) return shape::pdf_solid_angle(ref, dir);
+      return intersect(ray(ref, dir), intersect_opts(), nullptr) ? 1 / solid_angle : 0;
+    }
+
+    vector3f quad::normal_cone(Float* theta) const {
+      *theta = 0;
+      return tf_shape_to_world(normal).normalized();
     }
   }
 }
@@ -41,6 +41,10 @@ namespace tracer {
       return true;
     }
 
+    bool sphere::can_sample() const {
+      return true;
+    }
+
     point3f sphere::sample(const point2f& u) const {
       return tf_shape_to_world(radius * sampler::sample_sphere(u));
     }
@@ -48,5 +52,57 @@ namespace tracer {
     Float sphere::pdf() const {
       return 0.25f * INV_PI / pow2(radius);
     }
+
+    Float sphere::cone_extent(const point3f& o) const {
+      const Float sin2_max = pow2(radius) / dot2(o);
+      // 1 - cos = sin^2 / (1 + cos) keeps small cones from cancelling out
+      return sin2_max / (1 + std::sqrt(std::max(Float(0), 1 - sin2_max)));
+    }
+
+    point3f sphere::sample_solid_angle(const point3f& ref, const point2f& u, Float* pdf) const {
+      const point3f o = tf_world_to_shape(ref);
+      const Float dc2 = dot2(o);
+      if (dc2 <= pow2(radius)) return shape::sample_solid_angle(ref, u, pdf);
+
+      // direction in the cone around the center, then the near point of the sphere along it
+      // (Shirley and Wang 1996)
+      const Float dc = std::sqrt(dc2);
+      const vector3f wc = -vector3f(o) / dc;
+      vector3f wx;
+      if (std::abs(wc.x) > std::abs(wc.y)) {
+        wx = vector3f(-wc.z, 0, wc.x) / std::sqrt(pow2(wc.x) + pow2(wc.z));
+      } else {
+        wx = vector3f(0, wc.z, -wc.y) / std::sqrt(pow2(wc.y) + pow2(wc.z));
+      }
+      const vector3f wy = wc.cross(wx);
+
+      const Float one_minus_cos_max = cone_extent(o);
+      const Float one_minus_cos = u.x * one_minus_cos_max;
+      const Float cos_theta = 1 - one_minus_cos;
+      const Float sin2_theta = one_minus_cos * (2 - one_minus_cos);
+      const Float ds =
+        dc * cos_theta - std::sqrt(std::max(Float(0), pow2(radius) - dc2 * sin2_theta));
+      const Float cos_alpha = clamp((dc2 + pow2(radius) - pow2(ds)) / (2 * dc * radius),
+          Float(-1), Float(1));
+      const Float sin_alpha = sin_from_cos(cos_alpha);
+      const Float phi = TWO_PI * u.y;
+      const vector3f n =
+        -(sin_alpha * std::cos(phi) * wx + sin_alpha * std::sin(phi) * wy + cos_alpha * wc);
+
+      *pdf = INV_TWO_PI / one_minus_cos_max;
+      return tf_shape_to_world(point3f(radius * n));
+    }
+
+    Float sphere::pdf_solid_angle(const point3f& ref, const vector3f& dir) const {
+      const point3f o = tf_world_to_shape(ref);
+      const Float dc2 = dot2(o);
+      if (dc2 <= pow2(radius)) return shape::pdf_solid_angle(ref, dir);
+
+      // sines stay accurate where 1 - cos would round to 0 for small cones
+      const vector3f wc = -vector3f(o) / std::sqrt(dc2);
+      const vector3f d = tf_world_to_shape(dir).normalized();
+      if (d.dot(wc) <= 0 || d.cross(wc).size_sq() > pow2(radius) / dc2) return 0;
+      return INV_TWO_PI / cone_extent(o);
+    }
   }
 }
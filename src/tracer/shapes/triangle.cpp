@@ -2,27 +2,164 @@
 
 namespace tracer {
   namespace shapes {
+    // Edge functions and scaled distance of the watertight test (Woop et al. 2013) in the
+    // sheared space where the ray runs along +z from the origin
+    template <typename T>
+    static void sheared_edges(
+        const watertight_ray& wr,
+        const point3f& o,
+        const point3f& a,
+        const point3f& b,
+        const point3f& c,
+        Float* u,
+        Float* v,
+        Float* w,
+        Float* t_scaled)
+    {
+      const T akz = T(a[wr.kz]) - o[wr.kz];
+      const T bkz = T(b[wr.kz]) - o[wr.kz];
+      const T ckz = T(c[wr.kz]) - o[wr.kz];
+      const T akx = T(a[wr.kx]) - o[wr.kx] - T(wr.sx) * akz;
+      const T aky = T(a[wr.ky]) - o[wr.ky] - T(wr.sy) * akz;
+      const T bkx = T(b[wr.kx]) - o[wr.kx] - T(wr.sx) * bkz;
+      const T bky = T(b[wr.ky]) - o[wr.ky] - T(wr.sy) * bkz;
+      const T ckx = T(c[wr.kx]) - o[wr.kx] - T(wr.sx) * ckz;
+      const T cky = T(c[wr.ky]) - o[wr.ky] - T(wr.sy) * ckz;
+
+      *u = ckx * bky - cky * bkx;
+      *v = akx * cky - aky * ckx;
+      *w = bkx * aky - bky * akx;
+      *t_scaled = T(wr.sz) * (T(*u) * akz + T(*v) * bkz + T(*w) * ckz);
+    }
+
+    // Edges shared by two triangles evaluate to exactly zero in float, those are re-evaluated
+    // in double so that neighbouring triangles never both miss a ray
+    static void sheared_edges(
+        const watertight_ray& wr,
+        const point3f& o,
+        const point3f& a,
+        const point3f& b,
+        const point3f& c,
+        Float* u,
+        Float* v,
+        Float* w,
+        Float* t_scaled)
+    {
+      sheared_edges<Float>(wr, o, a, b, c, u, v, w, t_scaled);
+      if (*u == 0 || *v == 0 || *w == 0)
+        sheared_edges<double>(wr, o, a, b, c, u, v, w, t_scaled);
+    }
+
+    static bool resolve_hit(
+        Float u,
+        Float v,
+        Float w,
+        Float t_scaled,
+        Float t_max,
+        Float* t,
+        Float* b1,
+        Float* b2)
+    {
+      if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+
+      const Float det = u + v + w;
+      if (det == 0) return false;
+
+      const Float inv_det = 1 / det;
+      const Float t_hit = t_scaled * inv_det;
+      if (t_hit <= 0 || t_hit > t_max) return false;
+
+      *t  = t_hit;
+      *b1 = v * inv_det;
+      *b2 = w * inv_det;
+      return true;
+    }
+
+    watertight_ray::watertight_ray(const ray& r) {
+      // the dominant axis becomes z, the winding is kept by swapping x and y on negative z
+      const vector3f abs_dir(std::abs(r.dir.x), std::abs(r.dir.y), std::abs(r.dir.z));
+      kz = abs_dir.x > abs_dir.y ? (abs_dir.x > abs_dir.z ? 0 : 2) : (abs_dir.y > abs_dir.z ? 1 : 2);
+      kx = (kz + 1) % 3;
+      ky = (kx + 1) % 3;
+      if (r.dir[kz] < 0) std::swap(kx, ky);
+
+      sz = 1 / r.dir[kz];
+      sx = r.dir[kx] * sz;
+      sy = r.dir[ky] * sz;
+    }
+
     triangle::triangle(
-        const tf::transform& shape_to_world,
+        const tf::shared_transform& shape_to_world,
         const std::shared_ptr<material>& surface,
         const point3f& a,
         const point3f& b,
         const point3f& c,
         const normal3f& normal
         )
-      : shape(shape_to_world, surface),
-      a(a), b(b), c(c), ab(b-a), bc(c-b), ca(a-c),
-      normal(normal.is_zero() ? normal3f((b-a).cross(a-c).normalized()) : normal) {}
+      : shape(tf::shared_transform(), surface),
+      world_a(shape_to_world(a)), world_b(shape_to_world(b)), world_c(shape_to_world(c)),
+      world_normal(shape_to_world(
+            normal.is_zero() ? normal3f((b-a).cross(a-c).normalized()) : normal
+            ).normalized()) {}
 
     bounds3f triangle::bounds() const {
-      return bounds3f(a).merge(bounds3f(b)).merge(bounds3f(c));
+      return bounds3f(world_a).merge(bounds3f(world_b)).merge(bounds3f(world_c));
+    }
+
+    bool triangle::can_sample() const {
+      return true;
+    }
+
+    point3f triangle::sample(const point2f& u) const {
+      // uniform barycentrics
+      const Float su = std::sqrt(u[0]);
+      const Float b1 = 1 - su, b2 = u[1] * su;
+      return point3f(
+          vector3f(world_a) * (1 - b1 - b2) + vector3f(world_b) * b1 + vector3f(world_c) * b2
+          );
+    }
+
+    Float triangle::pdf() const {
+      return 2 / (world_b - world_a).cross(world_c - world_a).size();
+    }
+
+    vector3f triangle::normal_cone(Float* theta) const {
+      *theta = 0;
+      return world_normal;
+    }
+
+    bool triangle::intersect(
+        const ray& r,
+        const intersect_opts& options,
+        intersect_result* result) const
+    {
+      const watertight_ray wr(r);
+      Float u, v, w, t_scaled;
+      sheared_edges(wr, r.origin, world_a, world_b, world_c, &u, &v, &w, &t_scaled);
+
+      Float t, b1, b2;
+      if (!resolve_hit(u, v, w, t_scaled, r.t_max, &t, &b1, &b2)) return false;
+
+      if (result != nullptr) fill_result(r, t, b1, b2, result);
+      return true;
     }
 
-    bounds3f triangle::world_bounds_explicit() const {
-      point3f ta = tf_shape_to_world(a);
-      point3f tb = tf_shape_to_world(b);
-      point3f tc = tf_shape_to_world(c);
-      return bounds3f(ta).merge(bounds3f(tb)).merge(bounds3f(tc));
+    void triangle::fill_result(
+        const ray& r,
+        Float t,
+        Float b1,
+        Float b2,
+        intersect_result* result) const
+    {
+      // interpolating the vertices keeps the hit point on the plane, unlike r(t)
+      result->t_hit = t;
+      result->hit_point = point3f(
+          vector3f(world_a) * (1 - b1 - b2) + vector3f(world_b) * b1 + vector3f(world_c) * b2
+          );
+      result->normal = (r.dir.dot(world_normal) < 0) ? world_normal : normal3f(-world_normal);
+      result->uv = { b1, b2 };
+      result->object = this;
+      if (r.medium == INSIDE) result->normal = -result->normal;
     }
 
     bool triangle::intersect_shape(
@@ -30,30 +167,103 @@ namespace tracer {
         const intersect_opts& options,
         intersect_result* result) const
     {
-      if (COMPARE_EQ(r.dir.dot(normal), 0)) return false; // ray is parallel to the plane
-
-      Float t = (a - r.origin).dot(normal) / r.dir.dot(normal);
-      if (t < 0) return false;
-
-      point3f p = r(t);
-      vector3f ap = p - a;
-      vector3f bp = p - b;
-      vector3f cp = p - c;
-
-      if ((ab.cross(ap).dot(normal) > 0)
-          || (bc.cross(bp).dot(normal) > 0)
-          || (ca.cross(cp).dot(normal) > 0)) return false;
-
-      if (result != nullptr) {
-        result->hit_point = tf_shape_to_world(p);
-        result->t_hit = t;
-        result->normal = tf_shape_to_world((r.dir.dot(normal) < 0) ? normal : normal3f(-normal))
-          .normalized();
-        result->object = this;
-        if (r.medium == INSIDE) result->normal = -result->normal;
+      // shape space is world space
+      return intersect(r, options, result);
+    }
+
+    triangle_packet::triangle_packet() {
+      // empty lanes hold degenerate triangles that are invisible to every ray
+      for (int i = 0; i < TRIANGLE_PACKET_WIDTH; ++i) {
+        ax[i] = ay[i] = az[i] = 0;
+        bx[i] = by[i] = bz[i] = 0;
+        cx[i] = cy[i] = cz[i] = 0;
+        visibility[i] = 0;
+        triangles[i] = nullptr;
+      }
+    }
+
+    bool triangle_packet::add(const triangle* tri) {
+      if (full()) return false;
+
+      const int i = n_triangles++;
+      ax[i] = tri->world_a.x; ay[i] = tri->world_a.y; az[i] = tri->world_a.z;
+      bx[i] = tri->world_b.x; by[i] = tri->world_b.y; bz[i] = tri->world_b.z;
+      cx[i] = tri->world_c.x; cy[i] = tri->world_c.y; cz[i] = tri->world_c.z;
+      visibility[i] = tri->visibility;
+      triangles[i] = tri;
+      return true;
+    }
+
+    bool triangle_packet::full() const {
+      return n_triangles == TRIANGLE_PACKET_WIDTH;
+    }
+
+    int triangle_packet::size() const {
+      return n_triangles;
+    }
+
+    int triangle_packet::nearest(const ray& r, Float* t, Float* b1, Float* b2) const {
+      const watertight_ray wr(r);
+      const Float* const a[3] = { ax, ay, az };
+      const Float* const b[3] = { bx, by, bz };
+      const Float* const c[3] = { cx, cy, cz };
+      const Float ox = r.origin[wr.kx], oy = r.origin[wr.ky], oz = r.origin[wr.kz];
+
+      // branch-free over all lanes so the compiler can keep the packet in vector registers
+      Float u[TRIANGLE_PACKET_WIDTH], v[TRIANGLE_PACKET_WIDTH], w[TRIANGLE_PACKET_WIDTH];
+      Float t_scaled[TRIANGLE_PACKET_WIDTH];
+      for (int i = 0; i < TRIANGLE_PACKET_WIDTH; ++i) {
+        const Float akz = a[wr.kz][i] - oz;
+        const Float bkz = b[wr.kz][i] - oz;
+        const Float ckz = c[wr.kz][i] - oz;
+        const Float akx = a[wr.kx][i] - ox - wr.sx * akz;
+        const Float aky = a[wr.ky][i] - oy - wr.sy * akz;
+        const Float bkx = b[wr.kx][i] - ox - wr.sx * bkz;
+        const Float bky = b[wr.ky][i] - oy - wr.sy * bkz;
+        const Float ckx = c[wr.kx][i] - ox - wr.sx * ckz;
+        const Float cky = c[wr.ky][i] - oy - wr.sy * ckz;
+
+        u[i] = ckx * bky - cky * bkx;
+        v[i] = akx * cky - aky * ckx;
+        w[i] = bkx * aky - bky * akx;
+        t_scaled[i] = wr.sz * (u[i] * akz + v[i] * bkz + w[i] * ckz);
       }
 
+      int hit_lane = -1;
+      Float t_nearest = r.t_max;
+      for (int i = 0; i < n_triangles; ++i) {
+        if ((visibility[i] & r.mask) == 0) continue;
+
+        if (u[i] == 0 || v[i] == 0 || w[i] == 0) {
+          const triangle* tri = triangles[i];
+          sheared_edges<double>(
+              wr, r.origin, tri->world_a, tri->world_b, tri->world_c,
+              &u[i], &v[i], &w[i], &t_scaled[i]
+              );
+        }
+
+        if (resolve_hit(u[i], v[i], w[i], t_scaled[i], t_nearest, t, b1, b2)) {
+          t_nearest = *t;
+          hit_lane = i;
+        }
+      }
+
+      if (hit_lane >= 0) *t = t_nearest;
+      return hit_lane;
+    }
+
+    bool triangle_packet::intersect(const ray& r, shape::intersect_result* result) const {
+      Float t, b1, b2;
+      const int lane = nearest(r, &t, &b1, &b2);
+      if (lane < 0) return false;
+
+      triangles[lane]->fill_result(r, t, b1, b2, result);
       return true;
     }
+
+    bool triangle_packet::occluded(const ray& r) const {
+      Float t, b1, b2;
+      return nearest(r, &t, &b1, &b2) >= 0;
+    }
   }
 }
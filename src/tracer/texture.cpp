@@ -1,5 +1,6 @@
 #include <iostream>
 #include <sstream>
+#include <vector>
 #include "tracer/texture.hpp"
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -37,6 +38,15 @@ namespace tracer {
 
     stbi_image_free(pixels);
 
+    std::vector<Float> weights(n_pixels);
+    for (int y = 0; y < height; ++y) {
+      const Float sin_theta = std::sin(PI * (y + 0.5f) / height);
+      for (int x = 0; x < width; ++x) {
+        weights[width * y + x] = spectrums[width * y + x].luminance() * sin_theta;
+      }
+    }
+    importance = math::distribution2d(weights.data(), width, height);
+
     std::wcout << L" done" << std::endl;
   }
 
@@ -79,4 +89,28 @@ namespace tracer {
     const Float phi   = reduce_angle(std::atan2(-sph_coords.z, sph_coords.x));
     return sample(point2f(phi * INV_TWO_PI, theta * INV_PI));
   }
+
+  bool texture::has_distribution() const {
+    return !importance.empty();
+  }
+
+  vector3f texture::sample_direction(const point2f& u, Float* pdf) const {
+    Float pdf_st;
+    const point2f st = importance.sample(u, &pdf_st);
+    const Float theta = st.y * PI;
+    const Float phi = st.x * TWO_PI;
+    const Float sin_theta = std::sin(theta);
+    // the inverse of the lookup in sample(), the texture spans 2 pi^2 sin(theta) per unit area
+    *pdf = sin_theta > 0 ? pdf_st / (2 * pow2(PI) * sin_theta) : 0;
+    return vector3f(sin_theta * std::cos(phi), std::cos(theta), -sin_theta * std::sin(phi));
+  }
+
+  Float texture::pdf(const vector3f& dir) const {
+    const Float theta = std::acos(clamp(dir.y, Float(-1), Float(1)));
+    const Float phi = reduce_angle(std::atan2(-dir.z, dir.x));
+    const Float sin_theta = std::sin(theta);
+    if (sin_theta <= 0) return 0;
+    return importance.pdf(point2f(phi * INV_TWO_PI, theta * INV_PI))
+      / (2 * pow2(PI) * sin_theta);
+  }
 }
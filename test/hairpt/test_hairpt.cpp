@@ -0,0 +1,343 @@
+#include <iostream>
+#include <cassert>
+#include <cmath>
+
+#include "tracer/materials/hairpt.hpp"
+#include "tracer/materials/ggx.hpp"
+#include "tracer/hair_shadow_grid.hpp"
+#include "math/random.hpp"
+#include "math/sampler.hpp"
+
+using namespace tracer;
+
+static const int N_SAMPLES = 200000;
+
+// Largest error of the table relative to the peak of the lobe, and the L1 error relative to the
+// L1 norm of the analytic values
+struct table_error {
+  Float max_rel_peak = 0;
+  Float l1_rel = 0;
+};
+
+table_error longitudinal_error(const materials::hairpt& mat, int lobe) {
+  random::rng rng(lobe);
+  table_error error;
+  Float peak = 0;
+  Float max_abs = 0;
+  double sum_abs = 0;
+  double sum_exact = 0;
+  for (int k = 0; k < N_SAMPLES; ++k) {
+    const Float sin_in = 2 * rng.next_uf() - 1;
+    // concentrate half the samples around the specular cone where the lobe peaks
+    const Float sin_out = k % 2 ?
+      2 * rng.next_uf() - 1
+      : math::clamp(-sin_in + 0.2f * (rng.next_uf() - 0.5f), -1.f, 1.f);
+    const Float exact = mat.lsdf(
+        sin_in, sin_out, cos_from_sin(sin_in), cos_from_sin(sin_out), mat.lobe_variance(lobe)
+        );
+    Float M[4];
+    mat.longitudinal(M, sin_in, sin_out);
+    const Float table = M[lobe];
+    peak = std::max(peak, exact);
+    max_abs = std::max(max_abs, std::abs(table - exact));
+    sum_abs += std::abs(table - exact);
+    sum_exact += exact;
+  }
+  error.max_rel_peak = max_abs / peak;
+  error.l1_rel = sum_abs / sum_exact;
+  return error;
+}
+
+table_error detector_error(const materials::hairpt& mat, int lobe) {
+  random::rng rng(16 + lobe);
+  table_error error;
+  Float peak = 0;
+  Float max_abs = 0;
+  double sum_abs = 0;
+  double sum_exact = 0;
+  for (int k = 0; k < N_SAMPLES; ++k) {
+    const Float phi = 4 * PI * rng.next_uf() - TWO_PI;
+    const Float gamma_o = PI * rng.next_uf() - PI_OVER_TWO;
+    const Float gamma_t = 0.5f * gamma_o;
+    const Float exact = mat.gaussian_detector(lobe, phi, gamma_o, gamma_t, mat.azimuthal_scale());
+    const Float table = mat.detector(lobe, phi, gamma_o, gamma_t);
+    peak = std::max(peak, exact);
+    max_abs = std::max(max_abs, std::abs(table - exact));
+    sum_abs += std::abs(table - exact);
+    sum_exact += exact;
+  }
+  error.max_rel_peak = max_abs / peak;
+  error.l1_rel = sum_abs / sum_exact;
+  return error;
+}
+
+// Largest error of the lobe probabilities, and the L1 error of the attenuation luminance
+table_error attenuation_error(const materials::hairpt& mat) {
+  random::rng rng(32);
+  table_error error;
+  Float max_prob = 0;
+  double sum_abs = 0;
+  double sum_exact = 0;
+  sampled_spectrum exact[4], table[4];
+  for (int k = 0; k < N_SAMPLES / 10; ++k) {
+    const Float sin_theta_out = 2 * rng.next_uf() - 1;
+    const Float h = 2 * rng.next_uf() - 1;
+    Float exact_prob[4], table_prob[4];
+    mat.exact_attenuation(exact, exact_prob, sin_theta_out, h);
+    mat.lobe_attenuation(table, table_prob, sin_theta_out, h);
+    for (int lobe = 0; lobe < 4; ++lobe) {
+      max_prob = std::max(max_prob, std::abs(table_prob[lobe] - exact_prob[lobe]));
+      sum_abs += std::abs(table[lobe].luminance() - exact[lobe].luminance());
+      sum_exact += exact[lobe].luminance();
+    }
+  }
+  error.max_rel_peak = max_prob;
+  error.l1_rel = sum_abs / sum_exact;
+  return error;
+}
+
+void test_tables(Float beta_m, Float beta_n) {
+  const materials::hairpt mat(
+      sampled_spectrum(0.5f), sampled_spectrum(0.f), 1.f, 1.55f, beta_m, beta_n, 0.035f
+      );
+  for (int lobe = 0; lobe < 4; ++lobe) {
+    const table_error error = longitudinal_error(mat, lobe);
+    assert(error.max_rel_peak < 0.02f);
+    assert(error.l1_rel < 0.015f);
+  }
+  for (int lobe = 0; lobe < 3; ++lobe) {
+    const table_error error = detector_error(mat, lobe);
+    assert(error.max_rel_peak < 0.01f);
+    assert(error.l1_rel < 0.005f);
+  }
+  // sampling and its pdf share the probabilities, their error only costs variance
+  const table_error error = attenuation_error(mat);
+  assert(error.max_rel_peak < 0.03f);
+  assert(error.l1_rel < 0.005f);
+}
+
+void test_smooth() {
+  test_tables(0.3f, 0.3f);
+}
+
+void test_rough() {
+  test_tables(0.8f, 0.8f);
+}
+
+void test_narrow() {
+  test_tables(0.08f, 0.1f);
+}
+
+// Integral of the multiple scattering estimate over all incident directions
+Float scattered_energy(const materials::hairpt& mat, const vector3f& omega_out, int n_occluders) {
+  static const int RES = 128;
+  double sum = 0;
+  for (int i = 0; i < RES; ++i) {
+    for (int j = 0; j < 2 * RES; ++j) {
+      const Float sin_theta = -1 + (i + 0.5f) * 2 / RES;
+      const Float cos_theta = cos_from_sin(sin_theta);
+      const Float phi = (j + 0.5f) * PI / RES;
+      const vector3f omega_in(sin_theta, cos_theta * std::cos(phi), cos_theta * std::sin(phi));
+      sum += mat.multiple_scattering(omega_in, omega_out, n_occluders).luminance();
+    }
+  }
+  return sum * (2.f / RES) * (PI / RES);
+}
+
+void test_dual_scattering() {
+  for (Float refl : { 0.9f, 0.5f, 0.1f }) {
+    materials::hairpt mat(
+        sampled_spectrum(refl), sampled_spectrum(0.f), 1.f, 1.55f, 0.3f, 0.3f, 0.035f
+        );
+    mat.enable_dual_scattering(0.7f, 0.7f);
+    assert(mat.dual_scattering());
+
+    for (const vector3f& omega_out : { vector3f(0, 1, 0), vector3f(0.5f, 0.866f, 0) }) {
+      Float prev = 1;
+      for (int n = 0; n <= 8; ++n) {
+        const Float energy = scattered_energy(mat, omega_out, n);
+        assert(energy >= 0 && energy < 1);
+        // light fades with every fiber it passes once it scatters forward
+        if (n > 1) assert(energy < prev);
+        prev = energy;
+      }
+    }
+  }
+}
+
+// Largest relative difference between the pdf sample() reports and pdf() for the same
+// direction, and the integral of pdf() over the sphere next to the fraction of samples that
+// were not discarded, which it has to match. uvw is passed to the material as mf_normal.
+struct pdf_error {
+  Float max_rel = 0;
+  Float integral = 0;
+  Float kept = 0;
+};
+
+pdf_error sample_pdf_error(
+    const material& mat,
+    const material::light_transport& lt,
+    bool upper_hemisphere,
+    const normal3f& uvw,
+    uint64_t seed)
+{
+  static const int N_DIRECTIONS = 16;
+  random::rng rng(seed);
+  pdf_error error;
+  for (int d = 0; d < N_DIRECTIONS; ++d) {
+    vector3f omega_out(math::sampler::sample_sphere(rng.next_2uf()));
+    if (upper_hemisphere) omega_out.y = std::abs(omega_out.y);
+
+    int n_kept = 0;
+    for (int k = 0; k < N_SAMPLES / N_DIRECTIONS; ++k) {
+      vector3f omega_in;
+      normal3f mf_normal = uvw;
+      Float pdf;
+      const point3f u(rng.next_uf(), rng.next_uf(), rng.next_uf());
+      const material::light_transport sampled =
+        mat.sample(&omega_in, &mf_normal, &pdf, omega_out, lt, u);
+      if (!(pdf > 0)) continue;
+      ++n_kept;
+      const Float eval = mat.pdf(omega_in, omega_out, uvw, sampled);
+      error.max_rel = std::max(error.max_rel, std::abs(eval - pdf) / pdf);
+    }
+
+    // the transport of a direction follows from its side of the surface
+    double integral = 0;
+    for (int k = 0; k < N_SAMPLES / N_DIRECTIONS; ++k) {
+      const vector3f omega_in(math::sampler::sample_sphere(rng.next_2uf()));
+      const bool same_side = omega_in.y * omega_out.y > 0;
+      const material::light_transport side = lt.transport == material::HAIR ? lt
+        : (same_side ?
+            material::light_transport{ material::REFLECT, lt.med }
+            : material::light_transport{ material::REFRACT, material::medium(lt.med ^ 1) });
+      integral += mat.pdf(omega_in, omega_out, uvw, side) * 4 * PI;
+    }
+    error.integral += integral / (N_SAMPLES / N_DIRECTIONS) / N_DIRECTIONS;
+    error.kept += Float(n_kept) / (N_SAMPLES / N_DIRECTIONS) / N_DIRECTIONS;
+  }
+  return error;
+}
+
+void test_hairpt_pdf() {
+  for (Float beta : { 0.3f, 0.8f }) {
+    const materials::hairpt mat(
+        sampled_spectrum(0.5f), sampled_spectrum(0.f), 1.f, 1.55f, beta, beta, 0.035f
+        );
+    for (Float h : { 0.1f, 0.5f, 0.9f }) {
+      const pdf_error error =
+        sample_pdf_error(mat, { material::HAIR, OUTSIDE }, false, normal3f(0.5f, h, 0), 64);
+      assert(error.max_rel < 1e-3f);
+      assert(std::abs(error.integral - error.kept) < 0.03f);
+    }
+  }
+}
+
+void test_ggx_pdf() {
+  for (Float roughness : { 0.5f, 0.8f }) {
+    const materials::ggx reflect(
+        sampled_spectrum(1.f), sampled_spectrum(0.f), sampled_spectrum(0.f), roughness, 1.f, 1.5f
+        );
+    const pdf_error refl_error =
+      sample_pdf_error(reflect, { material::REFLECT, OUTSIDE }, true, normal3f(0, 1, 0), 80);
+    assert(refl_error.max_rel < 1e-3f);
+    assert(std::abs(refl_error.integral - refl_error.kept) < 0.03f);
+
+    const materials::ggx glass(
+        sampled_spectrum(1.f), sampled_spectrum(1.f), sampled_spectrum(0.f), roughness, 1.f, 1.5f,
+        material::REFRACT
+        );
+    for (material::medium med : { OUTSIDE, INSIDE }) {
+      const pdf_error error =
+        sample_pdf_error(glass, { material::REFRACT, med }, true, normal3f(0, 1, 0), 96 + med);
+      assert(error.max_rel < 1e-3f);
+      assert(std::abs(error.integral - error.kept) < 0.03f);
+    }
+  }
+}
+
+// Mean optical depth of the grid over a horizontal square at height y
+Float mean_optical_depth(const hair_shadow_grid& grid, Float y) {
+  static const int RES = 20;
+  double sum = 0;
+  for (int i = 0; i < RES; ++i) {
+    for (int k = 0; k < RES; ++k) {
+      const point3f p(0.2f + 0.6f * i / (RES - 1), y, 0.2f + 0.6f * k / (RES - 1));
+      assert(grid.contains(p));
+      sum -= std::log(grid.transmittance(p));
+    }
+  }
+  return sum / pow2(RES);
+}
+
+// Randomly oriented straight fibers attenuate like a medium whose extinction is their mean
+// cross section per unit volume
+void test_shadow_grid() {
+  static const int N_FIBERS = 20000;
+  static const Float LENGTH = 0.1f;
+  static const Float RADIUS = 0.001f;
+
+  random::rng rng(48);
+  std::deque<primitive_arena<shapes::cubic_bezier>> curves(1);
+  const tf::shared_transform identity;
+  for (int i = 0; i < N_FIBERS; ++i) {
+    const vector3f dir(math::sampler::sample_sphere(rng.next_2uf()));
+    const point3f center(
+        0.5f * LENGTH + (1 - LENGTH) * rng.next_uf(),
+        0.5f * LENGTH + (1 - LENGTH) * rng.next_uf(),
+        0.5f * LENGTH + (1 - LENGTH) * rng.next_uf()
+        );
+    point3f cps[4];
+    for (int j = 0; j < 4; ++j) cps[j] = center + (j / 3.f - 0.5f) * LENGTH * dir;
+    curves[0].emplace(identity, nullptr, cps, RADIUS, RADIUS, nullptr);
+  }
+
+  hair_shadow_grid grid;
+  grid.build(curves, point3f(0.5f, 1000, 0.5f), 1.f / 64);
+
+  // the centers fill a smaller box, the density thins out towards its sides, so the extinction
+  // is compared between two heights well inside
+  const Float extinction = N_FIBERS * PI_OVER_TWO * RADIUS * LENGTH / pow3(1 - LENGTH);
+  const Float depth = mean_optical_depth(grid, 0.25f) - mean_optical_depth(grid, 0.75f);
+  assert(std::abs(depth - 0.5f * extinction) < 0.03f * 0.5f * extinction);
+
+  // light comes from above
+  Float prev = 0;
+  for (Float y = 0.1f; y < 0.95f; y += 0.1f) {
+    const Float transmittance = grid.transmittance(point3f(0.5f, y, 0.5f));
+    assert(transmittance > prev && transmittance <= 1);
+    prev = transmittance;
+  }
+
+  // a lit layer of fibers does not shadow itself, a stray fiber above keeps the grid tall
+  std::deque<primitive_arena<shapes::cubic_bezier>> layer(1);
+  for (int i = 0; i < 100; ++i) {
+    const Float y = i == 99 ? 0.5f : 0, z = 0.01f * i;
+    const point3f cps[4] = {
+      point3f(0, y, z), point3f(1 / 3.f, y, z), point3f(2 / 3.f, y, z), point3f(1, y, z)
+    };
+    layer[0].emplace(identity, nullptr, cps, 2 * RADIUS, 2 * RADIUS, nullptr);
+  }
+  hair_shadow_grid layer_grid;
+  layer_grid.build(layer, point3f(0.5f, 1000, 0.5f), 1.f / 64);
+  assert(layer_grid.transmittance(point3f(0.5f, 0, 0.5f)) > 0.99f);
+}
+
+void test_module(void fn(void), const std::string& module_name) {
+  std::cout << "> Testing " << module_name << "... " << std::flush;
+  fn();
+  std::cout << "PASSED" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  test_module(test_smooth, "smooth fibers");
+  test_module(test_rough, "rough fibers");
+  test_module(test_narrow, "narrow lobes");
+  test_module(test_dual_scattering, "dual scattering");
+  test_module(test_hairpt_pdf, "hairpt sampling pdf");
+  test_module(test_ggx_pdf, "ggx sampling pdf");
+  test_module(test_shadow_grid, "hair shadow grid");
+
+  std::cout << "> Congratulations! All tests passed!" << std::endl;
+  return 0;
+}